@@ -1,5 +1,8 @@
 # minply ビルドスクリプト
 # Visual Studio の開発環境を pwsh で有効化してコンパイルを実行
+# -SelfTest: 自己テスト用のコンソール版（out\selftest\minply.exe）のみをビルドする
+
+param([switch]$SelfTest)
 
 $ErrorActionPreference = "Stop"
 Set-Location $PSScriptRoot
@@ -36,6 +39,22 @@ Enter-VsDevShell -VsInstallPath $vsPath -SkipAutomaticLocation -DevCmdArguments
 
 New-Item -ItemType Directory -Path "out" -Force | Out-Null
 
+if ($SelfTest) {
+    Write-Host "Compiling src\minply.cpp (self-test)..." -ForegroundColor Cyan
+    New-Item -ItemType Directory -Path "out\selftest" -Force | Out-Null
+    cl /nologo /EHsc /O2 /MT /std:c++17 /W3 /utf-8 /DMINPLY_SELF_TEST `
+       /I"$vcpkgInclude" `
+       /Fo:out/selftest/ /Fe:out/selftest/minply.exe src\minply.cpp `
+       ole32.lib mfplat.lib mfreadwrite.lib mfuuid.lib `
+       "$vcpkgLib\opus.lib" "$vcpkgLib\ogg.lib" "$vcpkgLib\ebur128.lib" "$vcpkgLib\zlib.lib" `
+       /link /SUBSYSTEM:CONSOLE /ENTRY:wmainCRTStartup 2>&1 | Tee-Object -FilePath "out/selftest.log"
+    if ($LASTEXITCODE -ne 0) {
+        Write-Host "Self-test build failed" -ForegroundColor Red
+        exit 1
+    }
+    exit 0
+}
+
 Write-Host "Compiling resources..." -ForegroundColor Cyan
 
 rc /nologo /fo out\minply.res src\minply.rc 2>&1 | Tee-Object -FilePath "out/build.log"
@@ -50,7 +69,7 @@ cl /nologo /EHsc /O2 /MT /std:c++17 /W3 /utf-8 `
    /I"$vcpkgInclude" `
    /Fo:out/ /Fe:out/minply.exe src\minply.cpp out\minply.res `
    ole32.lib mfplat.lib mfreadwrite.lib mfuuid.lib `
-   "$vcpkgLib\opus.lib" "$vcpkgLib\ogg.lib" "$vcpkgLib\ebur128.lib" `
+   "$vcpkgLib\opus.lib" "$vcpkgLib\ogg.lib" "$vcpkgLib\ebur128.lib" "$vcpkgLib\zlib.lib" `
    /link /SUBSYSTEM:WINDOWS /ENTRY:wmainCRTStartup 2>&1 | Tee-Object -Append -FilePath "out/build.log"
 
 if ($LASTEXITCODE -ne 0) {
@@ -58,6 +77,21 @@ if ($LASTEXITCODE -ne 0) {
     exit 1
 }
 
+Write-Host "Compiling src\minply.cpp (DLL)..." -ForegroundColor Cyan
+
+# 同一ソースから in-process API（minply.h）をエクスポートする DLL をビルドする
+New-Item -ItemType Directory -Path "out\dll" -Force | Out-Null
+cl /nologo /EHsc /O2 /MT /std:c++17 /W3 /utf-8 /LD /DMINPLY_BUILD_DLL `
+   /I"$vcpkgInclude" `
+   /Fo:out/dll/ /Fe:out/minply.dll src\minply.cpp `
+   ole32.lib mfplat.lib mfreadwrite.lib mfuuid.lib `
+   "$vcpkgLib\opus.lib" "$vcpkgLib\ogg.lib" "$vcpkgLib\ebur128.lib" "$vcpkgLib\zlib.lib" 2>&1 | Tee-Object -Append -FilePath "out/build.log"
+
+if ($LASTEXITCODE -ne 0) {
+    Write-Host "DLL build failed" -ForegroundColor Red
+    exit 1
+}
+
 Write-Host ""
 Write-Host "Build successful" -ForegroundColor Green
-Get-Item out/minply.exe
+Get-Item out/minply.exe, out/minply.dll
@@ -4,11 +4,17 @@
  * Lightweight and fast audio player with BLE receiver lag compensation
  *
  * Usage:
- *   minply.exe [audio file path | -]
+ *   minply.exe [--timing] [--deadline <ms>] [--raw <fmt>:<rate>:<channels> | --framed | --tone <pattern>] [audio file path ... | -]
+ *
+ * The playback pipeline is also exposed as an in-process C API (see minply.h);
+ * minply.exe is a thin client of it, minply.dll exports it.
  *
  * Features:
  *   - Instantly plays MP3, WAV, AAC, FLAC, Opus and other audio files
  *   - Accepts audio data from stdin (no argument or - as argument)
+ *   - Streams headerless s16le/f32le PCM from stdin with --raw
+ *   - Plays many length-prefixed sounds from stdin in one process with --framed
+ *   - Synthesizes beeps and chimes without an input file with --tone
  *   - Plays inaudible 19kHz guard tone before/after audio (BLE anti-clipping)
  *   - Exits immediately after playback completes
  *
@@ -20,8 +26,14 @@
  *
  * Build:
  *   Visual Studio 2019 or later, Release configuration, x64
+ *   Define MINPLY_BUILD_DLL to build minply.dll instead of minply.exe
  */
 
+#ifndef MINPLY_BUILD_DLL
+#define MINPLY_STATIC
+#endif
+#include "minply.h"
+
 #include <windows.h>
 #include <mmdeviceapi.h>
 #include <audioclient.h>
@@ -40,13 +52,27 @@
 #include <cmath>
 #include <string>
 #include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <string_view>
+#include <unordered_map>
+#include <zlib.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <intrin.h>
 
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "mfplat.lib")
 #pragma comment(lib, "mfreadwrite.lib")
 #pragma comment(lib, "mfuuid.lib")
 #pragma comment(lib, "shlwapi.lib")
-// Note: opus.lib and ogg.lib are linked via build.ps1
+// Note: opus.lib, ogg.lib and zlib.lib are linked via build.ps1
 
 // Error codes
 #define EXIT_SUCCESS          0
@@ -56,6 +82,12 @@
 #define ERR_WASAPI_INIT       4
 #define ERR_PLAYBACK_FAILED   5
 
+// The C API reports the same codes as the process exit status
+static_assert(MINPLY_E_INVALID_ARG == ERR_INVALID_ARGS && MINPLY_E_FILE == ERR_FILE_NOT_FOUND &&
+              MINPLY_E_DECODE == ERR_DECODE_FAILED &&
+              MINPLY_E_DEVICE == ERR_WASAPI_INIT && MINPLY_E_PLAYBACK == ERR_PLAYBACK_FAILED,
+              "minply.h result codes must match exit codes");
+
 // Constants
 constexpr float LEAD_IN_DURATION = 1.2f;    // Lead-in duration in seconds; BLE wake-up (~700ms) + WASAPI session startup noise margin
 constexpr float LEAD_OUT_DURATION = 1.2f;   // Lead-out duration in seconds; keep BLE active until audio tail drains through SBC codec pipeline
@@ -66,6 +98,17 @@ constexpr float TWO_PI = 6.2831853f;        // 2π
 constexpr float LOUDNESS_TARGET = -16.0f;        // Target integrated loudness in LUFS (optimized for notification sounds)
 constexpr float LOUDNESS_PEAK_CEILING = 0.891f;  // True peak ceiling (-1dBFS); prevents clipping after loudness gain
 constexpr float LOUDNESS_MIN_PEAK = 1e-6f;       // Minimum peak threshold; skip normalization for near-silence
+constexpr float LOUDNESS_BLOCK_DURATION = 0.4f;  // BS.1770 gating block length in seconds
+constexpr float LOUDNESS_ABSOLUTE_GATE = -70.0f; // BS.1770 absolute gate in LUFS
+constexpr float LOUDNESS_RELATIVE_GATE = -10.0f; // BS.1770 relative gate in LU below the absolute-gated mean
+constexpr float LOUDNESS_CHUNK_DURATION = 1.0f;  // Feed granularity of exact measurement; bounds cancellation latency
+
+// Loudness estimation parameters (sampled gating blocks for long inputs)
+constexpr float  LOUDNESS_ESTIMATE_ERROR        = 0.5f;   // Default 95% confidence half-width in LU
+constexpr float  LOUDNESS_ESTIMATE_MIN_DURATION = 60.0f;  // Inputs shorter than this are always measured exactly
+constexpr float  LOUDNESS_ESTIMATE_WARMUP       = 0.05f;  // K-weighting filter settle time fed ahead of each sampled block
+constexpr size_t LOUDNESS_ESTIMATE_MIN_BLOCKS   = 32;     // Blocks sampled in the first round
+constexpr float  GAIN_RAMP_DURATION             = 0.5f;   // Ramp time when the refined gain replaces the estimate
 
 constexpr float FADE_DURATION = 0.005f;    // Fade in/out duration in seconds (click noise reduction)
 constexpr DWORD BUFFER_WAIT_MS = 100;      // Buffer wait time in milliseconds
@@ -73,6 +116,26 @@ constexpr DWORD DRAIN_WAIT_MS = 300;       // Wait time for device buffer drain
 constexpr DWORD DRAIN_POLL_MS = 10;        // Polling interval while draining the WASAPI buffer
 constexpr DWORD DRAIN_TIMEOUT_MS = 5000;   // Hard cap on drain polling to prevent infinite loops on stuck devices
 constexpr int   RENDER_MAX_STALL_ITERATIONS = 100;  // ~10s of consecutive WAIT_TIMEOUT wakeups (100 * BUFFER_WAIT_MS) before aborting
+constexpr float STREAM_GUARD_SLICE = 0.01f; // Guard tone rendered per wait while a stream has no data, in seconds
+constexpr float STREAM_RING_DURATION = 4.0f; // Converted stream audio buffered ahead of the renderer, in seconds
+constexpr unsigned long long FRAMED_MAX_BYTES = 256ull * 1024 * 1024;  // Largest --framed message; longer headers are invalid
+
+// WSOLA tempo stage parameters
+constexpr float  TEMPO_WINDOW       = 0.03f;   // Segment length in seconds; segments overlap by half
+constexpr float  TEMPO_SEARCH       = 0.01f;   // Largest shift of a segment from its nominal position, in seconds
+constexpr UINT32 TEMPO_COARSE_RATE  = 12000;   // Shifts tried by the coarse search per second of shift; refined at full rate
+constexpr float  TEMPO_MIN_DURATION = 5.0f;    // Default shortest input played at the configured tempo
+constexpr float  TEMPO_RENDER_BLOCK = 0.02f;   // Input stretched per step while a buffered sound plays, in seconds
+
+// Tone synthesizer parameters (--tone, minply_play_tone)
+constexpr UINT32 TONE_MAX_VOICES    = 4;       // Frequencies sounding together in one step
+constexpr size_t TONE_MAX_STEPS     = 1024;    // Steps after expanding repeats
+constexpr float  TONE_MAX_DURATION  = 30.0f;   // Longest pattern in seconds
+constexpr int    TONE_MAX_DEPTH     = 8;       // Nesting limit of parenthesized groups
+constexpr float  TONE_ATTACK        = 0.005f;  // Default attack in seconds
+constexpr float  TONE_RELEASE       = 0.02f;   // Default release in seconds
+constexpr float  TONE_BELL_DECAY    = 0.25f;   // Time constant of the bell envelope's decay as a fraction of the step
+constexpr size_t TONE_BLOCK_FRAMES  = 1024;    // Frames synthesized per block
 
 // PCM integer-to-float scale factors (2^(bits-1))
 constexpr float PCM16_SCALE = 32768.0f;        // 2^15
@@ -86,11 +149,72 @@ constexpr int  OPUS_MAX_CHANNELS    = 8;       // Upper bound used for Opus pcmB
 
 // WAV decoder parameters
 constexpr WORD WAV_MAX_CHANNELS     = 8;       // WAVEFORMATEX channel upper bound accepted by this decoder
+constexpr WORD WAV_FORMAT_MS_ADPCM   = 0x0002;  // WAVE_FORMAT_ADPCM
+constexpr WORD WAV_FORMAT_IMA_ADPCM  = 0x0011;  // WAVE_FORMAT_IMA_ADPCM / WAVE_FORMAT_DVI_ADPCM
+constexpr size_t ADPCM_PARALLEL_MIN_FRAMES = 48000 * 10;  // Shorter ADPCM data is decoded on the calling thread
+constexpr UINT32 ADPCM_MAX_THREADS         = 8;           // Upper bound on block-parallel decode workers
+constexpr size_t PCM_PARALLEL_MIN_FRAMES   = 48000 * 10;  // Shorter PCM is converted on the calling thread
+constexpr UINT32 PCM_MAX_THREADS           = 16;          // Upper bound on range-parallel PCM conversion workers
+
+// Cross-process renderer election parameters
+constexpr DWORD  SHARED_QUEUE_SLOTS       = 32;    // Pending handoffs the renderer can hold before clients fall back
+constexpr DWORD  SHARED_ITEM_NAME_LEN     = 64;    // wchar_t capacity of a per-item kernel object name
+constexpr DWORD  SHARED_ACK_TIMEOUT_MS    = 2000;  // Client wait for the renderer to take ownership of its item
+constexpr UINT32 SHARED_MAX_RATE          = 768000;   // Highest item sample rate the renderer accepts
+constexpr float  SHARED_MAX_GAIN          = 4096.0f;  // Highest item gain (+72 dB); clients above it play standalone
+constexpr DWORD  SHARED_LOCK_TIMEOUT_MS   = 1000;  // Upper bound on waiting for the queue lock
+
+// Playback session parameters
+constexpr size_t BUFFER_POOL_SIZE        = 4;                  // Processed-audio buffers kept for reuse
+constexpr size_t BUFFER_POOL_MAX_SAMPLES = 48000 * 2 * 30;     // Larger buffers are freed rather than pooled
 
 // I/O chunk sizes
-constexpr size_t STDIN_INITIAL_RESERVE = 1024 * 1024;  // Pre-reserve to avoid reallocation for typical notification sounds
+constexpr size_t STDIN_INITIAL_RESERVE = 1024 * 1024;  // First commit of the stdin buffer; covers typical notification sounds
+constexpr size_t STDIN_RESERVE         = static_cast<size_t>(MAXUINT) + 1 - 65536;  // Address space reserved for piped input (4GB cap, allocation-granular)
 constexpr size_t STDIN_READ_CHUNK      = 65536;
 constexpr size_t OGG_FEED_CHUNK        = 65536;
+constexpr size_t FRAME_HEADER_MAX      = 1024;   // Longest accepted --framed header line
+constexpr UINT32 LOAD_QUEUE_DEPTH      = 16;     // Files read concurrently when several inputs are given
+constexpr size_t READ_AHEAD_HEAD       = 65536;          // Read synchronously before decoding starts; covers every container header
+constexpr size_t READ_AHEAD_CHUNK      = 1024 * 1024;    // Size of each overlapped body read
+constexpr DWORD  READ_AHEAD_DEPTH      = 4;              // Body reads kept in flight
+constexpr size_t ZIP_INFLATE_BLOCK     = 65536;          // Inflated bytes published to the decoder at a time
+constexpr size_t ZIP_EOCD_SEARCH       = 22 + 65535;     // End of central directory record plus the longest comment
+constexpr size_t PLANAR_ALIGN          = 64;             // Byte alignment of each planar channel (one cache line)
+constexpr size_t CHAIN_BLOCK_BYTES     = 256 * 1024;     // Float source per block of the block chain; stays in L2
+
+// Polyphase resampler parameters
+constexpr UINT32 RESAMPLE_TAPS         = 64;     // Filter taps per output frame when upsampling; scaled by the ratio when downsampling
+constexpr UINT32 RESAMPLE_MAX_PHASES   = 1024;   // Reduced ratios needing more phases fall back to linear interpolation
+constexpr double RESAMPLE_CUTOFF       = 0.91;   // Passband edge as a fraction of the lower Nyquist frequency
+constexpr double RESAMPLE_KAISER_BETA  = 8.0;    // Kaiser window shape; about 80 dB stopband attenuation
+constexpr size_t RESAMPLE_PARALLEL_MIN_FRAMES = 48000 * 2;  // Shorter buffers are resampled on the calling thread
+constexpr UINT32 RESAMPLE_MAX_THREADS  = 16;     // Upper bound on output segments resampled in parallel
+
+// Processed-audio cache
+constexpr DWORD  AUDIO_CACHE_VERSION   = 3;      // Part of every key; bump when processing changes the output
+constexpr UINT32 RICE_BLOCK_FRAMES     = 4096;   // Frames per independently decodable Rice24 block
+constexpr UINT32 RICE_PARTITION        = 256;    // Residuals sharing one Rice parameter
+constexpr UINT32 RICE_ESCAPE           = 24;     // Unary quotient that switches to a raw 40-bit residual
+constexpr UINT32 RICE_MAX_ORDER        = 4;      // Highest fixed predictor order
+constexpr float  RICE_SCALE            = 8388608.0f;  // 2^23: one 24-bit step per 1/2^23 of full scale
+constexpr float  RICE_LIMIT            = 255.0f;      // Quantized range; keeps order-4 residuals within 40 bits
+constexpr size_t CACHE_PARALLEL_MIN_SAMPLES = 48000 * 2 * 5;  // Shorter sounds are coded on the calling thread
+constexpr UINT32 CACHE_MAX_THREADS     = 8;
+
+// Deadline degradation policy
+constexpr float  DEADLINE_MAX_MS       = 60000.0f;  // Upper bound of --deadline and [pipeline] deadline
+constexpr double DEADLINE_COST_WEIGHT  = 0.3;       // Weight of the newest run in each stage's moving-average cost
+constexpr double DEADLINE_HEADROOM     = 0.8;       // Share of the remaining budget predictions may fill; absorbs run-to-run noise
+constexpr size_t DEADLINE_MIN_SAMPLES  = 48000;     // Shorter stage runs are too noisy to update the costs
+constexpr size_t DEADLINE_GAIN_HISTORY = 256;       // Analysed gains remembered per session; forgotten together when full
+
+// On-disk encoding of cached processed audio
+enum class CacheEncoding : UINT32 {
+    Float32 = 1,      // Samples as rendered
+    Float16 = 2,      // IEEE binary16; half the size, ~-66 dB relative rounding error
+    Rice24  = 3,      // 24-bit fixed point, lossless fixed-order prediction + Rice coding
+};
 
 // Application configuration
 //
@@ -105,6 +229,63 @@ struct AppConfig {
     bool  loudnessEnabled     = true;
     float loudnessTarget      = LOUDNESS_TARGET;
     float loudnessPeakCeiling = LOUDNESS_PEAK_CEILING;
+    bool  loudnessEstimate    = false;
+    float loudnessEstimateError       = LOUDNESS_ESTIMATE_ERROR;
+    float loudnessEstimateMinDuration = LOUDNESS_ESTIMATE_MIN_DURATION;
+    bool  loudnessTrustMetadata = true;
+    bool  shareEnabled        = false;
+    bool  cacheEnabled        = false;
+    CacheEncoding cacheFormat = CacheEncoding::Float16;
+    bool  planarLayout        = false;
+    float deadlineMs          = 0.0f;   // Submission-to-playback budget; 0 disables degradation
+    float tempoRate           = 1.0f;   // Playback speed of the WSOLA tempo stage; 1 bypasses it
+    float tempoMinDuration    = TEMPO_MIN_DURATION;
+};
+
+// Render-side gain shared between the playback loop and background loudness refinement.
+// The render loop ramps towards target over GAIN_RAMP_DURATION whenever it changes; the ramp state
+// carries over between the Render calls that play one sound in steps.
+struct GainControl {
+    std::atomic<float> target{1.0f};
+    bool  started = false;     // Render thread only from here on
+    float current = 0.0f;
+    float rampTarget = 0.0f;
+    float rampStep = 0.0f;
+};
+
+// Per-stage wall-clock timing reported to stderr when --timing is given
+class StageTimer {
+public:
+    explicit StageTimer(bool enabled) : enabled_(enabled) {
+        QueryPerformanceFrequency(&freq_);
+        QueryPerformanceCounter(&origin_);
+        last_ = origin_;
+    }
+
+    bool Enabled() const { return enabled_; }
+
+    // Report time spent since the previous mark (or construction) under the given stage name.
+    // Safe to call from the session's worker and render threads.
+    void Mark(const char* stage) {
+        if (!enabled_) return;
+        std::lock_guard<std::mutex> guard(lock_);
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        std::cerr << "Timing: " << stage << " " << ToMs(now.QuadPart - last_.QuadPart)
+                  << " ms (total " << ToMs(now.QuadPart - origin_.QuadPart) << " ms)" << std::endl;
+        last_ = now;
+    }
+
+private:
+    double ToMs(LONGLONG ticks) const {
+        return static_cast<double>(ticks) * 1000.0 / static_cast<double>(freq_.QuadPart);
+    }
+
+    bool enabled_;
+    std::mutex lock_;
+    LARGE_INTEGER freq_;
+    LARGE_INTEGER origin_;
+    LARGE_INTEGER last_;
 };
 
 // Print error message to stderr
@@ -112,973 +293,6622 @@ void PrintError(const char* message) {
     std::cerr << "Error: " << message << std::endl;
 }
 
-// Get device mix format from WASAPI
-bool GetDeviceMixFormat(WAVEFORMATEX** mixFormat) {
-    HRESULT hr;
-    IMMDeviceEnumerator* enumerator = nullptr;
-    IMMDevice* device = nullptr;
-    IAudioClient* client = nullptr;
-    bool success = false;
+// Format-specialised sample kernels
+//
+// Conversion and fade are instantiated with the device channel count as a template argument so
+// the per-frame channel loop has a compile-time bound and fully unrolls. Channel counts that divide
+// the 4-lane SSE2 width (mono, stereo, quad) additionally process whole frames per vector.
+// Channels == 0 is the generic fallback with runtime-bounded loops. SelectKernels picks the
+// instantiation once per buffer, never per sample. The BLE guard is bound by sinf and the render
+// copy's settled path is already a flat vector multiply, so neither is specialised.
+template <UINT32 Channels>
+struct ChannelKernels {
+    // Frames that fit exactly into one __m128, or 0 when frames straddle vectors
+    static constexpr UINT32 FRAMES_PER_VECTOR = (Channels != 0 && 4 % Channels == 0) ? 4 / Channels : 0;
+
+    static UINT32 Count(UINT32 runtimeChannels) { return Channels ? Channels : runtimeChannels; }
+
+    // Linear-interpolation resample and channel map of output frames [dstFirst, dstLast), scaled by gain.
+    // Used for channel mapping at equal rates and for ratios PolyphaseResampler does not take.
+    // input holds source frames from srcFirst and output frames from dstFirst, so a block of the
+    // signal converts to exactly the frames a whole-buffer conversion gives; srcFrames is the total.
+    static void Convert(const float* input, size_t srcFirst, size_t srcFrames, UINT32 srcRate, UINT32 srcChannels,
+                        float* output, size_t dstFirst, size_t dstLast, UINT32 dstRate, UINT32 dstChannels,
+                        float gain) {
+        const UINT32 channels = Count(dstChannels);
+        for (size_t i = dstFirst; i < dstLast; i++) {
+            float srcIndex = static_cast<float>(i * srcRate) / dstRate;
+            size_t idx0 = static_cast<size_t>(srcIndex);
+            size_t idx1 = (std::min)(idx0 + 1, srcFrames - 1);
+            float frac = srcIndex - idx0;
+            const float* f0 = input + (idx0 - srcFirst) * srcChannels;
+            const float* f1 = input + (idx1 - srcFirst) * srcChannels;
+            float* out = output + (i - dstFirst) * channels;
+
+            for (UINT32 ch = 0; ch < channels; ch++) {
+                UINT32 srcCh = (std::min)(ch, srcChannels - 1);
+                float s0 = f0[srcCh];
+                float s1 = f1[srcCh];
+                out[ch] = (s0 + (s1 - s0) * frac) * gain;
+            }
+        }
+    }
 
-    do {
-        hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
-                              __uuidof(IMMDeviceEnumerator), (void**)&enumerator);
-        if (FAILED(hr)) break;
+    // Multiply frames [begin, end) by i / fadeFrames (fade in) or (totalFrames - i) / fadeFrames (fade out)
+    static void FadeRange(float* data, UINT32 begin, UINT32 end, UINT32 totalFrames, bool fadeOut,
+                          UINT32 fadeFrames, UINT32 runtimeChannels) {
+        const UINT32 channels = Count(runtimeChannels);
+        UINT32 i = begin;
+        if constexpr (FRAMES_PER_VECTOR > 0) {
+            for (; i + FRAMES_PER_VECTOR <= end; i += FRAMES_PER_VECTOR) {
+                alignas(16) float gains[4];
+                for (UINT32 lane = 0; lane < 4; lane++) {
+                    UINT32 frame = i + lane / Channels;
+                    gains[lane] = static_cast<float>(fadeOut ? totalFrames - frame : frame) / fadeFrames;
+                }
+                float* p = data + static_cast<size_t>(i) * Channels;
+                _mm_storeu_ps(p, _mm_mul_ps(_mm_loadu_ps(p), _mm_load_ps(gains)));
+            }
+        }
+        for (; i < end; i++) {
+            float gain = static_cast<float>(fadeOut ? totalFrames - i : i) / fadeFrames;
+            for (UINT32 ch = 0; ch < channels; ch++) {
+                data[static_cast<size_t>(i) * channels + ch] *= gain;
+            }
+        }
+    }
 
-        hr = enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device);
-        if (FAILED(hr)) break;
+    static void Fade(float* data, UINT32 totalFrames, UINT32 fadeFrames, UINT32 channels) {
+        FadeRange(data, 0, fadeFrames, totalFrames, false, fadeFrames, channels);
+        FadeRange(data, totalFrames - fadeFrames, totalFrames, totalFrames, true, fadeFrames, channels);
+    }
+};
 
-        hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)&client);
-        if (FAILED(hr)) break;
+// Kernel table for one channel count
+struct FormatKernels {
+    void (*convert)(const float*, size_t, size_t, UINT32, UINT32, float*, size_t, size_t, UINT32, UINT32, float);
+    void (*fade)(float*, UINT32, UINT32, UINT32);
+};
 
-        hr = client->GetMixFormat(mixFormat);
-        if (SUCCEEDED(hr)) {
-            success = true;
-        }
-    } while (false);
+template <UINT32 Channels>
+constexpr FormatKernels MakeKernels() {
+    return { &ChannelKernels<Channels>::Convert, &ChannelKernels<Channels>::Fade };
+}
 
-    if (client) client->Release();
-    if (device) device->Release();
-    if (enumerator) enumerator->Release();
+// Pick the kernels specialised for the given channel count, or the generic fallback
+const FormatKernels& SelectKernels(UINT32 channels) {
+    static constexpr FormatKernels generic = MakeKernels<0>();
+    static constexpr FormatKernels mono    = MakeKernels<1>();
+    static constexpr FormatKernels stereo  = MakeKernels<2>();
+    static constexpr FormatKernels quad    = MakeKernels<4>();
+    static constexpr FormatKernels surround51 = MakeKernels<6>();
+    static constexpr FormatKernels surround71 = MakeKernels<8>();
+    switch (channels) {
+        case 1:  return mono;
+        case 2:  return stereo;
+        case 4:  return quad;
+        case 6:  return surround51;
+        case 8:  return surround71;
+        default: return generic;
+    }
+}
 
-    return success;
+// Copy frames into the device buffer with gain, ramping gain towards target by step per frame.
+// Once the ramp has settled the copy is a flat vector multiply independent of channel layout.
+void ScaledCopy(float* dst, const float* src, UINT32 frames, UINT32 channels,
+                float& gain, float target, float step) {
+    UINT32 i = 0;
+    for (; i < frames && gain != target; i++) {
+        if (gain < target) gain = (std::min)(gain + step, target);
+        else               gain = (std::max)(gain - step, target);
+        for (UINT32 ch = 0; ch < channels; ch++) {
+            dst[i * channels + ch] = src[i * channels + ch] * gain;
+        }
+    }
+    size_t j = static_cast<size_t>(i) * channels;
+    size_t count = static_cast<size_t>(frames) * channels;
+    __m128 g = _mm_set1_ps(gain);
+    for (; j + 4 <= count; j += 4) {
+        _mm_storeu_ps(dst + j, _mm_mul_ps(_mm_loadu_ps(src + j), g));
+    }
+    for (; j < count; j++) {
+        dst[j] = src[j] * gain;
+    }
 }
 
-// Forward declaration
-std::vector<float> ConvertFormat(const std::vector<float>& input,
-                                 UINT32 srcRate, UINT32 srcChannels,
-                                 UINT32 dstRate, UINT32 dstChannels);
+// Decoder that produced a DecodedAudio
+enum class DecoderKind {
+    Wav,              // Native PCM/float WAV reader
+    WavAdpcm,         // Native IMA/MS ADPCM reader
+    Opus,             // libopus; always 48kHz at the stream's channel count
+    MediaFoundation,  // MF source reader; float at the stream's own rate and channel count
+};
 
-// Read WAV data from buffer (bypass MF resampling for matching formats)
-bool TryReadWavBuffer(const BYTE* data, size_t size, std::vector<float>& audioData,
-                     UINT32 targetSampleRate, UINT32 targetChannels) {
-    size_t pos = 0;
+// Loudness measured ahead of time and embedded in the file (BWF bext v2)
+struct LoudnessMetadata {
+    bool present = false;
+    double loudness = 0.0;        // Integrated loudness in LUFS
+    bool hasTruePeak = false;
+    float truePeak = 0.0f;        // Linear maximum true peak
+    UINT32 channels = 0;          // Channel count of the file the values were measured on
+};
 
-    // バッファから n バイトを dst にコピーして pos を進める
-    auto readBytes = [&](void* dst, size_t n) -> bool {
-        if (n > size - pos) return false;
-        memcpy(dst, data + pos, n);
-        pos += n;
+// Float PCM stored one channel after another (structure of arrays)
+//
+// Each channel starts on a PLANAR_ALIGN boundary, so per-channel stages (resampling, fade, peak)
+// walk contiguous aligned arrays instead of striding across interleaved frames. Frames past
+// Frames() up to the capacity are unspecified.
+class PlanarAudio {
+public:
+    PlanarAudio() = default;
+    PlanarAudio(PlanarAudio&&) = default;
+    PlanarAudio& operator=(PlanarAudio&&) = default;
+
+    UINT32 Channels() const { return channels_; }
+    size_t Frames() const { return frames_; }
+    bool Empty() const { return frames_ == 0; }
+    float* Channel(UINT32 ch) { return data_.get() + ch * stride_; }
+    const float* Channel(UINT32 ch) const { return data_.get() + ch * stride_; }
+
+    // Set the layout, keeping existing frames of each channel; false when allocation fails
+    bool Resize(UINT32 channels, size_t frames) {
+        if (channels != channels_ || frames > stride_) {
+            size_t stride = (std::max)({ frames, stride_ * 2, PLANAR_ALIGN / sizeof(float) });
+            stride = (stride + PLANAR_ALIGN / sizeof(float) - 1) / (PLANAR_ALIGN / sizeof(float)) * (PLANAR_ALIGN / sizeof(float));
+            float* data = static_cast<float*>(_aligned_malloc(stride * channels * sizeof(float), PLANAR_ALIGN));
+            if (!data) return false;
+            if (channels == channels_) {
+                for (UINT32 ch = 0; ch < channels; ch++) memcpy(data + ch * stride, Channel(ch), frames_ * sizeof(float));
+            }
+            data_.reset(data);
+            stride_ = stride;
+            channels_ = channels;
+        }
+        frames_ = frames;
         return true;
-    };
-    // バッファ上で n バイト前進する（読み捨て）
-    auto skipBytes = [&](size_t n) -> bool {
-        if (n > size - pos) return false;
-        pos += n;
+    }
+
+    // Append interleaved frames, splitting them into the channels
+    bool Append(const float* interleaved, size_t frames) {
+        size_t first = frames_;
+        if (!Resize(channels_, first + frames)) return false;
+        for (UINT32 ch = 0; ch < channels_; ch++) {
+            float* dst = Channel(ch) + first;
+            for (size_t i = 0; i < frames; i++) dst[i] = interleaved[i * channels_ + ch];
+        }
         return true;
+    }
+
+    // Write frames [first, first + frames) interleaved into output
+    void Interleave(size_t first, size_t frames, float* output) const {
+        if (channels_ == 2) {
+            const float* left = Channel(0) + first;
+            const float* right = Channel(1) + first;
+            size_t i = 0;
+            for (; i + 4 <= frames; i += 4) {
+                __m128 l = _mm_loadu_ps(left + i);
+                __m128 r = _mm_loadu_ps(right + i);
+                _mm_storeu_ps(output + i * 2, _mm_unpacklo_ps(l, r));
+                _mm_storeu_ps(output + i * 2 + 4, _mm_unpackhi_ps(l, r));
+            }
+            for (; i < frames; i++) {
+                output[i * 2] = left[i];
+                output[i * 2 + 1] = right[i];
+            }
+            return;
+        }
+        for (UINT32 ch = 0; ch < channels_; ch++) {
+            const float* src = Channel(ch) + first;
+            for (size_t i = 0; i < frames; i++) output[i * channels_ + ch] = src[i];
+        }
+    }
+
+private:
+    struct AlignedFree {
+        void operator()(float* p) const { _aligned_free(p); }
     };
 
-    char header[12];
-    if (!readBytes(header, 12)) return false;
-    if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) return false;
+    std::unique_ptr<float[], AlignedFree> data_;
+    size_t stride_ = 0;           // Floats from one channel to the next
+    size_t frames_ = 0;
+    UINT32 channels_ = 0;
+};
 
-    WAVEFORMATEXTENSIBLE fmt = {};
-    bool fmtFound = false;
-    while (true) {
-        char chunkId[4];
-        DWORD chunkSize;
-        if (!readBytes(chunkId, 4) || !readBytes(&chunkSize, 4)) break;
+class ReadAhead;
 
-        if (memcmp(chunkId, "fmt ", 4) == 0) {
-            if (chunkSize < 16) break;
-            BYTE fmtBuf[40] = {};
-            DWORD fmtReadSize = (std::min)(chunkSize, static_cast<DWORD>(40));
-            if (!readBytes(fmtBuf, fmtReadSize)) break;
-            memcpy(&fmt, fmtBuf, fmtReadSize);
-            fmtFound = true;
-            if (chunkSize > fmtReadSize && !skipBytes(chunkSize - fmtReadSize)) break;
-            break;
-        }
-        if (!skipBytes(chunkSize)) break;
-    }
-    if (!fmtFound) return false;
+// Which buffer the decoders fill
+enum class DecodeOutput {
+    Interleaved,      // DecodedAudio::samples
+    Planar,           // DecodedAudio::planar where supported (PCM WAV, Opus)
+    Blocks,           // DecodedAudio::pcm for PCM WAV; converted block by block while it is processed
+};
 
-    // Normalize WAVE_FORMAT_EXTENSIBLE to its underlying SubFormat tag so PCM/Float can share branches below
-    WORD actualFormatTag = fmt.Format.wFormatTag;
-    if (actualFormatTag == WAVE_FORMAT_EXTENSIBLE && fmt.Format.cbSize >= 22) {
-        actualFormatTag = *reinterpret_cast<const WORD*>(&fmt.SubFormat);
+// PCM left in place in the input by the native WAV reader
+//
+// Stages read it through ReadPcmFrames one block at a time, so a long file is never expanded into
+// a full-length float copy that every stage would stream through DRAM again.
+struct DeferredPcm {
+    const BYTE* data = nullptr;   // First frame
+    size_t offset = 0;            // Byte offset of data in the input, for read-ahead waits
+    size_t frames = 0;
+    UINT32 channels = 0;
+    UINT32 bits = 0;
+    bool isFloat = false;
+    const ReadAhead* pending = nullptr;
+};
+
+// Decoder output before device format conversion
+struct DecodedAudio {
+    std::vector<float> samples;   // Interleaved float PCM
+    PlanarAudio planar;           // Filled instead of samples when planar output was requested and supported
+    DeferredPcm pcm;              // Set instead of samples when block output was requested and supported
+    UINT32 sampleRate = 0;
+    UINT32 channels = 0;
+    DecoderKind decoder = DecoderKind::Wav;
+    LoudnessMetadata metadata;
+};
+
+// 64-bit hash of a byte range, eight bytes per multiply; keys the processed-audio cache
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0) {
+    const BYTE* bytes = static_cast<const BYTE*>(data);
+    uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ull);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
     }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+    return hash ^ (hash >> 33);
+}
 
-    if (actualFormatTag != WAVE_FORMAT_PCM && actualFormatTag != WAVE_FORMAT_IEEE_FLOAT) return false;
-    // Reject malformed headers that would later trigger divide-by-zero or oversized allocations
-    if (fmt.Format.nChannels == 0 || fmt.Format.nChannels > WAV_MAX_CHANNELS) return false;
-    if (fmt.Format.nSamplesPerSec == 0) return false;
-    if (fmt.Format.wBitsPerSample == 0 || (fmt.Format.wBitsPerSample % 8) != 0) return false;
-    if (fmt.Format.nSamplesPerSec != targetSampleRate) return false;
+// Identity of an open file that changes whenever its contents may have: volume, file index, size and
+// last write time. 0 when unavailable.
+uint64_t FileIdentity(HANDLE file) {
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(file, &info)) return 0;
+    DWORD fields[] = { info.dwVolumeSerialNumber, info.nFileIndexHigh, info.nFileIndexLow,
+                       info.nFileSizeHigh, info.nFileSizeLow,
+                       info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime };
+    return HashBytes(fields, sizeof(fields));
+}
 
-    // Find data chunk (rescan from offset 12)
-    pos = 12;
-    DWORD dataSize = 0;
-    bool dataFound = false;
-    while (true) {
-        char chunkId[4];
-        DWORD chunkSize;
-        if (!readBytes(chunkId, 4) || !readBytes(&chunkSize, 4)) break;
+// Zip sound pack mapped read-only, with its central directory indexed by entry name
+//
+// The index holds views of the names inside the mapping, so building it copies nothing; lookups
+// hash the requested name once instead of comparing it against every entry. ZIP64 archives and
+// encrypted entries are not supported (sound packs stay far below the 4GB zip32 limits).
+class ZipArchive {
+public:
+    struct Entry {
+        WORD method = 0;                 // 0 = stored, 8 = deflated
+        WORD flags = 0;
+        DWORD crc = 0;
+        DWORD compressedSize = 0;
+        DWORD uncompressedSize = 0;
+        DWORD localHeader = 0;
+    };
 
-        if (memcmp(chunkId, "data", 4) == 0) {
-            dataSize = chunkSize;
-            dataFound = true;
-            break;
+    ZipArchive() = default;
+    ZipArchive(const ZipArchive&) = delete;
+    ZipArchive& operator=(const ZipArchive&) = delete;
+
+    ~ZipArchive() {
+        if (view_) UnmapViewOfFile(view_);
+        if (mapping_) CloseHandle(mapping_);
+    }
+
+    // Map the archive and index its central directory; exit code with message set on failure
+    int Open(const wchar_t* path, const char*& message) {
+        HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            message = "File not found";
+            return ERR_FILE_NOT_FOUND;
         }
-        if (!skipBytes(chunkSize)) break;
+        int result = EXIT_SUCCESS;
+        do {
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0 || fileSize.QuadPart > MAXDWORD) {
+                message = "Invalid zip archive";
+                result = ERR_DECODE_FAILED;
+                break;
+            }
+            mapping_ = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_) view_ = static_cast<const BYTE*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            if (!view_) {
+                message = "Failed to read file";
+                result = ERR_FILE_NOT_FOUND;
+                break;
+            }
+            size_ = static_cast<size_t>(fileSize.QuadPart);
+            identity_ = FileIdentity(file);
+            if (!Index()) {
+                message = "Invalid zip archive";
+                result = ERR_DECODE_FAILED;
+            }
+        } while (false);
+        // The mapping keeps the file open on its own
+        CloseHandle(file);
+        return result;
     }
-    if (!dataFound || dataSize == 0) return false;
-    if (dataSize > size - pos) return false;
 
-    UINT32 bytesPerSample = fmt.Format.wBitsPerSample / 8;
-    UINT32 totalSamples = dataSize / bytesPerSample;
-    audioData.resize(totalSamples);
+    uint64_t Identity() const { return identity_; }
 
-    const BYTE* rawData = data + pos;
+    const Entry* Find(std::string_view name) const {
+        auto it = index_.find(name);
+        return it == index_.end() ? nullptr : &it->second;
+    }
 
-    if (actualFormatTag == WAVE_FORMAT_IEEE_FLOAT && fmt.Format.wBitsPerSample == 32) {
-        memcpy(audioData.data(), rawData, dataSize);
+    // Locate an entry's data through its local header; nullptr unless the header and data both lie
+    // before the central directory, where every local record of a well-formed archive is
+    const BYTE* EntryData(const Entry& entry) const {
+        size_t pos = entry.localHeader;
+        if (pos > cdOffset_ || cdOffset_ - pos < 30 || Read32(pos) != 0x04034b50) return nullptr;
+        pos += 30 + static_cast<size_t>(Read16(pos + 26)) + Read16(pos + 28);
+        if (pos > cdOffset_ || cdOffset_ - pos < entry.compressedSize) return nullptr;
+        return view_ + pos;
     }
-    else if (actualFormatTag == WAVE_FORMAT_PCM) {
-        if (fmt.Format.wBitsPerSample == 16) {
-            const int16_t* samples = reinterpret_cast<const int16_t*>(rawData);
-            for (UINT32 i = 0; i < totalSamples; i++) {
-                audioData[i] = static_cast<float>(samples[i]) / PCM16_SCALE;
-            }
-        }
-        else if (fmt.Format.wBitsPerSample == 24) {
-            // Build via uint32_t to keep the left-shifts well-defined, then arithmetic-shift back to sign-extend.
-            // (Shifting a signed int into the sign bit is UB even though MSVC tolerates it.)
-            for (UINT32 i = 0; i < totalSamples; i++) {
-                uint32_t u =  static_cast<uint32_t>(rawData[i * 3])      << 8
-                           | static_cast<uint32_t>(rawData[i * 3 + 1]) << 16
-                           | static_cast<uint32_t>(rawData[i * 3 + 2]) << 24;
-                int32_t sample = static_cast<int32_t>(u) >> 8;
-                audioData[i] = static_cast<float>(sample) / PCM24_SCALE;
+
+private:
+    WORD Read16(size_t pos) const { return static_cast<WORD>(view_[pos] | (view_[pos + 1] << 8)); }
+    DWORD Read32(size_t pos) const { return Read16(pos) | (static_cast<DWORD>(Read16(pos + 2)) << 16); }
+
+    bool Index() {
+        // The end of central directory record is the last signature within the trailing comment window
+        if (size_ < 22) return false;
+        size_t eocd = SIZE_MAX;
+        size_t lowest = size_ > ZIP_EOCD_SEARCH ? size_ - ZIP_EOCD_SEARCH : 0;
+        for (size_t pos = size_ - 22; ; pos--) {
+            if (Read32(pos) == 0x06054b50) {
+                eocd = pos;
+                break;
             }
+            if (pos == lowest) break;
         }
-        else if (fmt.Format.wBitsPerSample == 32) {
-            const int32_t* samples = reinterpret_cast<const int32_t*>(rawData);
-            for (UINT32 i = 0; i < totalSamples; i++) {
-                audioData[i] = static_cast<float>(samples[i]) / PCM32_SCALE;
-            }
+        if (eocd == SIZE_MAX) return false;
+
+        WORD entryCount = Read16(eocd + 10);
+        size_t cdSize = Read32(eocd + 12);
+        size_t cdOffset = Read32(eocd + 16);
+        if (cdOffset > eocd || eocd - cdOffset < cdSize) return false;
+        cdOffset_ = cdOffset;
+
+        // Walk the directory by size rather than trusting the 16-bit count, which wraps past 65535
+        index_.reserve(entryCount);
+        size_t pos = cdOffset, end = cdOffset + cdSize;
+        while (end - pos >= 46) {
+            if (Read32(pos) != 0x02014b50) return false;
+            size_t nameLength = Read16(pos + 28);
+            size_t recordSize = 46 + nameLength + Read16(pos + 30) + Read16(pos + 32);
+            if (end - pos < recordSize) return false;
+
+            Entry entry;
+            entry.flags = Read16(pos + 8);
+            entry.method = Read16(pos + 10);
+            entry.crc = Read32(pos + 16);
+            entry.compressedSize = Read32(pos + 20);
+            entry.uncompressedSize = Read32(pos + 24);
+            entry.localHeader = Read32(pos + 42);
+            std::string_view name(reinterpret_cast<const char*>(view_ + pos + 46), nameLength);
+            index_.emplace(name, entry);
+            pos += recordSize;
         }
-        else {
-            return false;
+        return true;
+    }
+
+    HANDLE mapping_ = nullptr;
+    const BYTE* view_ = nullptr;
+    size_t size_ = 0;
+    size_t cdOffset_ = 0;                // Start of the central directory; local records lie below it
+    uint64_t identity_ = 0;
+    std::unordered_map<std::string_view, Entry> index_;
+};
+
+// Split "pack.zip:path/in/zip" into the archive path and the UTF-8 entry name
+//
+// The archive part must end in ".zip"; backslashes in the entry name become the '/' zip uses.
+bool ParseZipSpec(const wchar_t* spec, std::wstring& archive, std::string& entry) {
+    const wchar_t* split = nullptr;
+    for (const wchar_t* p = spec; *p; p++) {
+        if (*p == L':' && p - spec >= 4 && _wcsnicmp(p - 4, L".zip", 4) == 0 && p[1] != L'\0') {
+            split = p;
         }
     }
-    else {
-        return false;
+    if (!split) return false;
+
+    int length = WideCharToMultiByte(CP_UTF8, 0, split + 1, -1, nullptr, 0, nullptr, nullptr);
+    if (length <= 1) return false;
+    entry.resize(static_cast<size_t>(length));
+    WideCharToMultiByte(CP_UTF8, 0, split + 1, -1, &entry[0], length, nullptr, nullptr);
+    entry.pop_back();
+    std::replace(entry.begin(), entry.end(), '\\', '/');
+    archive.assign(spec, split);
+    return true;
+}
+
+// File read in the background while it is being decoded
+//
+// Open reads the first READ_AHEAD_HEAD bytes synchronously so the decoder can be chosen and set up
+// straight away; a reader thread then streams the rest through READ_AHEAD_DEPTH overlapped reads.
+// Reads complete into one file-sized buffer, and the decoders call Ensure before touching bytes past
+// the prefix known to be resident, so they consume the body as it arrives.
+// A "pack.zip:path/in/zip" path plays an archive entry instead: stored entries are used in place in
+// the archive mapping, and deflated ones are inflated by the same thread in ZIP_INFLATE_BLOCK steps.
+class ReadAhead {
+public:
+    ReadAhead() = default;
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    ~ReadAhead() {
+        if (reader_.joinable()) {
+            cancelled_ = true;
+            if (file_ != INVALID_HANDLE_VALUE) CancelIoEx(file_, nullptr);
+            reader_.join();
+        }
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        if (inflating_) inflateEnd(&inflater_);
     }
 
-    // Channel conversion (e.g. mono -> stereo)
-    if (fmt.Format.nChannels != targetChannels) {
-        audioData = ConvertFormat(audioData, targetSampleRate, fmt.Format.nChannels,
-                                  targetSampleRate, targetChannels);
+    // Open the file or archive entry and read its head; returns EXIT_SUCCESS or an exit code with
+    // message set, matching what a whole-file read reports
+    int Open(const wchar_t* path, const char*& message) {
+        QueryPerformanceCounter(&opened_);
+        std::wstring archivePath;
+        std::string entryName;
+        if (ParseZipSpec(path, archivePath, entryName)) return OpenEntry(archivePath.c_str(), entryName, message);
+
+        file_ = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            message = "File not found";
+            return ERR_FILE_NOT_FOUND;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file_, &fileSize)) {
+            message = "Failed to read file";
+            return ERR_FILE_NOT_FOUND;
+        }
+        identity_ = FileIdentity(file_);
+        if (fileSize.QuadPart == 0) {
+            message = "File is empty";
+            return ERR_FILE_NOT_FOUND;
+        }
+        // Same 4GB cap as LoadFile
+        if (fileSize.QuadPart > MAXDWORD) {
+            message = "File too large";
+            return ERR_DECODE_FAILED;
+        }
+        buffer_.resize(static_cast<size_t>(fileSize.QuadPart));
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+
+        size_t head = (std::min)(READ_AHEAD_HEAD, buffer_.size());
+        if (!ReadAt(0, head)) {
+            message = "Failed to read file";
+            return ERR_FILE_NOT_FOUND;
+        }
+        available_ = head;
+        if (head < buffer_.size()) reader_ = std::thread(&ReadAhead::ReaderMain, this);
+        return EXIT_SUCCESS;
     }
 
-    return true;
-}
+    const BYTE* Data() const { return data_; }
+    size_t Size() const { return size_; }
 
-// Convert audio format (resampling and channel conversion)
-std::vector<float> ConvertFormat(const std::vector<float>& input,
-                                 UINT32 srcRate, UINT32 srcChannels,
-                                 UINT32 dstRate, UINT32 dstChannels) {
-    if (input.empty() || srcRate == 0 || dstRate == 0 || srcChannels == 0 || dstChannels == 0) {
-        return {};
+    // Identifies the opened file or entry version without hashing its contents; 0 when unknown
+    uint64_t Identity() const { return identity_; }
+
+    // Block until the first end bytes are resident; false when the read failed before reaching them
+    bool Ensure(size_t end) const {
+        if (available_.load(std::memory_order_acquire) >= end) return true;
+        std::unique_lock<std::mutex> guard(lock_);
+        arrived_.wait(guard, [&]() { return available_ >= end || failed_; });
+        return available_ >= end;
     }
-    if (srcRate == dstRate && srcChannels == dstChannels) {
-        return input;
+
+    // Whether the first end bytes are already resident, without waiting
+    bool Resident(size_t end) const {
+        return available_.load(std::memory_order_acquire) >= end;
     }
 
-    size_t srcFrames = input.size() / srcChannels;
-    if (srcFrames == 0) return {};
-    size_t dstFrames = static_cast<size_t>((static_cast<uint64_t>(srcFrames) * dstRate) / srcRate);
-    std::vector<float> output(dstFrames * dstChannels);
+    bool Failed() const {
+        std::lock_guard<std::mutex> guard(lock_);
+        return failed_;
+    }
 
-    for (size_t i = 0; i < dstFrames; i++) {
-        float srcIndex = static_cast<float>(i * srcRate) / dstRate;
-        size_t idx0 = static_cast<size_t>(srcIndex);
-        size_t idx1 = (std::min)(idx0 + 1, srcFrames - 1);
-        float frac = srcIndex - idx0;
+    // Record when the decoder produced its first block; later calls are ignored
+    void MarkDecoded() const {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        LONGLONG expected = 0;
+        firstDecoded_.compare_exchange_strong(expected, now.QuadPart);
+    }
 
-        for (UINT32 ch = 0; ch < dstChannels; ch++) {
-            UINT32 srcCh = (std::min)(ch, srcChannels - 1);
-            float s0 = input[idx0 * srcChannels + srcCh];
-            float s1 = input[idx1 * srcChannels + srcCh];
-            output[i * dstChannels + ch] = s0 + (s1 - s0) * frac;
-        }
+    // Milliseconds from Open to the first decoded block; negative if none was recorded
+    double OpenToFirstBlockMs() const {
+        LONGLONG decoded = firstDecoded_.load();
+        if (decoded == 0) return -1.0;
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        return static_cast<double>(decoded - opened_.QuadPart) * 1000.0 / static_cast<double>(freq.QuadPart);
     }
 
-    return output;
-}
+private:
+    int OpenEntry(const wchar_t* archivePath, const std::string& entryName, const char*& message) {
+        archive_ = std::make_unique<ZipArchive>();
+        int result = archive_->Open(archivePath, message);
+        if (result != EXIT_SUCCESS) return result;
 
-// Decode Opus/Ogg data from buffer (.opus and .ogg Opus)
-bool TryDecodeOpusBuffer(const BYTE* data, size_t size, std::vector<float>& audioData,
-                         UINT32 targetSampleRate, UINT32 targetChannels) {
-    ogg_sync_state   oy;
-    ogg_stream_state os;
-    ogg_page         og;
-    ogg_packet       op;
+        const ZipArchive::Entry* entry = archive_->Find(entryName);
+        if (!entry) {
+            message = "Entry not found in archive";
+            return ERR_FILE_NOT_FOUND;
+        }
+        const BYTE* stored = archive_->EntryData(*entry);
+        if (!stored) {
+            message = "Invalid zip archive";
+            return ERR_DECODE_FAILED;
+        }
+        // Bit 0 marks an encrypted entry
+        if ((entry->flags & 1) != 0 || (entry->method != 0 && entry->method != 8) ||
+            entry->compressedSize == MAXDWORD || entry->uncompressedSize == MAXDWORD) {
+            message = "Unsupported zip entry";
+            return ERR_DECODE_FAILED;
+        }
+        if (entry->uncompressedSize == 0) {
+            message = "File is empty";
+            return ERR_FILE_NOT_FOUND;
+        }
+        if (archive_->Identity() != 0) {
+            DWORD fields[] = { entry->crc, entry->compressedSize, entry->uncompressedSize, entry->localHeader };
+            identity_ = HashBytes(entryName.data(), entryName.size(), HashBytes(fields, sizeof(fields), archive_->Identity()));
+        }
 
-    ogg_sync_init(&oy);
-    bool streamInitialized = false;
-    OpusDecoder* decoder = nullptr;
-    int opusChannels = 0;
-    std::vector<float> decodedFloat;
-    // Heap-allocated PCM scratch buffer; stack allocation would consume ~180KB and risk overflow on deep call stacks
-    std::vector<float> pcmBuffer(static_cast<size_t>(OPUS_MAX_FRAME_SIZE) * OPUS_MAX_CHANNELS);
-    int packetCount = 0;
+        if (entry->method == 0) {
+            if (entry->compressedSize != entry->uncompressedSize) {
+                message = "Invalid zip archive";
+                return ERR_DECODE_FAILED;
+            }
+            data_ = stored;
+            size_ = entry->uncompressedSize;
+            available_ = size_;
+            return EXIT_SUCCESS;
+        }
 
-    // Feed entire buffer in chunks; ogg_sync_buffer reallocs are expensive for large single allocations
-    size_t offset = 0;
-    while (offset < size) {
-        size_t toWrite = (std::min)(OGG_FEED_CHUNK, size - offset);
-        char* buf = ogg_sync_buffer(&oy, static_cast<long>(toWrite));
-        if (!buf) break;
-        memcpy(buf, data + offset, toWrite);
-        ogg_sync_wrote(&oy, static_cast<long>(toWrite));
-        offset += toWrite;
+        // The head is inflated before returning, like a file's head is read, so dispatch can look at it
+        buffer_.resize(entry->uncompressedSize);
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        if (inflateInit2(&inflater_, -MAX_WBITS) != Z_OK) {
+            message = "Failed to read file";
+            return ERR_FILE_NOT_FOUND;
+        }
+        inflating_ = true;
+        expectedCrc_ = entry->crc;
+        crc_ = crc32(0, Z_NULL, 0);
+        inflater_.next_in = const_cast<Bytef*>(stored);
+        inflater_.avail_in = entry->compressedSize;
+        if (!InflateTo((std::min)(READ_AHEAD_HEAD, size_))) {
+            message = "Invalid zip archive";
+            return ERR_DECODE_FAILED;
+        }
+        if (available_ < size_) reader_ = std::thread(&ReadAhead::InflaterMain, this);
+        return EXIT_SUCCESS;
     }
 
-    // Opus stream structure: packet 1 = OpusHead, packet 2 = OpusTags, packet 3+ = audio data
-    while (ogg_sync_pageout(&oy, &og) == 1) {
-        if (!streamInitialized) {
-            if (ogg_stream_init(&os, ogg_page_serialno(&og)) != 0) {
-                ogg_sync_clear(&oy);
-                return false;
+    // Inflate up to end, publishing each ZIP_INFLATE_BLOCK as it is produced; false on a corrupt stream.
+    // The entry's last block is published only once the CRC of the whole entry matches, so a decoder
+    // waiting for it sees a failed read instead of corrupt data.
+    bool InflateTo(size_t end) {
+        size_t produced = available_.load();
+        while (produced < end && !cancelled_) {
+            size_t block = (std::min)(ZIP_INFLATE_BLOCK, end - produced);
+            inflater_.next_out = buffer_.data() + produced;
+            inflater_.avail_out = static_cast<uInt>(block);
+            int status = inflate(&inflater_, Z_NO_FLUSH);
+            size_t inflated = block - inflater_.avail_out;
+            crc_ = crc32(crc_, buffer_.data() + produced, static_cast<uInt>(inflated));
+            produced += inflated;
+            if (produced == size_ && crc_ != expectedCrc_) return false;
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                available_.store(produced, std::memory_order_release);
             }
-            streamInitialized = true;
+            arrived_.notify_all();
+            if (status != Z_OK && status != Z_STREAM_END) return false;
+            if (status == Z_STREAM_END && produced < size_) return false;
         }
-        ogg_stream_pagein(&os, &og);
+        return produced >= end;
+    }
 
-        while (ogg_stream_packetout(&os, &op) == 1) {
-            packetCount++;
+    // Inflate the rest of a zip entry in the background
+    void InflaterMain() {
+        bool failed = !InflateTo(size_);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            failed_ = failed;
+        }
+        arrived_.notify_all();
+    }
 
-            if (packetCount == 1) {
-                // OpusHead packet carries channel count and reserves the codec context for audio packets
-                if (op.bytes >= 19 && memcmp(op.packet, "OpusHead", 8) == 0) {
-                    opusChannels = op.packet[9];
-                    // Channel mapping family != 0 needs opus_multistream_decoder; reject and limit family 0 to mono/stereo per RFC 7845
-                    int channelMappingFamily = op.packet[18];
-                    if (channelMappingFamily != 0 || opusChannels < 1 || opusChannels > 2) {
-                        if (streamInitialized) ogg_stream_clear(&os);
-                        ogg_sync_clear(&oy);
-                        return false;
-                    }
-                    int error;
-                    decoder = opus_decoder_create(OPUS_OUTPUT_RATE, opusChannels, &error);
-                    if (error != OPUS_OK || !decoder) {
-                        if (streamInitialized) ogg_stream_clear(&os);
-                        ogg_sync_clear(&oy);
-                        return false;
-                    }
-                }
-                else {
-                    if (decoder) opus_decoder_destroy(decoder);
-                    if (streamInitialized) ogg_stream_clear(&os);
-                    ogg_sync_clear(&oy);
-                    return false;
+    // Synchronous read of one range through the overlapped handle
+    bool ReadAt(size_t offset, size_t length) {
+        OVERLAPPED ov = {};
+        ov.Offset = static_cast<DWORD>(offset);
+        ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!ov.hEvent) return false;
+        DWORD got = 0;
+        bool ok = (ReadFile(file_, buffer_.data() + offset, static_cast<DWORD>(length), nullptr, &ov) ||
+                   GetLastError() == ERROR_IO_PENDING) &&
+                  GetOverlappedResult(file_, &ov, &got, TRUE) && got == length;
+        CloseHandle(ov.hEvent);
+        return ok;
+    }
+
+    // Keep READ_AHEAD_DEPTH reads in flight and publish completions in file order. Reads are awaited
+    // oldest first, so the resident prefix advances exactly as each one lands.
+    void ReaderMain() {
+        OVERLAPPED ov[READ_AHEAD_DEPTH] = {};
+        HANDLE events[READ_AHEAD_DEPTH] = {};
+        size_t starts[READ_AHEAD_DEPTH] = {};
+        size_t lengths[READ_AHEAD_DEPTH] = {};
+        bool failed = false;
+        for (DWORD i = 0; i < READ_AHEAD_DEPTH; i++) {
+            events[i] = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            if (!events[i]) failed = true;
+        }
+
+        size_t next = available_.load();
+        DWORD oldest = 0, inFlight = 0;
+        while (!failed) {
+            while (inFlight < READ_AHEAD_DEPTH && next < buffer_.size() && !cancelled_) {
+                DWORD slot = (oldest + inFlight) % READ_AHEAD_DEPTH;
+                ov[slot] = {};
+                ov[slot].Offset = static_cast<DWORD>(next);
+                ov[slot].hEvent = events[slot];
+                starts[slot] = next;
+                lengths[slot] = (std::min)(READ_AHEAD_CHUNK, buffer_.size() - next);
+                if (!ReadFile(file_, buffer_.data() + next, static_cast<DWORD>(lengths[slot]), nullptr, &ov[slot]) &&
+                    GetLastError() != ERROR_IO_PENDING) {
+                    failed = true;
+                    break;
                 }
+                next += lengths[slot];
+                inFlight++;
             }
-            else if (packetCount == 2) {
-                // OpusTags (metadata) - intentionally skipped
-                continue;
+            if (failed || inFlight == 0) break;
+
+            DWORD got = 0;
+            bool ok = GetOverlappedResult(file_, &ov[oldest], &got, TRUE) && got == lengths[oldest];
+            size_t end = starts[oldest] + lengths[oldest];
+            oldest = (oldest + 1) % READ_AHEAD_DEPTH;
+            inFlight--;
+            if (!ok || cancelled_) {
+                failed = true;
+                break;
             }
-            else {
-                if (decoder) {
-                    int frameSize = opus_decode_float(decoder, op.packet, op.bytes,
-                                                      pcmBuffer.data(), OPUS_MAX_FRAME_SIZE, 0);
-                    if (frameSize > 0) {
-                        size_t sampleCount = static_cast<size_t>(frameSize) * opusChannels;
-                        decodedFloat.insert(decodedFloat.end(),
-                                            pcmBuffer.data(), pcmBuffer.data() + sampleCount);
-                    }
-                }
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                available_.store(end, std::memory_order_release);
             }
+            arrived_.notify_all();
+        }
+
+        // Reads still in flight target the buffer; wait them out before returning
+        if (inFlight > 0) CancelIoEx(file_, nullptr);
+        for (; inFlight > 0; inFlight--) {
+            DWORD got = 0;
+            GetOverlappedResult(file_, &ov[oldest], &got, TRUE);
+            oldest = (oldest + 1) % READ_AHEAD_DEPTH;
+        }
+        for (HANDLE event : events) {
+            if (event) CloseHandle(event);
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            failed_ = failed || available_ < buffer_.size();
         }
+        arrived_.notify_all();
     }
 
-    if (decoder) opus_decoder_destroy(decoder);
-    if (streamInitialized) ogg_stream_clear(&os);
-    ogg_sync_clear(&oy);
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    std::unique_ptr<ZipArchive> archive_;
+    std::vector<BYTE> buffer_;               // File or inflated entry contents; unused for stored entries
+    const BYTE* data_ = nullptr;
+    size_t size_ = 0;
+    uint64_t identity_ = 0;
+    z_stream inflater_ = {};                 // Deflated entries; reads the stream inside the archive mapping
+    bool inflating_ = false;
+    uLong crc_ = 0;                         // CRC-32 of the inflated prefix
+    DWORD expectedCrc_ = 0;                 // From the central directory
+    std::thread reader_;
+    std::atomic<bool> cancelled_{false};
+    std::atomic<size_t> available_{0};      // Resident prefix of buffer_
+    mutable std::mutex lock_;
+    mutable std::condition_variable arrived_;
+    bool failed_ = false;
+    LARGE_INTEGER opened_ = {};
+    mutable std::atomic<LONGLONG> firstDecoded_{0};
+};
+
+// Wait for input bytes a decoder is about to read; always true for fully resident input
+bool EnsureInput(const ReadAhead* pending, size_t end) {
+    return !pending || pending->Ensure(end);
+}
+
+// Whether input bytes up to end can be read without waiting; always true for fully resident input
+bool InputResident(const ReadAhead* pending, size_t end) {
+    return !pending || pending->Resident(end);
+}
 
-    if (decodedFloat.empty()) return false;
+// Note the first decoded block of input that is still being read
+void MarkDecoded(const ReadAhead* pending) {
+    if (pending) pending->MarkDecoded();
+}
 
-    audioData = ConvertFormat(decodedFloat, OPUS_OUTPUT_RATE, opusChannels,
-                              targetSampleRate, targetChannels);
+// Read the EBU Tech 3285 v2 loudness fields of a RIFF/WAVE 'bext' chunk
+//
+// Walks chunk headers only, so it also covers WAV files that end up decoded by Media Foundation.
+// Input that is still being read is walked only as far as it is resident: chunks before 'data'
+// are there once the header has been parsed, and a trailing 'bext' is picked up only when the
+// body has already arrived, so the scan never holds the decoded audio back.
+// LoudnessValue and MaxTruePeakLevel are stored as 0.01 LU / 0.01 dB steps; 0x7FFF marks an unset
+// field, and version 0/1 chunks have no loudness fields at all.
+bool ReadWavLoudnessMetadata(const BYTE* data, size_t size, LoudnessMetadata& metadata,
+                             const ReadAhead* pending = nullptr) {
+    constexpr size_t BEXT_VERSION_OFFSET = 346;      // After Description .. TimeReference
+    constexpr size_t BEXT_LOUDNESS_OFFSET = 412;     // After Version and the 64-byte UMID
+    constexpr size_t BEXT_TRUE_PEAK_OFFSET = 416;    // After LoudnessValue and LoudnessRange
+    constexpr int16_t BEXT_UNSET = 0x7FFF;
+
+    metadata = LoudnessMetadata();
+    if (size < 12 || !InputResident(pending, 12) || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) return false;
+
+    LoudnessMetadata found;
+    size_t pos = 12;
+    while (size - pos >= 8 && InputResident(pending, pos + 8)) {
+        const BYTE* chunk = data + pos;
+        DWORD chunkSize;
+        memcpy(&chunkSize, chunk + 4, 4);
+        if (chunkSize > size - pos - 8) break;
+        const BYTE* payload = chunk + 8;
+        if (memcmp(chunk, "data", 4) != 0 && !InputResident(pending, pos + 8 + chunkSize)) break;
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 4) {
+            WORD channels;
+            memcpy(&channels, payload + 2, 2);
+            found.channels = channels;
+        }
+        else if (memcmp(chunk, "bext", 4) == 0 && chunkSize >= BEXT_TRUE_PEAK_OFFSET + 2) {
+            WORD version;
+            int16_t loudness, truePeak;
+            memcpy(&version, payload + BEXT_VERSION_OFFSET, 2);
+            memcpy(&loudness, payload + BEXT_LOUDNESS_OFFSET, 2);
+            memcpy(&truePeak, payload + BEXT_TRUE_PEAK_OFFSET, 2);
+            // Writers that leave the v2 fields zeroed report 0 LUFS; treat that as unmeasured
+            if (version >= 2 && loudness != BEXT_UNSET && loudness != 0) {
+                found.present = true;
+                found.loudness = loudness / 100.0;
+                if (truePeak != BEXT_UNSET) {
+                    found.hasTruePeak = true;
+                    found.truePeak = static_cast<float>(pow(10.0, truePeak / 100.0 / 20.0));
+                }
+            }
+        }
+        // Chunks are word-aligned; the pad byte is not included in chunkSize
+        pos += 8 + static_cast<size_t>(chunkSize) + (chunkSize & 1);
+        if (pos > size) break;
+    }
 
+    if (!found.present || found.channels == 0 || !std::isfinite(found.loudness) ||
+        found.loudness <= LOUDNESS_ABSOLUTE_GATE) {
+        return false;
+    }
+    metadata = found;
     return true;
 }
 
-// Decode audio data using Media Foundation
+// Threads for a parallel pass over count independent units: the hardware threads, capped at limit
+// and at count
+static UINT32 ParallelThreads(size_t count, UINT32 limit) {
+    UINT32 threads = (std::min)((std::max)(std::thread::hardware_concurrency(), 1u), limit);
+    return static_cast<UINT32>((std::min)(static_cast<size_t>(threads), (std::max)(count, static_cast<size_t>(1))));
+}
+
+// Run fn(first, last) over [0, count) split into one contiguous range per thread; the calling thread
+// takes the first range
+template <typename Fn>
+static void ParallelRanges(size_t count, UINT32 threads, Fn&& fn) {
+    if (threads <= 1) {
+        fn(static_cast<size_t>(0), count);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (UINT32 t = 1; t < threads; t++) {
+        workers.emplace_back(fn, count * t / threads, count * (t + 1) / threads);
+    }
+    fn(static_cast<size_t>(0), count / threads);
+    for (std::thread& worker : workers) worker.join();
+}
+
+// ADPCM block layout taken from the fmt chunk
+struct AdpcmFormat {
+    WORD tag = 0;                    // WAV_FORMAT_IMA_ADPCM or WAV_FORMAT_MS_ADPCM
+    UINT32 channels = 0;
+    UINT32 blockAlign = 0;
+    UINT32 samplesPerBlock = 0;
+    std::vector<int16_t> coefs;      // MS ADPCM predictor pairs (coef1, coef2)
+};
+
+static constexpr int16_t IMA_STEP_TABLE[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+static constexpr int8_t IMA_INDEX_TABLE[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+static constexpr int MS_ADAPTATION_TABLE[16] = { 230, 230, 230, 230, 307, 409, 512, 614, 768, 614, 512, 409, 307, 230, 230, 230 };
+
+// Frames held by an ADPCM block of blockBytes bytes (the final block of a file may be short)
+static size_t AdpcmBlockFrames(const AdpcmFormat& format, size_t blockBytes) {
+    size_t headerBytes = static_cast<size_t>(format.tag == WAV_FORMAT_IMA_ADPCM ? 4 : 7) * format.channels;
+    if (blockBytes < headerBytes) return 0;
+    size_t frames = format.tag == WAV_FORMAT_IMA_ADPCM
+        ? 1 + (blockBytes - headerBytes) / (4 * format.channels) * 8
+        : 2 + (blockBytes - headerBytes) * 2 / format.channels;
+    return (std::min)(frames, static_cast<size_t>(format.samplesPerBlock));
+}
+
+// Decode one IMA ADPCM block: a 4-byte header per channel, then 4-byte groups of 8 nibbles
+// interleaved by channel, low nibble first
+static void DecodeImaBlock(const BYTE* block, size_t frames, UINT32 channels, float* output) {
+    for (UINT32 ch = 0; ch < channels; ch++) {
+        const BYTE* header = block + ch * 4;
+        int predictor = static_cast<int16_t>(header[0] | (header[1] << 8));
+        int index = (std::min)(static_cast<int>(header[2]), 88);
+        output[ch] = predictor / PCM16_SCALE;
+
+        for (size_t frame = 1; frame < frames; frame++) {
+            size_t n = frame - 1;
+            const BYTE* group = block + channels * 4 + ((n / 8) * channels + ch) * 4;
+            BYTE code = group[(n % 8) / 2];
+            int nibble = (n % 2) ? (code >> 4) : (code & 0x0F);
+
+            int step = IMA_STEP_TABLE[index];
+            int diff = step >> 3;
+            if (nibble & 1) diff += step >> 2;
+            if (nibble & 2) diff += step >> 1;
+            if (nibble & 4) diff += step;
+            if (nibble & 8) diff = -diff;
+            predictor = (std::clamp)(predictor + diff, -32768, 32767);
+            index = (std::clamp)(index + IMA_INDEX_TABLE[nibble], 0, 88);
+            output[frame * channels + ch] = predictor / PCM16_SCALE;
+        }
+    }
+}
+
+// Decode one MS ADPCM block: predictor indices, deltas and two seed samples per channel, then
+// nibbles alternating across channels, high nibble first. False on an out-of-range predictor.
+static bool DecodeMsBlock(const BYTE* block, size_t frames, const AdpcmFormat& format, float* output) {
+    const UINT32 channels = format.channels;
+    const UINT32 numCoefs = static_cast<UINT32>(format.coefs.size() / 2);
+    int coef1[WAV_MAX_CHANNELS], coef2[WAV_MAX_CHANNELS];
+    int delta[WAV_MAX_CHANNELS], sample1[WAV_MAX_CHANNELS], sample2[WAV_MAX_CHANNELS];
+    auto readInt16 = [](const BYTE* p) { return static_cast<int>(static_cast<int16_t>(p[0] | (p[1] << 8))); };
+
+    for (UINT32 ch = 0; ch < channels; ch++) {
+        UINT32 predictor = block[ch];
+        if (predictor >= numCoefs) return false;
+        coef1[ch] = format.coefs[predictor * 2];
+        coef2[ch] = format.coefs[predictor * 2 + 1];
+        delta[ch] = (std::max)(readInt16(block + channels + ch * 2), 16);
+        sample1[ch] = readInt16(block + channels * 3 + ch * 2);
+        sample2[ch] = readInt16(block + channels * 5 + ch * 2);
+        output[ch] = sample2[ch] / PCM16_SCALE;
+        if (frames > 1) output[channels + ch] = sample1[ch] / PCM16_SCALE;
+    }
+
+    const BYTE* codes = block + channels * 7;
+    size_t nibbles = frames > 2 ? (frames - 2) * channels : 0;
+    for (size_t n = 0; n < nibbles; n++) {
+        UINT32 ch = static_cast<UINT32>(n % channels);
+        int nibble = (n % 2) ? (codes[n / 2] & 0x0F) : (codes[n / 2] >> 4);
+        int signedNibble = nibble >= 8 ? nibble - 16 : nibble;
+
+        int64_t predicted = (static_cast<int64_t>(sample1[ch]) * coef1[ch] + static_cast<int64_t>(sample2[ch]) * coef2[ch]) / 256;
+        predicted = (std::clamp)(predicted + signedNibble * delta[ch], static_cast<int64_t>(-32768), static_cast<int64_t>(32767));
+        sample2[ch] = sample1[ch];
+        sample1[ch] = static_cast<int>(predicted);
+        // Keep delta bounded on corrupt input so the adaptation product cannot overflow
+        delta[ch] = (std::clamp)((MS_ADAPTATION_TABLE[nibble] * delta[ch]) >> 8, 16, 1 << 21);
+        output[(2 + n / channels) * channels + ch] = predicted / PCM16_SCALE;
+    }
+    return true;
+}
+
+// Decode IMA/MS ADPCM data into interleaved float PCM
 //
-// Wraps the buffer as a seekable IStream (SHCreateMemStream) and feeds it to
-// MFSourceReader. Seekability is required by most MF decoders (MP3, AAC, FLAC, etc.).
-bool DecodeAudioBuffer(const BYTE* data, size_t size, std::vector<float>& decodedData,
-                       UINT32 targetSampleRate, UINT32 targetChannels) {
-    HRESULT hr;
-    IStream* istream = nullptr;
-    IMFByteStream* byteStream = nullptr;
-    IMFSourceReader* reader = nullptr;
-    IMFMediaType* mediaType = nullptr;
-    bool success = false;
+// Blocks are independent (each restarts the predictor from its header), so long inputs are split
+// into contiguous block ranges decoded on separate threads straight into their place in the output.
+// The per-sample predictor recurrence itself is serial and stays scalar.
+static bool DecodeAdpcm(const BYTE* raw, size_t dataSize, const AdpcmFormat& format, size_t frameLimit,
+                        std::vector<float>& output) {
+    size_t blockCount = (dataSize + format.blockAlign - 1) / format.blockAlign;
+    size_t lastBytes = dataSize - (blockCount - 1) * format.blockAlign;
+    size_t totalFrames = (blockCount - 1) * format.samplesPerBlock + AdpcmBlockFrames(format, lastBytes);
+    // The last block is padded to a full block; the fact chunk says where the audio really ends
+    size_t keepFrames = (std::min)(totalFrames, frameLimit);
+    if (keepFrames == 0) return false;
+    output.resize(totalFrames * format.channels);
+
+    std::atomic<bool> failed{false};
+    auto decodeRange = [&](size_t first, size_t last) {
+        for (size_t b = first; b < last && !failed.load(std::memory_order_relaxed); b++) {
+            const BYTE* block = raw + b * format.blockAlign;
+            size_t bytes = (std::min)(static_cast<size_t>(format.blockAlign), dataSize - b * format.blockAlign);
+            size_t frames = AdpcmBlockFrames(format, bytes);
+            float* dst = output.data() + b * format.samplesPerBlock * format.channels;
+            if (frames == 0) continue;
+            if (format.tag == WAV_FORMAT_IMA_ADPCM) {
+                DecodeImaBlock(block, frames, format.channels, dst);
+            }
+            else if (!DecodeMsBlock(block, frames, format, dst)) {
+                failed = true;
+            }
+        }
+    };
 
-    do {
-        // SHCreateMemStream takes a UINT length; refuse to silently truncate >4GB inputs
-        if (size > MAXUINT) {
-            PrintError("Input too large for in-memory decode");
+    UINT32 threads = totalFrames >= ADPCM_PARALLEL_MIN_FRAMES ? ParallelThreads(blockCount, ADPCM_MAX_THREADS) : 1;
+    ParallelRanges(blockCount, threads, decodeRange);
+    if (failed) return false;
+
+    output.resize(keepFrames * format.channels);
+    return true;
+}
+
+// Convert samples of one PCM format to float, scaled by gain
+template <typename Sample>
+static void ConvertPcmSamples(const BYTE* raw, size_t count, UINT32 bytesPerSample, float* output, float gain,
+                              Sample sample) {
+    if (gain == 1.0f) {
+        for (size_t i = 0; i < count; i++) output[i] = sample(raw + i * bytesPerSample);
+    }
+    else {
+        for (size_t i = 0; i < count; i++) output[i] = sample(raw + i * bytesPerSample) * gain;
+    }
+}
+
+// Convert frames [first, first + frames) of deferred PCM into interleaved floats, scaled by gain.
+// Waits for read-ahead input; false when the read failed.
+static bool ReadPcmFrames(const DeferredPcm& pcm, size_t first, size_t frames, float* output, float gain = 1.0f) {
+    const UINT32 bytesPerSample = pcm.bits / 8;
+    const size_t frameBytes = static_cast<size_t>(bytesPerSample) * pcm.channels;
+    if (!EnsureInput(pcm.pending, pcm.offset + (first + frames) * frameBytes)) return false;
+    const BYTE* raw = pcm.data + first * frameBytes;
+    const size_t count = frames * pcm.channels;
+
+    if (pcm.isFloat) {
+        ConvertPcmSamples(raw, count, 4, output, gain, [](const BYTE* p) {
+            float v;
+            memcpy(&v, p, 4);
+            return v;
+        });
+    }
+    else if (pcm.bits == 16) {
+        ConvertPcmSamples(raw, count, 2, output, gain, [](const BYTE* p) {
+            int16_t v;
+            memcpy(&v, p, 2);
+            return static_cast<float>(v) / PCM16_SCALE;
+        });
+    }
+    else if (pcm.bits == 24) {
+        // Build via uint32_t to keep the left-shifts well-defined, then arithmetic-shift back to sign-extend.
+        // (Shifting a signed int into the sign bit is UB even though MSVC tolerates it.)
+        ConvertPcmSamples(raw, count, 3, output, gain, [](const BYTE* p) {
+            uint32_t u = static_cast<uint32_t>(p[0]) << 8 | static_cast<uint32_t>(p[1]) << 16 |
+                         static_cast<uint32_t>(p[2]) << 24;
+            return static_cast<float>(static_cast<int32_t>(u) >> 8) / PCM24_SCALE;
+        });
+    }
+    else {
+        ConvertPcmSamples(raw, count, 4, output, gain, [](const BYTE* p) {
+            int32_t v;
+            memcpy(&v, p, 4);
+            return static_cast<float>(v) / PCM32_SCALE;
+        });
+    }
+    return true;
+}
+
+// Convert frames [begin, end) of PCM into planar channels, one channel at a time
+template <typename Sample>
+static void DeinterleavePcm(const BYTE* raw, size_t begin, size_t end, UINT32 bytesPerSample,
+                            PlanarAudio& output, Sample sample) {
+    const UINT32 channels = output.Channels();
+    const size_t frameBytes = static_cast<size_t>(bytesPerSample) * channels;
+    for (UINT32 ch = 0; ch < channels; ch++) {
+        float* dst = output.Channel(ch);
+        const BYTE* src = raw + ch * bytesPerSample;
+        for (size_t i = begin; i < end; i++) dst[i] = sample(src + i * frameBytes);
+    }
+}
+
+// Read WAV data from buffer (bypass MF decoding)
+//
+// Output keeps the file's rate and channel count; resampling and channel mapping happen in the
+// conversion stage.
+// IMA and MS ADPCM are decoded here too, at any sample rate. Planar output writes PCM straight into
+// audio.planar; block output only validates it and leaves it in audio.pcm. ADPCM output is always
+// interleaved.
+bool TryReadWavBuffer(const BYTE* data, size_t size, DecodedAudio& audio, const ReadAhead* pending = nullptr,
+                      DecodeOutput output = DecodeOutput::Interleaved) {
+    size_t pos = 0;
+
+    // バッファから n バイトを dst にコピーして pos を進める
+    auto readBytes = [&](void* dst, size_t n) -> bool {
+        if (n > size - pos) return false;
+        if (!EnsureInput(pending, pos + n)) return false;
+        memcpy(dst, data + pos, n);
+        pos += n;
+        return true;
+    };
+    // バッファ上で n バイト前進する（読み捨て）
+    auto skipBytes = [&](size_t n) -> bool {
+        if (n > size - pos) return false;
+        pos += n;
+        return true;
+    };
+
+    char header[12];
+    if (!readBytes(header, 12)) return false;
+    if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) return false;
+
+    WAVEFORMATEXTENSIBLE fmt = {};
+    bool fmtFound = false;
+    const BYTE* fmtChunk = nullptr;      // Whole fmt payload; ADPCM extensions may exceed WAVEFORMATEXTENSIBLE
+    DWORD fmtChunkSize = 0;
+    while (true) {
+        char chunkId[4];
+        DWORD chunkSize;
+        if (!readBytes(chunkId, 4) || !readBytes(&chunkSize, 4)) break;
+
+        if (memcmp(chunkId, "fmt ", 4) == 0) {
+            if (chunkSize < 16) break;
+            fmtChunk = data + pos;
+            fmtChunkSize = (std::min)(chunkSize, static_cast<DWORD>(size - pos));
+            BYTE fmtBuf[40] = {};
+            DWORD fmtReadSize = (std::min)(chunkSize, static_cast<DWORD>(40));
+            if (!readBytes(fmtBuf, fmtReadSize)) break;
+            memcpy(&fmt, fmtBuf, fmtReadSize);
+            fmtFound = true;
+            if (chunkSize > fmtReadSize && !skipBytes(chunkSize - fmtReadSize)) break;
             break;
         }
-        istream = SHCreateMemStream(data, static_cast<UINT>(size));
-        if (!istream) {
-            PrintError("Failed to create memory stream");
-            break;
+        if (!skipBytes(chunkSize)) break;
+    }
+    if (!fmtFound) return false;
+
+    // Normalize WAVE_FORMAT_EXTENSIBLE to its underlying SubFormat tag so PCM/Float can share branches below
+    WORD actualFormatTag = fmt.Format.wFormatTag;
+    if (actualFormatTag == WAVE_FORMAT_EXTENSIBLE && fmt.Format.cbSize >= 22) {
+        actualFormatTag = *reinterpret_cast<const WORD*>(&fmt.SubFormat);
+    }
+
+    // ADPCM decodes natively too: it would otherwise pay the full MF startup cost
+    bool adpcm = actualFormatTag == WAV_FORMAT_IMA_ADPCM || actualFormatTag == WAV_FORMAT_MS_ADPCM;
+    if (!adpcm && actualFormatTag != WAVE_FORMAT_PCM && actualFormatTag != WAVE_FORMAT_IEEE_FLOAT) return false;
+    // Reject malformed headers that would later trigger divide-by-zero or oversized allocations
+    if (fmt.Format.nChannels == 0 || fmt.Format.nChannels > WAV_MAX_CHANNELS) return false;
+    if (fmt.Format.nSamplesPerSec == 0) return false;
+    if (!adpcm) {
+        if (fmt.Format.wBitsPerSample == 0 || (fmt.Format.wBitsPerSample % 8) != 0) return false;
+    }
+
+    AdpcmFormat adpcmFormat;
+    if (adpcm) {
+        if (!EnsureInput(pending, static_cast<size_t>(fmtChunk - data) + fmtChunkSize)) return false;
+        // WAVEFORMATEX (18 bytes) + wSamplesPerBlock, and for MS ADPCM wNumCoef + coefficient pairs
+        auto readWord = [&](size_t offset) { return static_cast<WORD>(fmtChunk[offset] | (fmtChunk[offset + 1] << 8)); };
+        if (fmt.Format.wBitsPerSample != 4 || fmtChunkSize < 20) return false;
+        adpcmFormat.tag = actualFormatTag;
+        adpcmFormat.channels = fmt.Format.nChannels;
+        adpcmFormat.blockAlign = fmt.Format.nBlockAlign;
+        adpcmFormat.samplesPerBlock = readWord(18);
+        if (actualFormatTag == WAV_FORMAT_MS_ADPCM) {
+            if (fmtChunkSize < 22) return false;
+            WORD numCoefs = readWord(20);
+            if (numCoefs == 0 || fmtChunkSize < 22 + static_cast<size_t>(numCoefs) * 4) return false;
+            for (size_t i = 0; i < static_cast<size_t>(numCoefs) * 2; i++) {
+                adpcmFormat.coefs.push_back(static_cast<int16_t>(readWord(22 + i * 2)));
+            }
+        }
+        // Full blocks must hold exactly wSamplesPerBlock frames so blocks map to fixed output offsets
+        if (adpcmFormat.blockAlign == 0 || adpcmFormat.samplesPerBlock == 0 ||
+            AdpcmBlockFrames(adpcmFormat, adpcmFormat.blockAlign) != adpcmFormat.samplesPerBlock) {
+            return false;
         }
+    }
 
-        hr = MFCreateMFByteStreamOnStream(istream, &byteStream);
-        if (FAILED(hr)) {
-            PrintError("Failed to create MF byte stream");
+    // Find data chunk (rescan from offset 12), noting the fact chunk's frame count on the way
+    pos = 12;
+    DWORD dataSize = 0;
+    bool dataFound = false;
+    size_t factFrames = SIZE_MAX;
+    while (true) {
+        char chunkId[4];
+        DWORD chunkSize;
+        if (!readBytes(chunkId, 4) || !readBytes(&chunkSize, 4)) break;
+
+        if (memcmp(chunkId, "data", 4) == 0) {
+            dataSize = chunkSize;
+            dataFound = true;
             break;
         }
+        if (memcmp(chunkId, "fact", 4) == 0 && chunkSize >= 4 && size - pos >= 4 && EnsureInput(pending, pos + 4)) {
+            DWORD frames;
+            memcpy(&frames, data + pos, 4);
+            factFrames = frames;
+        }
+        if (!skipBytes(chunkSize)) break;
+    }
+    if (!dataFound || dataSize == 0) return false;
+    if (dataSize > size - pos) return false;
 
-        hr = MFCreateSourceReaderFromByteStream(byteStream, nullptr, &reader);
-        if (FAILED(hr)) {
-            PrintError("Failed to open audio data");
-            break;
+    if (adpcm) {
+        // Blocks are decoded in parallel across the whole chunk, so it must be resident first
+        if (!EnsureInput(pending, pos + dataSize)) return false;
+        MarkDecoded(pending);
+        if (!DecodeAdpcm(data + pos, dataSize, adpcmFormat, factFrames, audio.samples)) return false;
+        audio.sampleRate = fmt.Format.nSamplesPerSec;
+        audio.channels = fmt.Format.nChannels;
+        audio.decoder = DecoderKind::WavAdpcm;
+        return true;
+    }
+
+    bool isFloat = actualFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+    WORD bits = fmt.Format.wBitsPerSample;
+    if (isFloat ? bits != 32 : (bits != 16 && bits != 24 && bits != 32)) return false;
+
+    UINT32 bytesPerSample = bits / 8;
+    UINT32 totalSamples = dataSize / bytesPerSample;
+    const BYTE* rawData = data + pos;
+    UINT32 channels = fmt.Format.nChannels;
+    size_t totalFrames = totalSamples / channels;
+    if (totalFrames == 0) return false;
+
+    DeferredPcm pcm;
+    pcm.data = rawData;
+    pcm.offset = pos;
+    pcm.frames = totalFrames;
+    pcm.channels = channels;
+    pcm.bits = bits;
+    pcm.isFloat = isFloat;
+    pcm.pending = pending;
+
+    if (output == DecodeOutput::Blocks) {
+        // The head is waited for here so read-ahead timing still marks the first decoded block
+        if (!EnsureInput(pending, pos + (std::min)(static_cast<size_t>(dataSize), READ_AHEAD_CHUNK))) return false;
+        MarkDecoded(pending);
+        audio.pcm = pcm;
+        audio.sampleRate = fmt.Format.nSamplesPerSec;
+        audio.channels = channels;
+        audio.decoder = DecoderKind::Wav;
+        return true;
+    }
+
+    // Convert one read-ahead chunk (slice) at a time so a file still being read is converted as it
+    // arrives. Long inputs split the slices into one contiguous range per thread, each converting
+    // straight into its own part of the output.
+    const size_t sliceFrames = (std::max)(READ_AHEAD_CHUNK / (bytesPerSample * channels), static_cast<size_t>(1));
+    const size_t sliceCount = (totalFrames + sliceFrames - 1) / sliceFrames;
+    const UINT32 threads = totalFrames >= PCM_PARALLEL_MIN_FRAMES ? ParallelThreads(sliceCount, PCM_MAX_THREADS) : 1;
+    const bool planar = output == DecodeOutput::Planar;
+    if (planar && !audio.planar.Resize(channels, totalFrames)) return false;
+    if (!planar) audio.samples.resize(totalFrames * channels);
+
+    auto convertSlice = [&](size_t begin, size_t end) -> bool {
+        if (!planar) return ReadPcmFrames(pcm, begin, end - begin, audio.samples.data() + begin * channels);
+        if (!EnsureInput(pending, pos + end * bytesPerSample * channels)) return false;
+        if (isFloat) {
+            DeinterleavePcm(rawData, begin, end, 4, audio.planar, [](const BYTE* p) {
+                float v;
+                memcpy(&v, p, 4);
+                return v;
+            });
         }
+        else if (bits == 16) {
+            DeinterleavePcm(rawData, begin, end, 2, audio.planar, [](const BYTE* p) {
+                int16_t v;
+                memcpy(&v, p, 2);
+                return static_cast<float>(v) / PCM16_SCALE;
+            });
+        }
+        else if (bits == 24) {
+            DeinterleavePcm(rawData, begin, end, 3, audio.planar, [](const BYTE* p) {
+                uint32_t u = static_cast<uint32_t>(p[0]) << 8 | static_cast<uint32_t>(p[1]) << 16 |
+                             static_cast<uint32_t>(p[2]) << 24;
+                return static_cast<float>(static_cast<int32_t>(u) >> 8) / PCM24_SCALE;
+            });
+        }
+        else {
+            DeinterleavePcm(rawData, begin, end, 4, audio.planar, [](const BYTE* p) {
+                int32_t v;
+                memcpy(&v, p, 4);
+                return static_cast<float>(v) / PCM32_SCALE;
+            });
+        }
+        return true;
+    };
 
-        // Output media type: 32-bit float PCM at the device's mix rate/channels
-        hr = MFCreateMediaType(&mediaType);
-        if (FAILED(hr)) break;
+    std::atomic<bool> failed{false};
+    ParallelRanges(sliceCount, threads, [&](size_t first, size_t last) {
+        for (size_t slice = first; slice < last && !failed.load(std::memory_order_relaxed); slice++) {
+            size_t begin = slice * sliceFrames;
+            if (!convertSlice(begin, (std::min)(begin + sliceFrames, totalFrames))) {
+                failed = true;
+                return;
+            }
+            if (begin == 0) MarkDecoded(pending);
+        }
+    });
+    if (failed) return false;
 
-        hr = mediaType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio);
-        if (FAILED(hr)) break;
+    audio.sampleRate = fmt.Format.nSamplesPerSec;
+    audio.channels = channels;
+    audio.decoder = DecoderKind::Wav;
+    return true;
+}
 
-        hr = mediaType->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_Float);
-        if (FAILED(hr)) break;
+// Band-limited resampler for a rational rate ratio dstRate/srcRate = up/down (reduced)
+//
+// Output frame i sits at source position i * down / up, i.e. source frame (i * down) / up plus phase
+// (i * down) % up of up. Each phase has its own windowed-sinc filter of taps() coefficients, low-passed
+// at RESAMPLE_CUTOFF of the lower Nyquist frequency, so both upsampling images and downsampling aliases
+// are suppressed. Positions are exact integers, so a range of output frames computes the same samples
+// whether the signal is converted whole or block by block. Samples outside the signal count as zero.
+//
+// The coefficient table is expanded to the source channel count (each tap repeated per channel) so
+// one frame's taps are a single contiguous dot product over interleaved input.
+class PolyphaseResampler {
+public:
+    // False when the reduced ratio needs more than RESAMPLE_MAX_PHASES phases
+    bool Init(UINT32 srcRate, UINT32 dstRate, UINT32 channels) {
+        UINT32 divisor = std::gcd(srcRate, dstRate);
+        up_ = dstRate / divisor;
+        down_ = srcRate / divisor;
+        if (up_ > RESAMPLE_MAX_PHASES) return false;
+        channels_ = channels;
+        switch (channels) {
+            case 1:  dot_ = &Dot<1>; break;
+            case 2:  dot_ = &Dot<2>; break;
+            case 3:  dot_ = &Dot<3>; break;
+            case 4:  dot_ = &Dot<4>; break;
+            case 5:  dot_ = &Dot<5>; break;
+            case 6:  dot_ = &Dot<6>; break;
+            case 7:  dot_ = &Dot<7>; break;
+            case 8:  dot_ = &Dot<8>; break;
+            default: dot_ = &DotWide; break;
+        }
 
-        hr = mediaType->SetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, 32);
-        if (FAILED(hr)) break;
+        // Downsampling narrows the passband, so the filter spans proportionally more source frames
+        double scale = (std::min)(1.0, static_cast<double>(up_) / down_);
+        UINT32 half = static_cast<UINT32>(std::ceil(RESAMPLE_TAPS / 2 / scale));
+        taps_ = (half * 2 + 15) & ~15u;
+        half_ = half;
+        double cutoff = 0.5 * scale * RESAMPLE_CUTOFF;
+        double windowNorm = BesselI0(RESAMPLE_KAISER_BETA);
+
+        table_.assign(static_cast<size_t>(up_) * taps_ * channels, 0.0f);
+        std::vector<double> h(taps_);
+        for (UINT32 phase = 0; phase < up_; phase++) {
+            double sum = 0.0;
+            for (UINT32 k = 0; k < half * 2; k++) {
+                // Distance from the output position to tap k's source frame
+                double d = static_cast<double>(k) - (half - 1) - static_cast<double>(phase) / up_;
+                double x = d / half;
+                double window = x * x < 1.0 ? BesselI0(RESAMPLE_KAISER_BETA * std::sqrt(1.0 - x * x)) / windowNorm : 0.0;
+                double arg = 2.0 * cutoff * d;
+                double sinc = arg == 0.0 ? 1.0 : std::sin(PI_D * arg) / (PI_D * arg);
+                h[k] = 2.0 * cutoff * sinc * window;
+                sum += h[k];
+            }
+            // Unity gain at DC for every phase
+            float* row = &table_[static_cast<size_t>(phase) * taps_ * channels];
+            for (UINT32 k = 0; k < half * 2; k++) {
+                for (UINT32 ch = 0; ch < channels; ch++) row[k * channels + ch] = static_cast<float>(h[k] / sum);
+            }
+        }
+        return true;
+    }
 
-        hr = mediaType->SetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, targetSampleRate);
-        if (FAILED(hr)) break;
+    size_t OutputFrames(size_t srcFrames) const {
+        return static_cast<size_t>(static_cast<uint64_t>(srcFrames) * up_ / down_);
+    }
 
-        hr = mediaType->SetUINT32(MF_MT_AUDIO_NUM_CHANNELS, targetChannels);
-        if (FAILED(hr)) break;
+    // Source frames an output frame reads before and after its own position (i * down / up)
+    UINT32 History() const { return half_ - 1; }
+    UINT32 Lookahead() const { return taps_ - half_; }
+
+    // Source frames [first, last) read by output frames [dstFirst, dstLast), clamped to the signal
+    void InputRange(size_t dstFirst, size_t dstLast, size_t srcFrames, size_t& first, size_t& last) const {
+        size_t begin = static_cast<size_t>(static_cast<uint64_t>(dstFirst) * down_ / up_);
+        size_t end = static_cast<size_t>(static_cast<uint64_t>(dstLast - 1) * down_ / up_);
+        first = begin >= half_ - 1 ? begin - (half_ - 1) : 0;
+        last = (std::min)(end + (taps_ - half_ + 1), srcFrames);
+    }
+
+    // Output frames [dstFirst, dstLast) into output (dstChannels interleaved, source channel
+    // min(ch, channels - 1) per device channel), scaled by gain. input holds source frames from srcFirst
+    // covering InputRange; srcFrames is the signal length.
+    void Run(const float* input, size_t srcFirst, size_t srcFrames, float* output, size_t dstFirst, size_t dstLast,
+             UINT32 dstChannels, float gain) const {
+        const UINT32 channels = channels_;
+        const size_t span = static_cast<size_t>(taps_) * channels;
+        std::vector<float> padded;
+        float acc[WAV_MAX_CHANNELS];
+        std::vector<float> wideAcc(channels > WAV_MAX_CHANNELS ? channels : 0);
+        float* sums = channels > WAV_MAX_CHANNELS ? wideAcc.data() : acc;
+
+        uint64_t position = static_cast<uint64_t>(dstFirst) * down_;
+        size_t frame = static_cast<size_t>(position / up_);
+        UINT32 phase = static_cast<UINT32>(position % up_);
+        const UINT32 step = down_ / up_;
+        const UINT32 stepPhase = down_ % up_;
+        for (size_t i = dstFirst; i < dstLast; i++) {
+            // First tap's source frame; windows reaching past either end read a zero-padded copy
+            const float* window;
+            if (frame + 1 >= half_ && frame + 1 - half_ + taps_ <= srcFrames) {
+                window = input + (frame + 1 - half_ - srcFirst) * channels;
+            }
+            else {
+                padded.assign(span, 0.0f);
+                for (UINT32 k = 0; k < taps_; k++) {
+                    size_t source = frame + 1 + k;
+                    if (source < half_ || source - half_ >= srcFrames) continue;
+                    memcpy(&padded[static_cast<size_t>(k) * channels], input + (source - half_ - srcFirst) * channels,
+                           channels * sizeof(float));
+                }
+                window = padded.data();
+            }
+            dot_(window, &table_[static_cast<size_t>(phase) * span], span, channels, sums);
+
+            float* out = output + (i - dstFirst) * dstChannels;
+            for (UINT32 ch = 0; ch < dstChannels; ch++) {
+                out[ch] = sums[(std::min)(ch, channels - 1)] * gain;
+            }
+
+            frame += step;
+            phase += stepPhase;
+            if (phase >= up_) {
+                phase -= up_;
+                frame++;
+            }
+        }
+    }
+
+private:
+    static constexpr double PI_D = 3.14159265358979323846;
+
+    static double BesselI0(double x) {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 32; k++) {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    // Per-channel sums of window[j] * coefs[j] over interleaved frames. Lane l of vector v holds channel
+    // (4v + l) % Channels, a pattern that repeats every PERIOD = lcm(4, Channels) / 4 vectors. Short
+    // patterns are accumulated in several independent groups to hide the add latency; span is a
+    // multiple of every group size because taps is a multiple of 16.
+    template <UINT32 Channels>
+    static void Dot(const float* window, const float* coefs, size_t span, UINT32, float* sums) {
+        constexpr UINT32 Period = std::lcm(4u, Channels) / 4;
+        constexpr UINT32 GROUPS = Period == 1 ? 4 : Period == 2 ? 2 : 1;
+        __m128 acc[Period * GROUPS];
+        for (UINT32 v = 0; v < Period * GROUPS; v++) acc[v] = _mm_setzero_ps();
+        for (size_t j = 0; j < span; j += 4 * Period * GROUPS) {
+            for (UINT32 v = 0; v < Period * GROUPS; v++) {
+                acc[v] = _mm_add_ps(acc[v], _mm_mul_ps(_mm_loadu_ps(window + j + 4 * v), _mm_loadu_ps(coefs + j + 4 * v)));
+            }
+        }
+        alignas(16) float lanes[4 * Period];
+        for (UINT32 v = 0; v < Period; v++) {
+            __m128 total = acc[v];
+            for (UINT32 group = 1; group < GROUPS; group++) total = _mm_add_ps(total, acc[group * Period + v]);
+            _mm_store_ps(lanes + 4 * v, total);
+        }
+        for (UINT32 ch = 0; ch < Channels; ch++) sums[ch] = 0.0f;
+        for (UINT32 j = 0; j < 4 * Period; j++) sums[j % Channels] += lanes[j];
+    }
+
+    // Scalar fallback for more than 8 channels
+    static void DotWide(const float* window, const float* coefs, size_t span, UINT32 channels, float* sums) {
+        for (UINT32 ch = 0; ch < channels; ch++) sums[ch] = 0.0f;
+        for (size_t j = 0; j < span; j++) sums[j % channels] += window[j] * coefs[j];
+    }
+
+    UINT32 up_ = 1;
+    UINT32 down_ = 1;
+    UINT32 channels_ = 1;
+    void (*dot_)(const float*, const float*, size_t, UINT32, float*) = nullptr;
+    UINT32 taps_ = 0;     // Coefficients per phase, padded to a multiple of 16
+    UINT32 half_ = 0;     // Taps before and including the output position
+    std::vector<float> table_;
+};
+
+// Rate conversion used by the format converters; Linear is the cheap fallback of the deadline policy
+enum class Resampling { Polyphase, Linear };
+
+// Convert audio format (resampling and channel conversion) into output, applying gain on the way
+//
+// output is resized (its capacity reused, e.g. from the session buffer pool); empty on invalid input.
+void ConvertFormatInto(const float* input, size_t sampleCount,
+                       UINT32 srcRate, UINT32 srcChannels,
+                       UINT32 dstRate, UINT32 dstChannels,
+                       std::vector<float>& output, float gain = 1.0f,
+                       Resampling method = Resampling::Polyphase) {
+    output.clear();
+    if (sampleCount == 0 || srcRate == 0 || dstRate == 0 || srcChannels == 0 || dstChannels == 0) {
+        return;
+    }
+    if (srcRate == dstRate && srcChannels == dstChannels) {
+        output.assign(input, input + sampleCount);
+        if (gain != 1.0f) {
+            for (float& s : output) s *= gain;
+        }
+        return;
+    }
+
+    size_t srcFrames = sampleCount / srcChannels;
+    if (srcFrames == 0) return;
+    size_t dstFrames = static_cast<size_t>((static_cast<uint64_t>(srcFrames) * dstRate) / srcRate);
+    output.resize(dstFrames * dstChannels);
+
+    // Every output frame is computed from the input alone, so long buffers are split into one segment
+    // of output frames per thread. A segment's filters read across its edges from the shared input,
+    // so the result is exactly that of a single pass.
+    PolyphaseResampler resampler;
+    const bool polyphase = srcRate != dstRate && method == Resampling::Polyphase &&
+                           resampler.Init(srcRate, dstRate, srcChannels);
+    const FormatKernels& kernels = SelectKernels(dstChannels);
+    const size_t parallelMin = polyphase ? RESAMPLE_PARALLEL_MIN_FRAMES : PCM_PARALLEL_MIN_FRAMES;
+    const UINT32 threads = srcFrames >= parallelMin ? ParallelThreads(dstFrames, RESAMPLE_MAX_THREADS) : 1;
+    ParallelRanges(dstFrames, threads, [&](size_t first, size_t last) {
+        float* out = output.data() + first * dstChannels;
+        if (polyphase) {
+            resampler.Run(input, 0, srcFrames, out, first, last, dstChannels, gain);
+        }
+        else {
+            kernels.convert(input, 0, srcFrames, srcRate, srcChannels, out, first, last, dstRate, dstChannels, gain);
+        }
+    });
+}
+
+// Convert deferred PCM to the device format block by block: each CHAIN_BLOCK_BYTES block of source
+// frames is read into an L2-resident scratch buffer and resampled, channel mapped and scaled into
+// output before the next is read, so the source is streamed from memory once. Blocks are independent,
+// so long inputs split them into one contiguous range per thread, each with its own scratch buffer
+// and writing its own part of the output. The output frames equal those of ConvertFormatInto on the
+// whole signal. False when reading the input failed.
+bool ConvertPcmBlocks(const DeferredPcm& pcm, UINT32 srcRate, UINT32 dstRate, UINT32 dstChannels,
+                      std::vector<float>& output, float gain = 1.0f,
+                      Resampling method = Resampling::Polyphase) {
+    output.clear();
+    const size_t srcFrames = pcm.frames;
+    if (srcFrames == 0 || srcRate == 0 || dstRate == 0 || pcm.channels == 0 || dstChannels == 0) return true;
+    const size_t blockFrames = (std::max)(CHAIN_BLOCK_BYTES / (sizeof(float) * pcm.channels), static_cast<size_t>(1));
+    const size_t srcBlocks = (srcFrames + blockFrames - 1) / blockFrames;
+    const UINT32 threads = srcFrames >= PCM_PARALLEL_MIN_FRAMES ? ParallelThreads(srcBlocks, PCM_MAX_THREADS) : 1;
+    std::atomic<bool> failed{false};
+
+    // Run convert(block, scratch) over [0, count) on the worker threads until a block fails
+    auto forEachBlock = [&](size_t count, auto&& convert) {
+        ParallelRanges(count, threads, [&](size_t first, size_t last) {
+            std::vector<float> scratch;
+            for (size_t b = first; b < last && !failed.load(std::memory_order_relaxed); b++) {
+                if (!convert(b, scratch)) failed = true;
+            }
+        });
+        return !failed.load();
+    };
+
+    // Same format: the read itself is the whole conversion
+    if (srcRate == dstRate && pcm.channels == dstChannels) {
+        output.resize(srcFrames * dstChannels);
+        return forEachBlock(srcBlocks, [&](size_t b, std::vector<float>&) {
+            size_t first = b * blockFrames;
+            size_t count = (std::min)(blockFrames, srcFrames - first);
+            return ReadPcmFrames(pcm, first, count, output.data() + first * dstChannels, gain);
+        });
+    }
+
+    size_t dstFrames = static_cast<size_t>((static_cast<uint64_t>(srcFrames) * dstRate) / srcRate);
+    output.resize(dstFrames * dstChannels);
+
+    // Polyphase: each block of output frames reads the source frames its filters span, so frames
+    // near block edges are read twice
+    PolyphaseResampler resampler;
+    if (srcRate != dstRate && method == Resampling::Polyphase && resampler.Init(srcRate, dstRate, pcm.channels)) {
+        const size_t dstBlock = (std::max)(resampler.OutputFrames(blockFrames), static_cast<size_t>(1));
+        return forEachBlock((dstFrames + dstBlock - 1) / dstBlock, [&](size_t b, std::vector<float>& block) {
+            size_t dstFirst = b * dstBlock;
+            size_t dstLast = (std::min)(dstFirst + dstBlock, dstFrames);
+            size_t first, last;
+            resampler.InputRange(dstFirst, dstLast, srcFrames, first, last);
+            block.resize((last - first) * pcm.channels);
+            if (!ReadPcmFrames(pcm, first, last - first, block.data())) return false;
+            resampler.Run(block.data(), first, srcFrames, output.data() + dstFirst * dstChannels,
+                          dstFirst, dstLast, dstChannels, gain);
+            return true;
+        });
+    }
+
+    const FormatKernels& kernels = SelectKernels(dstChannels);
+    // First source frame an output frame interpolates from, with the kernel's own arithmetic
+    auto sourceFrame = [&](size_t i) {
+        return static_cast<size_t>(static_cast<float>(i * srcRate) / dstRate);
+    };
+    // First output frame interpolating from source frame `frame` or later
+    auto outputFrame = [&](size_t frame) {
+        size_t i = (std::min)(static_cast<size_t>(static_cast<uint64_t>(frame) * dstRate / srcRate), dstFrames);
+        while (i > 0 && sourceFrame(i - 1) >= frame) i--;
+        while (i < dstFrames && sourceFrame(i) < frame) i++;
+        return i;
+    };
+
+    // Each block also reads the following frame, the second interpolation input of its last frames
+    return forEachBlock(srcBlocks, [&](size_t b, std::vector<float>& block) {
+        size_t first = b * blockFrames;
+        size_t last = (std::min)(first + blockFrames, srcFrames);
+        size_t dstFirst = outputFrame(first);
+        size_t dstLast = last == srcFrames ? dstFrames : outputFrame(last);
+        if (dstFirst >= dstLast) return true;
+        size_t count = (std::min)(last + 1, srcFrames) - first;
+        block.resize(count * pcm.channels);
+        if (!ReadPcmFrames(pcm, first, count, block.data())) return false;
+        kernels.convert(block.data(), first, srcFrames, srcRate, pcm.channels,
+                        output.data() + dstFirst * dstChannels, dstFirst, dstLast, dstRate, dstChannels, gain);
+        return true;
+    });
+}
+
+// Planar counterpart of ConvertFormatInto; output is resized to the device channels and frames.
+//
+// Each channel is resampled on its own contiguous samples, and a device channel fed by the same
+// source channel as the previous one is copied from it. The polyphase filters are those of the
+// interleaved path; only the order in which tap products are summed differs, by float rounding.
+// For linear interpolation, positions are computed once per tile of frames and reused for every
+// channel, with ChannelKernels::Convert's arithmetic; at equal rates (channel mapping only) the
+// planar path copies frames directly instead of interpolating at float-rounded positions, which
+// differ from whole frames by up to ~1e-7 of a frame per second.
+bool ConvertPlanar(const PlanarAudio& input, UINT32 srcRate, UINT32 dstRate, UINT32 dstChannels,
+                   PlanarAudio& output, float gain = 1.0f,
+                   Resampling method = Resampling::Polyphase) {
+    constexpr size_t TILE_FRAMES = 1024;
+    const UINT32 srcChannels = input.Channels();
+    const size_t srcFrames = input.Frames();
+    if (srcFrames == 0 || srcRate == 0 || dstRate == 0 || dstChannels == 0) return false;
+    size_t dstFrames = static_cast<size_t>((static_cast<uint64_t>(srcFrames) * dstRate) / srcRate);
+    if (dstFrames == 0 || !output.Resize(dstChannels, dstFrames)) return false;
+
+    if (srcRate == dstRate) {
+        const __m128 g = _mm_set1_ps(gain);
+        for (UINT32 ch = 0; ch < dstChannels; ch++) {
+            const float* src = input.Channel((std::min)(ch, srcChannels - 1));
+            float* dst = output.Channel(ch);
+            size_t i = 0;
+            for (; i + 4 <= dstFrames; i += 4) _mm_store_ps(dst + i, _mm_mul_ps(_mm_load_ps(src + i), g));
+            for (; i < dstFrames; i++) dst[i] = src[i] * gain;
+        }
+        return true;
+    }
+
+    // Long channels are resampled in parallel output segments as in ConvertFormatInto
+    PolyphaseResampler resampler;
+    if (method == Resampling::Polyphase && resampler.Init(srcRate, dstRate, 1)) {
+        const UINT32 threads = srcFrames >= RESAMPLE_PARALLEL_MIN_FRAMES ? ParallelThreads(dstFrames, RESAMPLE_MAX_THREADS) : 1;
+        for (UINT32 ch = 0; ch < dstChannels; ch++) {
+            UINT32 srcCh = (std::min)(ch, srcChannels - 1);
+            if (ch > 0 && srcCh == (std::min)(ch - 1, srcChannels - 1)) {
+                memcpy(output.Channel(ch), output.Channel(ch - 1), dstFrames * sizeof(float));
+                continue;
+            }
+            ParallelRanges(dstFrames, threads, [&](size_t first, size_t last) {
+                resampler.Run(input.Channel(srcCh), 0, srcFrames, output.Channel(ch) + first, first, last, 1, gain);
+            });
+        }
+        return true;
+    }
+
+    size_t idx0[TILE_FRAMES];
+    size_t idx1[TILE_FRAMES];
+    float frac[TILE_FRAMES];
+    for (size_t first = 0; first < dstFrames; first += TILE_FRAMES) {
+        size_t count = (std::min)(TILE_FRAMES, dstFrames - first);
+        for (size_t i = 0; i < count; i++) {
+            float srcIndex = static_cast<float>((first + i) * srcRate) / dstRate;
+            idx0[i] = static_cast<size_t>(srcIndex);
+            idx1[i] = (std::min)(idx0[i] + 1, srcFrames - 1);
+            frac[i] = srcIndex - idx0[i];
+        }
+        for (UINT32 ch = 0; ch < dstChannels; ch++) {
+            UINT32 srcCh = (std::min)(ch, srcChannels - 1);
+            float* dst = output.Channel(ch) + first;
+            if (ch > 0 && srcCh == (std::min)(ch - 1, srcChannels - 1)) {
+                memcpy(dst, output.Channel(ch - 1) + first, count * sizeof(float));
+                continue;
+            }
+            const float* src = input.Channel(srcCh);
+            for (size_t i = 0; i < count; i++) {
+                float s0 = src[idx0[i]];
+                float s1 = src[idx1[i]];
+                dst[i] = (s0 + (s1 - s0) * frac[i]) * gain;
+            }
+        }
+    }
+    return true;
+}
+
+// Convert audio format (resampling and channel conversion)
+std::vector<float> ConvertFormat(const std::vector<float>& input,
+                                 UINT32 srcRate, UINT32 srcChannels,
+                                 UINT32 dstRate, UINT32 dstChannels) {
+    std::vector<float> output;
+    ConvertFormatInto(input.data(), input.size(), srcRate, srcChannels, dstRate, dstChannels, output);
+    return output;
+}
+
+// Decode Opus/Ogg data from buffer (.opus and .ogg Opus)
+//
+// Output stays at the Opus decode rate and stream channel count; conversion happens afterwards.
+// With planar set, each decoded packet is split into audio.planar while it is still in cache.
+bool TryDecodeOpusBuffer(const BYTE* data, size_t size, DecodedAudio& audio, const ReadAhead* pending = nullptr,
+                         bool planar = false) {
+    ogg_sync_state   oy;
+    ogg_stream_state os;
+    ogg_page         og;
+    ogg_packet       op;
+
+    ogg_sync_init(&oy);
+    bool streamInitialized = false;
+    OpusDecoder* decoder = nullptr;
+    int opusChannels = 0;
+    std::vector<float> decodedFloat;
+    // Heap-allocated PCM scratch buffer; stack allocation would consume ~180KB and risk overflow on deep call stacks
+    std::vector<float> pcmBuffer(static_cast<size_t>(OPUS_MAX_FRAME_SIZE) * OPUS_MAX_CHANNELS);
+    int packetCount = 0;
+    bool outOfMemory = false;
+
+    // Feed the buffer in chunks (ogg_sync_buffer reallocs are expensive for large single allocations)
+    // and decode the pages completed so far after each one, so a file still being read is decoded
+    // as it arrives
+    size_t offset = 0;
+    while (offset < size && !outOfMemory) {
+        size_t toWrite = (std::min)(OGG_FEED_CHUNK, size - offset);
+        if (!EnsureInput(pending, offset + toWrite)) break;
+        char* buf = ogg_sync_buffer(&oy, static_cast<long>(toWrite));
+        if (!buf) break;
+        memcpy(buf, data + offset, toWrite);
+        ogg_sync_wrote(&oy, static_cast<long>(toWrite));
+        offset += toWrite;
+
+        // Opus stream structure: packet 1 = OpusHead, packet 2 = OpusTags, packet 3+ = audio data
+        while (!outOfMemory && ogg_sync_pageout(&oy, &og) == 1) {
+            if (!streamInitialized) {
+                if (ogg_stream_init(&os, ogg_page_serialno(&og)) != 0) {
+                    ogg_sync_clear(&oy);
+                    return false;
+                }
+                streamInitialized = true;
+            }
+            ogg_stream_pagein(&os, &og);
+
+            while (ogg_stream_packetout(&os, &op) == 1) {
+                packetCount++;
+
+                if (packetCount == 1) {
+                    // OpusHead packet carries channel count and reserves the codec context for audio packets
+                    if (op.bytes >= 19 && memcmp(op.packet, "OpusHead", 8) == 0) {
+                        opusChannels = op.packet[9];
+                        // Channel mapping family != 0 needs opus_multistream_decoder; reject and limit family 0 to mono/stereo per RFC 7845
+                        int channelMappingFamily = op.packet[18];
+                        if (channelMappingFamily != 0 || opusChannels < 1 || opusChannels > 2) {
+                            if (streamInitialized) ogg_stream_clear(&os);
+                            ogg_sync_clear(&oy);
+                            return false;
+                        }
+                        int error;
+                        decoder = opus_decoder_create(OPUS_OUTPUT_RATE, opusChannels, &error);
+                        if (planar && decoder && !audio.planar.Resize(opusChannels, 0)) error = OPUS_ALLOC_FAIL;
+                        if (error != OPUS_OK || !decoder) {
+                            if (decoder) opus_decoder_destroy(decoder);
+                            if (streamInitialized) ogg_stream_clear(&os);
+                            ogg_sync_clear(&oy);
+                            return false;
+                        }
+                    }
+                    else {
+                        if (decoder) opus_decoder_destroy(decoder);
+                        if (streamInitialized) ogg_stream_clear(&os);
+                        ogg_sync_clear(&oy);
+                        return false;
+                    }
+                }
+                else if (packetCount == 2) {
+                    // OpusTags (metadata) - intentionally skipped
+                    continue;
+                }
+                else {
+                    if (decoder) {
+                        int frameSize = opus_decode_float(decoder, op.packet, op.bytes,
+                                                          pcmBuffer.data(), OPUS_MAX_FRAME_SIZE, 0);
+                        if (frameSize > 0 && planar) {
+                            if (!audio.planar.Append(pcmBuffer.data(), static_cast<size_t>(frameSize))) {
+                                outOfMemory = true;
+                                break;
+                            }
+                            MarkDecoded(pending);
+                        }
+                        else if (frameSize > 0) {
+                            size_t sampleCount = static_cast<size_t>(frameSize) * opusChannels;
+                            decodedFloat.insert(decodedFloat.end(),
+                                                pcmBuffer.data(), pcmBuffer.data() + sampleCount);
+                            MarkDecoded(pending);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (decoder) opus_decoder_destroy(decoder);
+    if (streamInitialized) ogg_stream_clear(&os);
+    ogg_sync_clear(&oy);
+
+    if (outOfMemory || (planar ? audio.planar.Empty() : decodedFloat.empty())) return false;
+
+    audio.samples = std::move(decodedFloat);
+    audio.sampleRate = OPUS_OUTPUT_RATE;
+    audio.channels = static_cast<UINT32>(opusChannels);
+    audio.decoder = DecoderKind::Opus;
+    return true;
+}
+
+// Decode audio data using Media Foundation
+//
+// Wraps the buffer as a seekable IStream (SHCreateMemStream) and feeds it to
+// MFSourceReader. Seekability is required by most MF decoders (MP3, AAC, FLAC, etc.).
+// Only the sample type is requested: the output keeps the stream's rate and channel count, so MF
+// inserts no resampler or channel mixer and the conversion stage handles MF output like any other.
+bool DecodeAudioBuffer(const BYTE* data, size_t size, DecodedAudio& audio, const ReadAhead* pending = nullptr) {
+    // The source reader seeks anywhere in the stream, so it needs the whole input
+    if (!EnsureInput(pending, size)) return false;
+
+    HRESULT hr;
+    std::vector<float>& decodedData = audio.samples;
+    IStream* istream = nullptr;
+    IMFByteStream* byteStream = nullptr;
+    IMFSourceReader* reader = nullptr;
+    IMFMediaType* mediaType = nullptr;
+    IMFMediaType* outputType = nullptr;
+    bool success = false;
+
+    do {
+        // SHCreateMemStream takes a UINT length; refuse to silently truncate >4GB inputs
+        if (size > MAXUINT) {
+            PrintError("Input too large for in-memory decode");
+            break;
+        }
+        istream = SHCreateMemStream(data, static_cast<UINT>(size));
+        if (!istream) {
+            PrintError("Failed to create memory stream");
+            break;
+        }
+
+        hr = MFCreateMFByteStreamOnStream(istream, &byteStream);
+        if (FAILED(hr)) {
+            PrintError("Failed to create MF byte stream");
+            break;
+        }
+
+        hr = MFCreateSourceReaderFromByteStream(byteStream, nullptr, &reader);
+        if (FAILED(hr)) {
+            PrintError("Failed to open audio data");
+            break;
+        }
+
+        // Output media type: 32-bit float PCM in the stream's own format
+        hr = MFCreateMediaType(&mediaType);
+        if (FAILED(hr)) break;
+
+        hr = mediaType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio);
+        if (FAILED(hr)) break;
+
+        hr = mediaType->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_Float);
+        if (FAILED(hr)) break;
+
+        hr = mediaType->SetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, 32);
+        if (FAILED(hr)) break;
+
+        hr = reader->SetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, nullptr, mediaType);
+        if (FAILED(hr)) {
+            PrintError("Failed to set output format");
+            break;
+        }
+
+        // Rate and channels the decoder settled on
+        UINT32 sampleRate = 0;
+        UINT32 channels = 0;
+        hr = reader->GetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, &outputType);
+        if (SUCCEEDED(hr)) hr = outputType->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &sampleRate);
+        if (SUCCEEDED(hr)) hr = outputType->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &channels);
+        if (FAILED(hr) || sampleRate == 0 || channels == 0) {
+            PrintError("Failed to get output format");
+            break;
+        }
+
+        while (true) {
+            DWORD flags = 0;
+            IMFSample* sample = nullptr;
+
+            hr = reader->ReadSample((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, 0,
+                                   nullptr, &flags, nullptr, &sample);
+            if (FAILED(hr)) break;
+
+            // MF reports stream-level errors via flags rather than HRESULT; honor them to avoid spinning forever
+            if (flags & MF_SOURCE_READERF_ERROR) {
+                if (sample) sample->Release();
+                break;
+            }
+            if (flags & MF_SOURCE_READERF_ENDOFSTREAM) {
+                if (sample) sample->Release();
+                break;
+            }
+            // A mid-stream media-type change would force mixing samples of different formats; discard partial data and fail
+            if (flags & MF_SOURCE_READERF_CURRENTMEDIATYPECHANGED) {
+                if (sample) sample->Release();
+                decodedData.clear();
+                break;
+            }
+
+            if (sample) {
+                IMFMediaBuffer* buffer = nullptr;
+                hr = sample->ConvertToContiguousBuffer(&buffer);
+                if (SUCCEEDED(hr)) {
+                    BYTE* bufData = nullptr;
+                    DWORD dataLen = 0;
+
+                    hr = buffer->Lock(&bufData, nullptr, &dataLen);
+                    if (SUCCEEDED(hr)) {
+                        size_t sampleCount = dataLen / sizeof(float);
+                        size_t oldSize = decodedData.size();
+                        decodedData.resize(oldSize + sampleCount);
+                        memcpy(&decodedData[oldSize], bufData, dataLen);
+                        buffer->Unlock();
+                    }
+                    buffer->Release();
+                }
+                sample->Release();
+            }
+        }
+
+        success = !decodedData.empty();
+        audio.sampleRate = sampleRate;
+        audio.channels = channels;
+        audio.decoder = DecoderKind::MediaFoundation;
+
+    } while (false);
+
+    if (outputType) outputType->Release();
+    if (mediaType) mediaType->Release();
+    if (reader) reader->Release();
+    if (byteStream) byteStream->Release();
+    if (istream) istream->Release();
+
+    return success;
+}
+
+// Decode input bytes, dispatching by magic bytes to avoid unnecessary decoder attempts
+//
+// Every decoder outputs the source's own rate and channel count; conversion to the device format
+// happens afterwards, so the device format need not be known yet.
+//
+// pending is set while the input is still being read; dispatch only looks at the head, and each
+// decoder waits for the bytes it needs next. Decoders without the requested output fill
+// audio.samples.
+bool DecodeInput(const BYTE* data, size_t size, DecodedAudio& audio, const ReadAhead* pending = nullptr,
+                 DecodeOutput output = DecodeOutput::Interleaved) {
+    audio = DecodedAudio();
+    bool decoded = false;
+    const bool wave = size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WAVE", 4) == 0;
+    if (wave) {
+        decoded = TryReadWavBuffer(data, size, audio, pending, output);
+    }
+    if (!decoded && size >= 4 && memcmp(data, "OggS", 4) == 0) {
+        audio = DecodedAudio();
+        decoded = TryDecodeOpusBuffer(data, size, audio, pending, output == DecodeOutput::Planar);
+    }
+    if (!decoded) {
+        audio = DecodedAudio();
+        decoded = DecodeAudioBuffer(data, size, audio, pending);
+        if (decoded) MarkDecoded(pending);
+    }
+    if (decoded && wave) {
+        ReadWavLoudnessMetadata(data, size, audio.metadata, pending);
+    }
+    return decoded;
+}
+
+// Whole stdin input without intermediate copies
+//
+// Only reads when stdin is a pipe or redirected file to avoid blocking on
+// interactive console input. Switches to binary mode to prevent CRLF translation.
+// A redirected disk file is mapped read-only from the current file position, so nothing is copied.
+// A pipe is read straight into a reserved address range whose pages are committed as it grows:
+// each byte is copied once by the kernel into its final place, and growth never moves data.
+class StdinInput {
+public:
+    StdinInput() = default;
+    StdinInput(const StdinInput&) = delete;
+    StdinInput& operator=(const StdinInput&) = delete;
+
+    ~StdinInput() {
+        if (view_) UnmapViewOfFile(view_);
+        if (mapping_) CloseHandle(mapping_);
+        if (reserved_) VirtualFree(reserved_, 0, MEM_RELEASE);
+    }
+
+    // Returns false if stdin is not redirected, on read error, or no data was read
+    bool Read() {
+        HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+        if (!hStdin || hStdin == INVALID_HANDLE_VALUE) return false;
+
+        DWORD type = GetFileType(hStdin);
+        if (type != FILE_TYPE_PIPE && type != FILE_TYPE_DISK) return false;
+
+        _setmode(_fileno(stdin), _O_BINARY);
+
+        if (type == FILE_TYPE_DISK && MapFile(hStdin)) return size_ > 0;
+        return ReadPipe(hStdin);
+    }
+
+    const BYTE* Data() const { return data_; }
+    size_t Size() const { return size_; }
+
+private:
+    bool MapFile(HANDLE file) {
+        LARGE_INTEGER fileSize, position, zero = {};
+        if (!GetFileSizeEx(file, &fileSize) || !SetFilePointerEx(file, zero, &position, FILE_CURRENT)) return false;
+        if (fileSize.QuadPart <= position.QuadPart) return false;
+        // Same 4GB cap as the pipe path; the in-memory decode path uses SHCreateMemStream (UINT length)
+        if (fileSize.QuadPart - position.QuadPart > MAXUINT) return false;
+
+        mapping_ = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_) return false;
+        view_ = static_cast<const BYTE*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (!view_) return false;
+        data_ = view_ + position.QuadPart;
+        size_ = static_cast<size_t>(fileSize.QuadPart - position.QuadPart);
+        return true;
+    }
+
+    bool ReadPipe(HANDLE pipe) {
+        reserved_ = static_cast<BYTE*>(VirtualAlloc(nullptr, STDIN_RESERVE, MEM_RESERVE, PAGE_READWRITE));
+        if (!reserved_) return false;
+        data_ = reserved_;
+
+        while (true) {
+            if (size_ == committed_) {
+                if (committed_ == STDIN_RESERVE) {
+                    PrintError("stdin input exceeds 4GB limit");
+                    return false;
+                }
+                // Grow geometrically so multi-GB inputs need few commit calls
+                size_t grow = (std::min)((std::max)(committed_, STDIN_INITIAL_RESERVE), STDIN_RESERVE - committed_);
+                if (!VirtualAlloc(reserved_ + committed_, grow, MEM_COMMIT, PAGE_READWRITE)) return false;
+                committed_ += grow;
+            }
+
+            DWORD toRead = static_cast<DWORD>((std::min)(committed_ - size_, static_cast<size_t>(MAXDWORD)));
+            DWORD bytesRead = 0;
+            // Distinguish EOF (success with 0 bytes) from read errors:
+            // pipe disconnect / handle invalidation must not be treated as clean EOF
+            // because that would silently truncate the input.
+            if (!ReadFile(pipe, reserved_ + size_, toRead, &bytesRead, nullptr)) {
+                DWORD err = GetLastError();
+                // ERROR_BROKEN_PIPE on a closed write-end is a normal end-of-stream
+                if (err == ERROR_BROKEN_PIPE) break;
+                return false;
+            }
+            if (bytesRead == 0) break;
+            size_ += bytesRead;
+        }
+        return size_ > 0;
+    }
+
+    HANDLE mapping_ = nullptr;
+    const BYTE* view_ = nullptr;
+    BYTE* reserved_ = nullptr;
+    size_t committed_ = 0;
+    const BYTE* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Generate inaudible sine wave buffer for BLE anti-clipping
+// BLE devices enter power-saving mode on digital silence, causing audio clipping.
+// A 19kHz tone at ~-60dB is inaudible to adults but keeps the BLE codec active.
+std::vector<float> GenerateBleGuard(UINT32 sampleRate, UINT32 channels, float duration,
+                                     float freq, float amp) {
+    size_t totalFrames = static_cast<size_t>(sampleRate * duration);
+    std::vector<float> buffer(totalFrames * channels);
+
+    for (size_t i = 0; i < totalFrames; i++) {
+        float t = static_cast<float>(i) / sampleRate;
+        float sample = amp * sinf(TWO_PI * freq * t);
+        for (UINT32 ch = 0; ch < channels; ch++) {
+            buffer[i * channels + ch] = sample;
+        }
+    }
+
+    return buffer;
+}
+
+// Interleaved (or planar, or deferred PCM) samples to measure, with the libebur128 channel type of each channel
+struct LoudnessInput {
+    const float* data = nullptr;
+    const PlanarAudio* planar = nullptr;   // Set instead of data for planar input
+    const DeferredPcm* pcm = nullptr;      // Set instead of data for PCM still in the input
+    size_t sampleCount = 0;
+    UINT32 sampleRate = 0;
+    UINT32 channels = 0;
+    std::vector<int> channelTypes;     // Empty for the libebur128 default channel map
+};
+
+// libebur128's default type for channel index of a channels-wide stream (ebur128_init_channel_map)
+static int DefaultLoudnessChannel(UINT32 index, UINT32 channels) {
+    if (channels == 4) {
+        static constexpr int quad[] = { EBUR128_LEFT, EBUR128_RIGHT, EBUR128_LEFT_SURROUND, EBUR128_RIGHT_SURROUND };
+        return quad[index];
+    }
+    if (channels == 5) {
+        static constexpr int five[] = { EBUR128_LEFT, EBUR128_RIGHT, EBUR128_CENTER,
+                                        EBUR128_LEFT_SURROUND, EBUR128_RIGHT_SURROUND };
+        return five[index];
+    }
+    switch (index) {
+        case 0:  return EBUR128_LEFT;
+        case 1:  return EBUR128_RIGHT;
+        case 2:  return EBUR128_CENTER;
+        case 4:  return EBUR128_LEFT_SURROUND;
+        case 5:  return EBUR128_RIGHT_SURROUND;
+        default: return EBUR128_UNUSED;
+    }
+}
+
+// Channel types that make a measurement of source-channel data equal to measuring it after
+// ConvertFormat maps it to dstChannels (destination channel c copies source channel min(c, src - 1))
+//
+// Each source channel takes the summed BS.1770 weight of the destination channels it feeds. libebur128
+// only offers weights 0, 1, 1.41 (surround) and 2 (dual mono), so mappings needing any other sum,
+// e.g. mono onto 5.1, return false and must be measured in the device format.
+bool MapLoudnessChannels(UINT32 srcChannels, UINT32 dstChannels, std::vector<int>& types) {
+    std::vector<UINT32> units(srcChannels, 0), surrounds(srcChannels, 0);
+    for (UINT32 ch = 0; ch < dstChannels; ch++) {
+        UINT32 src = (std::min)(ch, srcChannels - 1);
+        int type = DefaultLoudnessChannel(ch, dstChannels);
+        if (type == EBUR128_LEFT_SURROUND || type == EBUR128_RIGHT_SURROUND) surrounds[src]++;
+        else if (type != EBUR128_UNUSED) units[src]++;
+    }
+
+    types.assign(srcChannels, EBUR128_UNUSED);
+    for (UINT32 ch = 0; ch < srcChannels; ch++) {
+        if (units[ch] == 0 && surrounds[ch] == 0) types[ch] = EBUR128_UNUSED;
+        else if (units[ch] == 1 && surrounds[ch] == 0) types[ch] = EBUR128_LEFT;
+        else if (units[ch] == 0 && surrounds[ch] == 1) types[ch] = EBUR128_LEFT_SURROUND;
+        else if (units[ch] == 2 && surrounds[ch] == 0) types[ch] = EBUR128_DUAL_MONO;
+        else return false;
+    }
+    return true;
+}
+
+// Loudness change in LU when a file measured in its own channel layout is played through ConvertFormat
+// on a dstChannels device. Exact when the layout is unchanged and for mono, whose copies all carry the
+// same signal; other mappings depend on per-channel levels the metadata does not carry.
+bool LoudnessChannelOffset(UINT32 srcChannels, UINT32 dstChannels, double& offset) {
+    offset = 0.0;
+    if (srcChannels == dstChannels) return true;
+    if (srcChannels != 1) return false;
+    double weight = 0.0;
+    for (UINT32 ch = 0; ch < dstChannels; ch++) {
+        int type = DefaultLoudnessChannel(ch, dstChannels);
+        if (type == EBUR128_LEFT_SURROUND || type == EBUR128_RIGHT_SURROUND) weight += 1.41;
+        else if (type != EBUR128_UNUSED) weight += 1.0;
+    }
+    offset = 10.0 * log10(weight);
+    return true;
+}
+
+static ebur128_state* CreateLoudnessState(const LoudnessInput& input, int mode) {
+    ebur128_state* state = ebur128_init(input.channels, input.sampleRate, mode);
+    if (!state) return nullptr;
+    for (UINT32 ch = 0; ch < input.channelTypes.size(); ch++) {
+        if (ebur128_set_channel(state, ch, input.channelTypes[ch]) != EBUR128_SUCCESS) {
+            ebur128_destroy(&state);
+            return nullptr;
+        }
+    }
+    return state;
+}
+
+// Interleaved frames [offset, offset + frames) of the input. libebur128 only takes interleaved
+// frames, so planar input is interleaved into scratch one slice at a time; deferred PCM is converted
+// into it. nullptr when reading deferred PCM failed.
+static const float* LoudnessFrames(const LoudnessInput& input, size_t offset, size_t frames,
+                                   std::vector<float>& scratch) {
+    if (input.pcm) {
+        scratch.resize(frames * input.channels);
+        return ReadPcmFrames(*input.pcm, offset, frames, scratch.data()) ? scratch.data() : nullptr;
+    }
+    if (!input.planar) return &input.data[offset * input.channels];
+    scratch.resize(frames * input.channels);
+    input.planar->Interleave(offset, frames, scratch.data());
+    return scratch.data();
+}
+
+// Absolute sample peak over the first used channels of interleaved frames
+static float PeakOfFrames(const float* data, size_t frames, UINT32 channels, UINT32 used) {
+    float peak = 0.0f;
+    for (size_t i = 0; i < frames * channels; i += channels) {
+        for (UINT32 ch = 0; ch < used; ch++) {
+            float v = fabsf(data[i + ch]);
+            if (v > peak) peak = v;
+        }
+    }
+    return peak;
+}
+
+// Find absolute sample peak over the first usedChannels channels of each frame
+float MeasurePeak(const LoudnessInput& input, UINT32 usedChannels) {
+    float peak = 0.0f;
+    UINT32 used = (std::min)(usedChannels, input.channels);
+    if (input.pcm) {
+        size_t frames = input.sampleCount / input.channels;
+        size_t blockFrames = (std::max)(CHAIN_BLOCK_BYTES / (sizeof(float) * input.channels), static_cast<size_t>(1));
+        std::vector<float> scratch;
+        for (size_t offset = 0; offset < frames; offset += blockFrames) {
+            size_t n = (std::min)(blockFrames, frames - offset);
+            const float* block = LoudnessFrames(input, offset, n, scratch);
+            if (!block) break;
+            peak = (std::max)(peak, PeakOfFrames(block, n, input.channels, used));
+        }
+        return peak;
+    }
+    if (input.planar) {
+        const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+        size_t frames = input.planar->Frames();
+        for (UINT32 ch = 0; ch < used; ch++) {
+            const float* src = input.planar->Channel(ch);
+            __m128 max = _mm_setzero_ps();
+            size_t i = 0;
+            for (; i + 4 <= frames; i += 4) max = _mm_max_ps(_mm_and_ps(_mm_load_ps(src + i), abs), max);
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, max);
+            for (float v : lanes) peak = (std::max)(peak, v);
+            for (; i < frames; i++) peak = (std::max)(peak, fabsf(src[i]));
+        }
+        return peak;
+    }
+    return PeakOfFrames(input.data, input.sampleCount / input.channels, input.channels, used);
+}
+
+// Measure EBU R128 integrated loudness over the whole buffer (ITU-R BS.1770-4)
+//
+// Frames are fed in LOUDNESS_CHUNK_DURATION slices so a background caller can abort via cancel.
+// With peak set, the sample peak over the first usedChannels channels is taken from the same slices,
+// which for deferred PCM are L2-sized so each block is read from memory once for both.
+// Returns false on libebur128 failure, cancellation or a non-finite result (e.g. fully gated input).
+bool MeasureLoudness(const LoudnessInput& input, double& loudness, const std::atomic<bool>* cancel = nullptr,
+                     float* peak = nullptr, UINT32 usedChannels = 0) {
+    ebur128_state* state = CreateLoudnessState(input, EBUR128_MODE_I);
+    if (!state) return false;
+
+    size_t frames = input.sampleCount / input.channels;
+    size_t chunkFrames = (std::max)(static_cast<size_t>(input.sampleRate * LOUDNESS_CHUNK_DURATION), static_cast<size_t>(1));
+    if (input.pcm) {
+        chunkFrames = (std::min)(chunkFrames, (std::max)(CHAIN_BLOCK_BYTES / (sizeof(float) * input.channels), static_cast<size_t>(1)));
+    }
+    UINT32 used = (std::min)(usedChannels, input.channels);
+    if (peak) *peak = 0.0f;
+    std::vector<float> scratch;
+    for (size_t offset = 0; offset < frames; offset += chunkFrames) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) {
+            ebur128_destroy(&state);
+            return false;
+        }
+        size_t n = (std::min)(chunkFrames, frames - offset);
+        const float* chunk = LoudnessFrames(input, offset, n, scratch);
+        if (chunk && peak) *peak = (std::max)(*peak, PeakOfFrames(chunk, n, input.channels, used));
+        if (!chunk || ebur128_add_frames_float(state, chunk, n) != EBUR128_SUCCESS) {
+            ebur128_destroy(&state);
+            return false;
+        }
+    }
+
+    int result = ebur128_loudness_global(state, &loudness);
+    ebur128_destroy(&state);
+    return result == EBUR128_SUCCESS && std::isfinite(loudness);
+}
+
+// Result of sampled loudness estimation
+struct LoudnessEstimate {
+    double loudness = 0.0;     // Estimated integrated loudness in LUFS
+    double halfWidth = 0.0;    // 95% confidence half-width in LU actually reached
+    size_t sampledBlocks = 0;
+    size_t totalBlocks = 0;
+};
+
+// Estimate integrated loudness from a stratified random subset of 400ms gating blocks
+//
+// The input is split into non-overlapping gating blocks. Each round divides the timeline into
+// equal strata and K-weights one randomly placed block per stratum, so samples stay spread across
+// the whole file. Absolute and relative gates are applied to the sampled block energies exactly as
+// BS.1770 does for the full set. Rounds double the sample count until the 95% confidence half-width
+// of the gated mean (with finite population correction) is within errorBound LU, or all blocks are used.
+bool EstimateLoudness(const LoudnessInput& input, float errorBound, LoudnessEstimate& estimate) {
+    const UINT32 sampleRate = input.sampleRate;
+    const UINT32 channels = input.channels;
+    size_t frames = input.sampleCount / channels;
+    size_t blockFrames = static_cast<size_t>(sampleRate * LOUDNESS_BLOCK_DURATION);
+    size_t warmupFrames = static_cast<size_t>(sampleRate * LOUDNESS_ESTIMATE_WARMUP);
+    if (blockFrames == 0) return false;
+    size_t totalBlocks = frames / blockFrames;
+    if (totalBlocks < LOUDNESS_ESTIMATE_MIN_BLOCKS * 2) return false;
+
+    // Momentary loudness of the last 400ms fed equals the loudness of one gating block
+    ebur128_state* state = CreateLoudnessState(input, EBUR128_MODE_M);
+    if (!state) return false;
+
+    std::vector<bool> visited(totalBlocks, false);
+    std::vector<double> energies;     // Mean-square energy of each block above the absolute gate
+    std::vector<float> scratch;
+    size_t sampled = 0;
+    // Fixed-seed xorshift keeps repeated plays of the same file at the same gain
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    auto nextRandom = [&rng]() -> uint64_t {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    };
+
+    bool ok = true;
+    size_t strata = LOUDNESS_ESTIMATE_MIN_BLOCKS;
+    while (ok) {
+        for (size_t s = 0; s < strata && ok; s++) {
+            size_t first = s * totalBlocks / strata;
+            size_t last = (s + 1) * totalBlocks / strata;
+            if (last <= first) continue;
+            size_t block = first + static_cast<size_t>(nextRandom() % (last - first));
+            if (visited[block]) continue;
+            visited[block] = true;
+            sampled++;
+
+            size_t start = block * blockFrames;
+            size_t warmup = (std::min)(warmupFrames, start);
+            const float* blockData = LoudnessFrames(input, start - warmup, warmup + blockFrames, scratch);
+            if (!blockData || ebur128_add_frames_float(state, blockData, warmup + blockFrames) != EBUR128_SUCCESS) {
+                ok = false;
+                break;
+            }
+            double blockLoudness;
+            if (ebur128_loudness_momentary(state, &blockLoudness) != EBUR128_SUCCESS) {
+                ok = false;
+                break;
+            }
+            if (std::isfinite(blockLoudness) && blockLoudness > LOUDNESS_ABSOLUTE_GATE) {
+                energies.push_back(pow(10.0, (blockLoudness + 0.691) / 10.0));
+            }
+        }
+        if (!ok || energies.empty()) break;
+
+        // Relative gate against the absolute-gated mean, then the gated mean and its sampling error
+        double sum = 0.0;
+        for (double e : energies) sum += e;
+        double relativeGate = sum / energies.size() * pow(10.0, LOUDNESS_RELATIVE_GATE / 10.0);
+        double gatedSum = 0.0, gatedSqSum = 0.0;
+        size_t gatedCount = 0;
+        for (double e : energies) {
+            if (e <= relativeGate) continue;
+            gatedSum += e;
+            gatedSqSum += e * e;
+            gatedCount++;
+        }
+        if (gatedCount == 0) {
+            ok = false;
+            break;
+        }
+        double mean = gatedSum / gatedCount;
+        double variance = gatedCount > 1 ? (gatedSqSum - gatedSum * mean) / (gatedCount - 1) : 0.0;
+        double fpc = 1.0 - static_cast<double>(sampled) / totalBlocks;
+        double stdErr = sqrt((std::max)(variance, 0.0) / gatedCount * (std::max)(fpc, 0.0));
+        // 1.96 sigma of the mean, converted from a relative energy error to LU
+        double halfWidth = 10.0 * log10(1.0 + 1.96 * stdErr / mean);
+
+        estimate.loudness = -0.691 + 10.0 * log10(mean);
+        estimate.halfWidth = halfWidth;
+        estimate.sampledBlocks = sampled;
+        estimate.totalBlocks = totalBlocks;
+
+        if (halfWidth <= errorBound || sampled >= totalBlocks || strata >= totalBlocks) break;
+        strata = (std::min)(strata * 2, totalBlocks);
+    }
+
+    ebur128_destroy(&state);
+    return ok && !energies.empty() && std::isfinite(estimate.loudness);
+}
+
+// Gain that brings loudness to target, clamped so the peak stays under peakCeiling
+float ComputeLoudnessGain(double loudness, float peak, float target, float peakCeiling) {
+    float gain = static_cast<float>(pow(10.0, (target - loudness) / 20.0));
+
+    if (peak * gain > peakCeiling) {
+        gain = peakCeiling / peak;
+    }
+    return gain;
+}
+
+// Scale audio in place by a loudness gain
+void ApplyGain(std::vector<float>& audioData, float gain) {
+    if (gain == 1.0f) return;
+    for (float& s : audioData) {
+        s *= gain;
+    }
+}
+
+// Apply fade-in/out to audio data to prevent click noise from waveform discontinuity
+void ApplyFade(std::vector<float>& audioData, UINT32 sampleRate, UINT32 channels) {
+    UINT32 fadeFrames = static_cast<UINT32>(sampleRate * FADE_DURATION);
+    UINT32 totalFrames = static_cast<UINT32>(audioData.size() / channels);
+    if (totalFrames < fadeFrames * 2) return; // too short for fade
+
+    SelectKernels(channels).fade(audioData.data(), totalFrames, fadeFrames, channels);
+}
+
+// Scale planar audio in place by a loudness gain
+void ApplyGainPlanar(PlanarAudio& audio, float gain) {
+    if (gain == 1.0f) return;
+    const __m128 g = _mm_set1_ps(gain);
+    for (UINT32 ch = 0; ch < audio.Channels(); ch++) {
+        float* data = audio.Channel(ch);
+        size_t i = 0;
+        for (; i + 4 <= audio.Frames(); i += 4) _mm_store_ps(data + i, _mm_mul_ps(_mm_load_ps(data + i), g));
+        for (; i < audio.Frames(); i++) data[i] *= gain;
+    }
+}
+
+// Planar counterpart of ApplyFade; each channel ramps four frames per vector
+void ApplyFadePlanar(PlanarAudio& audio, UINT32 sampleRate) {
+    UINT32 fadeFrames = static_cast<UINT32>(sampleRate * FADE_DURATION);
+    UINT32 totalFrames = static_cast<UINT32>(audio.Frames());
+    if (totalFrames < fadeFrames * 2) return; // too short for fade
+
+    const __m128 step = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    const __m128 divisor = _mm_set1_ps(static_cast<float>(fadeFrames));
+    for (UINT32 ch = 0; ch < audio.Channels(); ch++) {
+        float* data = audio.Channel(ch);
+        float* tail = data + (totalFrames - fadeFrames);
+        UINT32 i = 0;
+        for (; i + 4 <= fadeFrames; i += 4) {
+            __m128 in = _mm_div_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(i)), step), divisor);
+            __m128 out = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(static_cast<float>(fadeFrames - i)), step), divisor);
+            _mm_store_ps(data + i, _mm_mul_ps(_mm_load_ps(data + i), in));
+            _mm_storeu_ps(tail + i, _mm_mul_ps(_mm_loadu_ps(tail + i), out));
+        }
+        for (; i < fadeFrames; i++) {
+            data[i] *= static_cast<float>(i) / fadeFrames;
+            tail[i] *= static_cast<float>(fadeFrames - i) / fadeFrames;
+        }
+    }
+}
+
+// Streaming WSOLA (waveform-similarity overlap-add) tempo change without a pitch change
+//
+// Output is the overlap-add of Hann-windowed TEMPO_WINDOW segments at a hop of half a window. Segment
+// k nominally starts at input frame k * hop * rate; it is moved by up to TEMPO_SEARCH to where its
+// first half best matches the input that followed the previous segment (normalized cross-correlation
+// over all channels, tried every few frames and then refined around the best shift), so each
+// crossfade joins waveforms in phase. Input is pushed incrementally and a segment is placed as soon
+// as its search range has arrived, so output trails input by at most one window plus the search
+// range; the first half window passes through unchanged.
+class WsolaStretcher {
+public:
+    // False for rates outside 0.5 to 2 or formats too short for a window
+    bool Init(UINT32 sampleRate, UINT32 channels, float rate) {
+        if (!(rate >= 0.5f && rate <= 2.0f) || channels == 0) return false;
+        channels_ = channels;
+        rate_ = rate;
+        hop_ = static_cast<size_t>(sampleRate * TEMPO_WINDOW / 2);
+        search_ = static_cast<size_t>(sampleRate * TEMPO_SEARCH);
+        stride_ = (std::max)(sampleRate / TEMPO_COARSE_RATE, 1u);
+        if (hop_ < 16) return false;
+        weights_.resize(hop_ * 2);
+        for (size_t i = 0; i < hop_ * 2; i++) {
+            weights_[i] = 0.5f - 0.5f * cosf(TWO_PI * static_cast<float>(i) / static_cast<float>(hop_ * 2));
+        }
+        return true;
+    }
+
+    // Append frames of input; output frames that no later input can change are appended to output
+    void Push(const float* input, size_t frames, std::vector<float>& output) {
+        input_.insert(input_.end(), input, input + frames * channels_);
+        total_ += frames;
+        Place(false, output);
+    }
+
+    // End of input: place the segments that still fit and append the rest of the input unchanged
+    void Flush(std::vector<float>& output) {
+        Place(true, output);
+        uint64_t from = segment_ == 0 ? 0 : prev_ + hop_;
+        output.insert(output.end(), Frame(from), Frame(total_));
+        input_.clear();
+        base_ = total_;
+    }
+
+private:
+    const float* Frame(uint64_t frame) const { return input_.data() + (frame - base_) * channels_; }
+
+    void Place(bool final, std::vector<float>& output) {
+        const size_t overlap = hop_ * channels_;
+        while (true) {
+            if (segment_ == 0) {
+                // Nothing precedes the first segment, so its first half is output as is
+                if (total_ < hop_ * 2) return;
+                output.insert(output.end(), Frame(0), Frame(hop_));
+                prev_ = 0;
+                segment_ = 1;
+                continue;
+            }
+            uint64_t nominal = static_cast<uint64_t>(static_cast<double>(segment_ * hop_) * rate_);
+            uint64_t lo = nominal > search_ ? nominal - search_ : 0;
+            uint64_t hi = nominal + search_;
+            if (hi + hop_ * 2 > total_) {
+                if (!final || total_ < lo + hop_ * 2) break;
+                hi = total_ - hop_ * 2;
+            }
+
+            const float* natural = Frame(prev_ + hop_);
+            uint64_t best = Search(natural, lo, hi);
+            const float* next = Frame(best);
+            size_t base = output.size();
+            output.resize(base + overlap);
+            float* out = output.data() + base;
+            for (size_t i = 0; i < hop_; i++) {
+                float fadeOut = weights_[hop_ + i];
+                float fadeIn = weights_[i];
+                for (UINT32 ch = 0; ch < channels_; ch++) {
+                    size_t k = i * channels_ + ch;
+                    out[k] = natural[k] * fadeOut + next[k] * fadeIn;
+                }
+            }
+            prev_ = best;
+            segment_++;
+        }
+
+        // Keep what the next segment can read: the previous segment's second half and its search range
+        uint64_t nextNominal = static_cast<uint64_t>(static_cast<double>(segment_ * hop_) * rate_);
+        uint64_t keep = (std::min)(prev_ + hop_, nextNominal > search_ ? nextNominal - search_ : 0);
+        if (segment_ > 0 && keep > base_) {
+            input_.erase(input_.begin(), input_.begin() + static_cast<size_t>(keep - base_) * channels_);
+            base_ = keep;
+        }
+    }
+
+    // Start in [lo, hi] whose first half best matches natural, by normalized cross-correlation:
+    // a coarse pass every stride_ frames, then every frame around the best coarse candidate
+    uint64_t Search(const float* natural, uint64_t lo, uint64_t hi) {
+        const size_t overlap = hop_ * channels_;
+        // energy_[j]: energy of frames [lo, lo + j), for the candidates' normalization
+        size_t span = static_cast<size_t>(hi - lo) + hop_;
+        energy_.resize(span + 1);
+        energy_[0] = 0.0;
+        const float* first = Frame(lo);
+        for (size_t j = 0; j < span; j++) {
+            float e = 0.0f;
+            for (UINT32 ch = 0; ch < channels_; ch++) e += first[j * channels_ + ch] * first[j * channels_ + ch];
+            energy_[j + 1] = energy_[j] + e;
+        }
+        auto score = [&](uint64_t start) {
+            size_t j = static_cast<size_t>(start - lo);
+            double energy = energy_[j + hop_] - energy_[j];
+            return static_cast<double>(DotProduct(natural, Frame(start), overlap)) / sqrt(energy + 1e-9);
+        };
+
+        uint64_t best = lo;
+        double bestScore = score(lo);
+        for (uint64_t start = lo + stride_; start <= hi; start += stride_) {
+            double value = score(start);
+            if (value > bestScore) {
+                bestScore = value;
+                best = start;
+            }
+        }
+        uint64_t coarse = best;
+        uint64_t from = coarse > lo + stride_ ? coarse - stride_ + 1 : lo;
+        uint64_t to = (std::min)(coarse + stride_ - 1, hi);
+        for (uint64_t start = from; start <= to; start++) {
+            if (start == coarse) continue;
+            double value = score(start);
+            if (value > bestScore) {
+                bestScore = value;
+                best = start;
+            }
+        }
+        return best;
+    }
+
+    // Sum of a[i] * b[i], four SSE accumulators deep
+    static float DotProduct(const float* a, const float* b, size_t count) {
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(a + i + 8), _mm_loadu_ps(b + i + 8)));
+            acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(a + i + 12), _mm_loadu_ps(b + i + 12)));
+        }
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+        float sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        for (; i < count; i++) sum += a[i] * b[i];
+        return sum;
+    }
+
+    UINT32 channels_ = 1;
+    float rate_ = 1.0f;
+    size_t hop_ = 0;                     // Half a window: output frames per segment
+    size_t search_ = 0;
+    UINT32 stride_ = 1;                  // Coarse search step in frames
+    std::vector<float> weights_;         // Hann window over two hops
+    std::vector<float> input_;           // Input frames from base_ still needed
+    std::vector<double> energy_;
+    uint64_t base_ = 0;
+    uint64_t total_ = 0;                 // Input frames pushed
+    uint64_t segment_ = 0;               // Next segment to place
+    uint64_t prev_ = 0;                  // Start of the previous segment
+};
+
+// One step of a tone pattern: up to TONE_MAX_VOICES sine frequencies (none for a rest) and an envelope
+struct ToneStep {
+    float freqs[TONE_MAX_VOICES] = {};
+    UINT32 voices = 0;
+    float duration = 0.0f;           // Seconds
+    float attack = TONE_ATTACK;      // Linear rise from silence, in seconds
+    float release = TONE_RELEASE;    // Linear fall to silence at the end of the step, in seconds
+    bool bell = false;               // Exponential decay after the attack instead of a sustained level
+};
+
+// Unsigned decimal number; strtod alone would also take leading spaces, signs, hex and "inf"
+static bool ParseToneNumber(const char*& p, double& value) {
+    if ((p[0] < '0' || p[0] > '9') && p[0] != '.') return false;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) return false;
+    char* end = nullptr;
+    value = strtod(p, &end);
+    if (end == p || !std::isfinite(value)) return false;
+    p = end;
+    return true;
+}
+
+// step := freq ("+" freq)* ":" duration [":" envelope]
+static bool ParseToneStep(const char*& p, ToneStep& step) {
+    while (true) {
+        double freq;
+        if (!ParseToneNumber(p, freq) || (freq != 0.0 && (freq < 20.0 || freq > 20000.0))) return false;
+        if (freq != 0.0) {
+            if (step.voices == TONE_MAX_VOICES) return false;
+            step.freqs[step.voices++] = static_cast<float>(freq);
+        }
+        if (*p != '+') break;
+        p++;
+    }
+    if (*p++ != ':') return false;
+
+    double duration;
+    if (!ParseToneNumber(p, duration)) return false;
+    if (p[0] == 'm' && p[1] == 's') {
+        p += 2;
+        duration /= 1000.0;
+    }
+    else if (*p == 's') {
+        p++;
+    }
+    else {
+        duration /= 1000.0;
+    }
+    if (!(duration > 0.0 && duration <= TONE_MAX_DURATION)) return false;
+    step.duration = static_cast<float>(duration);
+
+    if (*p != ':') return true;
+    p++;
+    if (strncmp(p, "bell", 4) == 0) {
+        p += 4;
+        step.bell = true;
+        return true;
+    }
+    bool any = false;
+    for (char key : { 'a', 'r' }) {
+        if (*p != key) continue;
+        p++;
+        double ms;
+        if (!ParseToneNumber(p, ms) || ms < 0.0 || ms > TONE_MAX_DURATION * 1000.0) return false;
+        (key == 'a' ? step.attack : step.release) = static_cast<float>(ms / 1000.0);
+        any = true;
+    }
+    return any;
+}
+
+// pattern := item ("," item)*, item := (step | "(" pattern ")") ["*" count]
+static bool ParseToneItems(const char*& p, std::vector<ToneStep>& steps, int depth) {
+    if (depth > TONE_MAX_DEPTH) return false;
+    while (true) {
+        size_t first = steps.size();
+        if (*p == '(') {
+            p++;
+            if (!ParseToneItems(p, steps, depth + 1) || *p++ != ')') return false;
+        }
+        else {
+            ToneStep step;
+            if (!ParseToneStep(p, step)) return false;
+            steps.push_back(step);
+        }
+        if (*p == '*') {
+            p++;
+            double count;
+            if (!ParseToneNumber(p, count) || count < 1.0 || count != floor(count) ||
+                (steps.size() - first) * count > TONE_MAX_STEPS) {
+                return false;
+            }
+            std::vector<ToneStep> repeated(steps.begin() + first, steps.end());
+            for (int i = 1; i < static_cast<int>(count); i++) steps.insert(steps.end(), repeated.begin(), repeated.end());
+        }
+        if (steps.size() > TONE_MAX_STEPS) return false;
+        if (*p != ',') return true;
+        p++;
+    }
+}
+
+// Parse a tone pattern such as "880:150ms,660:150ms" or "(1320+1760:80ms:bell,0:40ms)*3"
+//
+//   pattern  := item ("," item)*
+//   item     := (step | "(" pattern ")") ["*" count]
+//   step     := freq ("+" freq)* ":" duration [":" envelope]
+//   duration := number ["ms" | "s"]            (milliseconds without a unit)
+//   envelope := "bell" | ["a" ms] ["r" ms]      (attack and release times)
+// Frequencies are in Hz (20 to 20000); 0 is a rest. False on a syntax error or a pattern
+// beyond TONE_MAX_STEPS steps or TONE_MAX_DURATION seconds.
+bool ParseTonePattern(const char* text, std::vector<ToneStep>& steps) {
+    steps.clear();
+    const char* p = text;
+    if (!ParseToneItems(p, steps, 0) || *p != '\0') return false;
+    double total = 0.0;
+    for (const ToneStep& step : steps) total += step.duration;
+    return total <= TONE_MAX_DURATION;
+}
+
+// Peak amplitude of a sine on every device channel that measures target LUFS
+//
+// A 997 Hz sine of peak A on channels of summed BS.1770 weight W measures 10 log10(W A^2 / 2) LUFS;
+// K-weighting shifts other frequencies by a few dB, so tones land near the target without analysis.
+float ToneLevel(float target, UINT32 channels) {
+    double weight = 0.0;
+    for (UINT32 ch = 0; ch < channels; ch++) {
+        switch (DefaultLoudnessChannel(ch, channels)) {
+            case EBUR128_LEFT:
+            case EBUR128_RIGHT:
+            case EBUR128_CENTER:          weight += 1.0; break;
+            case EBUR128_LEFT_SURROUND:
+            case EBUR128_RIGHT_SURROUND:  weight += 1.41; break;
+            default: break;
+        }
+    }
+    if (weight == 0.0) weight = 1.0;
+    return static_cast<float>(sqrt(2.0 * pow(10.0, target / 10.0) / weight));
+}
+
+// Block-by-block synthesizer for a parsed tone pattern
+//
+// Each voice is a phase-accumulating sine oscillator, as behind the guard tone, restarted at phase 0
+// with every step; the step's envelope scales the sum of its voices and every device channel gets
+// the same sample. A voice sounding alone peaks at level; chords share it by power, and are scaled
+// down further where their summed peak would pass the ceiling.
+class ToneSynth {
+public:
+    ToneSynth(const std::vector<ToneStep>& steps, UINT32 sampleRate, float level, float ceiling)
+        : steps_(steps), sampleRate_(sampleRate), level_(level), ceiling_(ceiling) {
+        for (const ToneStep& step : steps_) total_ += StepFrames(step);
+    }
+
+    size_t TotalFrames() const { return total_; }
+
+    // Write up to count of the next frames; returns the frames written, 0 once the pattern has ended
+    size_t Render(float* out, size_t count, UINT32 channels) {
+        size_t written = 0;
+        while (written < count && step_ < steps_.size()) {
+            const ToneStep& step = steps_[step_];
+            const size_t frames = StepFrames(step);
+            if (frame_ == 0) StartStep(step, frames);
+            size_t run = (std::min)(count - written, frames - frame_);
+            for (size_t i = 0; i < run; i++, frame_++) {
+                float sample = 0.0f;
+                for (UINT32 v = 0; v < step.voices; v++) {
+                    sample += sinf(static_cast<float>(phase_[v]));
+                    phase_[v] += increment_[v];
+                    while (phase_[v] >= TWO_PI) phase_[v] -= TWO_PI;
+                }
+                sample *= amplitude_ * Envelope(step);
+                float* frame = out + (written + i) * channels;
+                for (UINT32 ch = 0; ch < channels; ch++) frame[ch] = sample;
+            }
+            written += run;
+            if (frame_ == frames) {
+                frame_ = 0;
+                step_++;
+            }
+        }
+        return written;
+    }
+
+private:
+    size_t StepFrames(const ToneStep& step) const {
+        return static_cast<size_t>(step.duration * sampleRate_ + 0.5f);
+    }
+
+    void StartStep(const ToneStep& step, size_t frames) {
+        for (UINT32 v = 0; v < step.voices; v++) {
+            phase_[v] = 0.0;
+            increment_[v] = TWO_PI * step.freqs[v] / sampleRate_;
+        }
+        amplitude_ = step.voices == 0 ? 0.0f
+                   : (std::min)(level_ / sqrtf(static_cast<float>(step.voices)), ceiling_ / step.voices);
+        attackFrames_ = (std::min)(static_cast<size_t>(step.attack * sampleRate_), frames / 2);
+        releaseFrames_ = (std::min)(static_cast<size_t>(step.release * sampleRate_), frames - attackFrames_);
+        decay_ = step.bell ? expf(-1.0f / (TONE_BELL_DECAY * step.duration * sampleRate_)) : 1.0f;
+        sustain_ = 1.0f;
+    }
+
+    // Envelope at frame_: attack ramp, sustain or bell decay, release ramp
+    float Envelope(const ToneStep& step) {
+        const size_t frames = StepFrames(step);
+        float gain;
+        if (frame_ < attackFrames_) {
+            gain = static_cast<float>(frame_) / attackFrames_;
+        }
+        else {
+            gain = sustain_;
+            sustain_ *= decay_;
+        }
+        if (frame_ + releaseFrames_ >= frames && releaseFrames_ > 0) {
+            gain *= static_cast<float>(frames - frame_) / releaseFrames_;
+        }
+        return gain;
+    }
+
+    const std::vector<ToneStep>& steps_;
+    UINT32 sampleRate_;
+    float level_;
+    float ceiling_;
+    size_t total_ = 0;
+    size_t step_ = 0;                    // Step being rendered and the next frame within it
+    size_t frame_ = 0;
+    double phase_[TONE_MAX_VOICES] = {};
+    double increment_[TONE_MAX_VOICES] = {};
+    float amplitude_ = 0.0f;
+    size_t attackFrames_ = 0;
+    size_t releaseFrames_ = 0;
+    float decay_ = 1.0f;                 // Per-frame factor of the bell decay; 1 sustains
+    float sustain_ = 1.0f;
+};
+
+// Single-producer single-consumer float ring whose storage is mapped twice, back to back
+//
+// The second view aliases the first, so a span of up to Capacity() floats starting anywhere in the
+// ring is contiguous in memory: the writer converts straight into it and the reader hands it to the
+// device in one piece, with no split at the wraparound. The placeholder APIs this needs (VirtualAlloc2,
+// MapViewOfFile3) arrived in Windows 10 1803 and are looked up at run time; without them the ring is
+// a single allocation and spans end at the wraparound, so both sides already loop over spans.
+//
+// Positions are free-running counts of floats. The writer fills floats past Head(), then publishes
+// them with Publish (release); the reader sees them through ReadSpan (acquire) and returns them with
+// Release, which the writer observes the same way. Neither side takes a lock.
+class MirroredRing {
+public:
+    MirroredRing() = default;
+    MirroredRing(const MirroredRing&) = delete;
+    MirroredRing& operator=(const MirroredRing&) = delete;
+
+    ~MirroredRing() {
+        if (mirrored_) {
+            UnmapViewOfFile(base_);
+            UnmapViewOfFile(base_ + capacity_);
+        }
+        else if (base_) {
+            VirtualFree(base_, 0, MEM_RELEASE);
+        }
+        if (section_) CloseHandle(section_);
+    }
+
+    // Allocate at least minFloats floats. The fallback capacity is a multiple of granule so whole
+    // frames never straddle its wraparound.
+    bool Create(size_t minFloats, UINT32 granule) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        size_t align = info.dwAllocationGranularity;
+        size_t bytes = (minFloats * sizeof(float) + align - 1) / align * align;
+        if (CreateMirrored(bytes)) return true;
+
+        capacity_ = bytes / sizeof(float) / granule * granule;
+        base_ = static_cast<float*>(VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+        return base_ != nullptr;
+    }
+
+    size_t Capacity() const { return capacity_; }
+    bool Mirrored() const { return mirrored_; }
+
+    // Writer: contiguous free floats at Head()
+    float* WriteSpan(size_t& floats) const {
+        size_t offset = static_cast<size_t>(head_ % capacity_);
+        floats = capacity_ - static_cast<size_t>(head_ - read_.load(std::memory_order_acquire));
+        if (!mirrored_) floats = (std::min)(floats, capacity_ - offset);
+        return base_ + offset;
+    }
+
+    // Writer: floats written at Head() become part of the ring, still unpublished
+    void Advance(size_t floats) { head_ += floats; }
+    uint64_t Head() const { return head_; }
+
+    // Writer: the float at an unpublished position (ring storage is not contiguous without the mirror)
+    float& At(uint64_t position) { return base_[position % capacity_]; }
+
+    // Writer: make everything before position (at most Head()) visible to the reader
+    void Publish(uint64_t position) { written_.store(position, std::memory_order_release); }
+
+    // Reader: contiguous published floats
+    const float* ReadSpan(size_t& floats) const {
+        uint64_t read = read_.load(std::memory_order_relaxed);
+        size_t offset = static_cast<size_t>(read % capacity_);
+        floats = static_cast<size_t>(written_.load(std::memory_order_acquire) - read);
+        if (!mirrored_) floats = (std::min)(floats, capacity_ - offset);
+        return base_ + offset;
+    }
+
+    // Reader: hand floats at the front of the ring back to the writer
+    void Release(size_t floats) {
+        read_.store(read_.load(std::memory_order_relaxed) + floats, std::memory_order_release);
+    }
+
+private:
+    using VirtualAlloc2Fn = void* (WINAPI*)(HANDLE, void*, SIZE_T, ULONG, ULONG, void*, ULONG);
+    using MapViewOfFile3Fn = void* (WINAPI*)(HANDLE, HANDLE, void*, ULONG64, SIZE_T, ULONG, ULONG, void*, ULONG);
+    // winnt.h values, named here for SDKs that predate placeholders
+    static constexpr ULONG RESERVE_PLACEHOLDER  = 0x00040000;
+    static constexpr ULONG REPLACE_PLACEHOLDER  = 0x00004000;
+    static constexpr ULONG PRESERVE_PLACEHOLDER = 0x00000002;
+
+    // Reserve a 2 * bytes placeholder, split it in two, and map one pagefile-backed section into both
+    bool CreateMirrored(size_t bytes) {
+        HMODULE kernelBase = GetModuleHandleW(L"kernelbase.dll");
+        if (!kernelBase) return false;
+        auto virtualAlloc2 = reinterpret_cast<VirtualAlloc2Fn>(GetProcAddress(kernelBase, "VirtualAlloc2"));
+        auto mapViewOfFile3 = reinterpret_cast<MapViewOfFile3Fn>(GetProcAddress(kernelBase, "MapViewOfFile3"));
+        if (!virtualAlloc2 || !mapViewOfFile3) return false;
+
+        BYTE* first = nullptr;
+        BYTE* second = nullptr;
+        bool firstMapped = false;
+        bool ok = false;
+        do {
+            section_ = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                          static_cast<DWORD>(static_cast<uint64_t>(bytes) >> 32),
+                                          static_cast<DWORD>(bytes), nullptr);
+            if (!section_) break;
+            first = static_cast<BYTE*>(virtualAlloc2(nullptr, nullptr, bytes * 2, MEM_RESERVE | RESERVE_PLACEHOLDER,
+                                                     PAGE_NOACCESS, nullptr, 0));
+            if (!first) break;
+            if (!VirtualFree(first, bytes, MEM_RELEASE | PRESERVE_PLACEHOLDER)) break;
+            second = first + bytes;
+            if (!mapViewOfFile3(section_, nullptr, first, 0, bytes, REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0)) break;
+            firstMapped = true;
+            if (!mapViewOfFile3(section_, nullptr, second, 0, bytes, REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0)) break;
+            ok = true;
+        } while (false);
+
+        if (ok) {
+            base_ = reinterpret_cast<float*>(first);
+            capacity_ = bytes / sizeof(float);
+            mirrored_ = true;
+            return true;
+        }
+        if (firstMapped) UnmapViewOfFile(first);
+        else if (first) VirtualFree(first, 0, MEM_RELEASE);
+        if (second) VirtualFree(second, 0, MEM_RELEASE);
+        if (section_) CloseHandle(section_);
+        section_ = nullptr;
+        return false;
+    }
+
+    float* base_ = nullptr;
+    size_t capacity_ = 0;                // Floats
+    bool mirrored_ = false;
+    HANDLE section_ = nullptr;
+    uint64_t head_ = 0;                  // Writer only: end of written floats
+    std::atomic<uint64_t> written_{0};   // End of published floats
+    std::atomic<uint64_t> read_{0};      // End of released floats
+};
+
+// Headerless PCM written incrementally through minply_stream_write (e.g. TTS output on stdin)
+//
+// The writer thread converts each block to the device format as it arrives, directly into a
+// MirroredRing the render thread plays from; a writer that gets STREAM_RING_DURATION ahead of playback
+// waits for space. Resampling runs over the whole stream with the PolyphaseResampler: an output frame
+// is produced once every source frame its filter reads has arrived, and the source frames its
+// successors still read are kept as history, so the frames equal those ConvertFormatInto would
+// produce for the concatenated input. Ratios the resampler rejects fall back to linear interpolation
+// as they do there. Loudness normalization needs the complete signal and is not applied; the start
+// is faded in, and the last FADE_DURATION of output is left unpublished until End() so it can be
+// faded out in place. A tempo other than 1 runs the source through a WsolaStretcher before resampling,
+// whatever the stream's length; its lookahead is bounded, so playback still starts with the first blocks.
+class PcmStream {
+public:
+    PcmStream(UINT32 format, UINT32 sampleRate, UINT32 channels)
+        : format_(format), srcRate_(sampleRate), srcChannels_(channels) {}
+    PcmStream(const PcmStream&) = delete;
+    PcmStream& operator=(const PcmStream&) = delete;
+
+    ~PcmStream() {
+        if (event_) CloseHandle(event_);
+        if (space_) CloseHandle(space_);
+    }
+
+    bool Init(UINT32 dstRate, UINT32 dstChannels, float tempo = 1.0f) {
+        dstRate_ = dstRate;
+        dstChannels_ = dstChannels;
+        polyphase_ = srcRate_ != dstRate && resampler_.Init(srcRate_, dstRate, srcChannels_);
+        if (polyphase_) {
+            history_ = resampler_.History();
+            lookahead_ = resampler_.Lookahead();
+        }
+        stretch_ = tempo != 1.0f && stretcher_.Init(srcRate_, srcChannels_, tempo);
+        fadeFrames_ = static_cast<UINT32>(dstRate * FADE_DURATION);
+        size_t ringFrames = (std::max)(static_cast<size_t>(dstRate * STREAM_RING_DURATION),
+                                       static_cast<size_t>(fadeFrames_) * 4);
+        if (!ring_.Create(ringFrames * dstChannels, dstChannels)) return false;
+        event_ = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        space_ = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        return event_ != nullptr && space_ != nullptr;
+    }
+
+    UINT32 FrameBytes() const { return (format_ == MINPLY_FORMAT_S16LE ? 2 : 4) * srcChannels_; }
+
+    // Append raw bytes; a trailing partial frame is carried over to the next write.
+    // Blocks while the ring is full.
+    void Write(const BYTE* data, size_t size) {
+        // Only the writer stores; the release publishes firstWrite_ to FirstWrite on the render thread
+        if (!firstWriteTaken_.load(std::memory_order_relaxed)) {
+            QueryPerformanceCounter(&firstWrite_);
+            firstWriteTaken_.store(true, std::memory_order_release);
+        }
+        if (detached_) return;
+        const UINT32 frameBytes = FrameBytes();
+        size_t used = 0;
+        if (!carry_.empty()) {
+            used = (std::min)(size, frameBytes - carry_.size());
+            carry_.insert(carry_.end(), data, data + used);
+            if (carry_.size() < frameBytes) return;
+            AppendSource(carry_.data(), 1);
+            carry_.clear();
+        }
+        size_t frames = (size - used) / frameBytes;
+        AppendSource(data + used, frames);
+        used += frames * frameBytes;
+        carry_.assign(data + used, data + size);
+        Produce(false);
+    }
+
+    // End of input: flush the stretcher and the resampler, fade out the held-back tail and publish it
+    void End() {
+        if (stretch_) {
+            size_t before = source_.size();
+            stretcher_.Flush(source_);
+            sourceTotal_ += (source_.size() - before) / srcChannels_;
+        }
+        Produce(true);
+        uint64_t head = ring_.Head();
+        UINT32 tailFrames = static_cast<UINT32>((head - published_) / dstChannels_);
+        UINT32 fade = (std::min)(fadeFrames_, tailFrames);
+        for (UINT32 i = 0; i < fade; i++) {
+            float gain = static_cast<float>(fade - i) / fadeFrames_;
+            uint64_t frame = head - static_cast<uint64_t>(fade - i) * dstChannels_;
+            for (UINT32 ch = 0; ch < dstChannels_; ch++) {
+                ring_.At(frame + ch) *= gain;
+            }
+        }
+        ring_.Publish(head);
+        published_ = head;
+        ended_.store(true, std::memory_order_release);
+        SetEvent(event_);
+    }
+
+    // Render side: published frames (at most a quarter of the ring, so the writer can keep filling
+    // while they play); return them with Release. Read Ended() before ReadSpan: an empty span after
+    // an ended stream means it has played out.
+    const float* ReadSpan(size_t& frames) const {
+        size_t floats;
+        const float* span = ring_.ReadSpan(floats);
+        frames = (std::min)(floats, ring_.Capacity() / 4) / dstChannels_;
+        return span;
+    }
+
+    void Release(size_t frames) {
+        ring_.Release(frames * dstChannels_);
+        SetEvent(space_);
+    }
+
+    bool Ended() const { return ended_.load(std::memory_order_acquire); }
+
+    // End without flushing, e.g. after a failed write; whatever is published still plays
+    void Abort() {
+        ended_.store(true, std::memory_order_release);
+        SetEvent(event_);
+    }
+
+    // Render side gave up on the stream: a writer waiting for space returns, later writes are dropped
+    void Detach() {
+        detached_ = true;
+        SetEvent(space_);
+    }
+
+    HANDLE Event() const { return event_; }
+    bool FirstWrite(LARGE_INTEGER& time) const {
+        if (!firstWriteTaken_.load(std::memory_order_acquire)) return false;
+        time = firstWrite_;
+        return true;
+    }
+
+private:
+    void AppendSource(const BYTE* data, size_t frames) {
+        // Stretched streams convert into unstretched_ and append the stretcher's output to source_
+        std::vector<float>& target = stretch_ ? unstretched_ : source_;
+        size_t samples = frames * srcChannels_;
+        size_t base = target.size();
+        target.resize(base + samples);
+        if (format_ == MINPLY_FORMAT_S16LE) {
+            for (size_t i = 0; i < samples; i++) {
+                int16_t v;
+                memcpy(&v, data + i * 2, 2);
+                target[base + i] = static_cast<float>(v) / PCM16_SCALE;
+            }
+        }
+        else {
+            memcpy(&target[base], data, samples * sizeof(float));
+        }
+        if (stretch_) {
+            size_t before = source_.size();
+            stretcher_.Push(unstretched_.data(), frames, source_);
+            unstretched_.clear();
+            frames = (source_.size() - before) / srcChannels_;
+        }
+        sourceTotal_ += frames;
+    }
+
+    // Publish everything but the fade-out span
+    void PublishHeld() {
+        uint64_t hold = static_cast<uint64_t>(fadeFrames_) * dstChannels_;
+        uint64_t head = ring_.Head();
+        if (head < published_ + hold + dstChannels_) return;
+        published_ = head - hold;
+        ring_.Publish(published_);
+        SetEvent(event_);
+    }
+
+    // Emit every output frame whose filter inputs are available (all of them when final)
+    void Produce(bool final) {
+        size_t bufferedFrames = source_.size() / srcChannels_;
+        uint64_t endFrame = sourceBase_ + bufferedFrames;
+        uint64_t outputLimit = sourceTotal_ * dstRate_ / srcRate_;
+        // Output frame i reads source frames up to i * srcRate / dstRate + lookahead_
+        uint64_t ready = outputLimit;
+        if (!final) {
+            ready = endFrame > lookahead_ ? ((endFrame - lookahead_) * dstRate_ + srcRate_ - 1) / srcRate_ : 0;
+            ready = (std::min)(ready, outputLimit);
+        }
+        const size_t signalFrames = static_cast<size_t>(final ? sourceTotal_ : endFrame);
+
+        while (outIndex_ < ready && !detached_) {
+            size_t floats;
+            float* span = ring_.WriteSpan(floats);
+            size_t frames = static_cast<size_t>((std::min)(static_cast<uint64_t>(floats / dstChannels_), ready - outIndex_));
+            if (frames == 0) {
+                // Full: let the renderer drain what is already converted
+                PublishHeld();
+                WaitForSingleObject(space_, BUFFER_WAIT_MS);
+                continue;
+            }
+            if (polyphase_) {
+                resampler_.Run(source_.data(), static_cast<size_t>(sourceBase_), signalFrames, span,
+                               static_cast<size_t>(outIndex_), static_cast<size_t>(outIndex_ + frames), dstChannels_, 1.0f);
+            }
+            else {
+                for (size_t i = 0; i < frames; i++) {
+                    uint64_t position = (outIndex_ + i) * srcRate_;
+                    uint64_t idx0 = position / dstRate_;
+                    uint64_t idx1 = (std::min)(idx0 + 1, sourceTotal_ - 1);
+                    float frac = static_cast<float>(position % dstRate_) / dstRate_;
+                    const float* f0 = &source_[(idx0 - sourceBase_) * srcChannels_];
+                    const float* f1 = &source_[(idx1 - sourceBase_) * srcChannels_];
+                    float* out = span + i * dstChannels_;
+                    for (UINT32 ch = 0; ch < dstChannels_; ch++) {
+                        UINT32 srcCh = (std::min)(ch, srcChannels_ - 1);
+                        out[ch] = f0[srcCh] + (f1[srcCh] - f0[srcCh]) * frac;
+                    }
+                }
+            }
+            for (uint64_t i = outIndex_; i < outIndex_ + frames && i < fadeFrames_; i++) {
+                float gain = static_cast<float>(i) / fadeFrames_;
+                float* out = span + (i - outIndex_) * dstChannels_;
+                for (UINT32 ch = 0; ch < dstChannels_; ch++) out[ch] *= gain;
+            }
+            ring_.Advance(frames * dstChannels_);
+            outIndex_ += frames;
+        }
+
+        // Drop source frames no later output frame can reference
+        uint64_t next = outIndex_ * srcRate_ / dstRate_;
+        uint64_t keepFrom = (std::min)(next > history_ ? next - history_ : 0, endFrame);
+        keepFrom = (std::max)(keepFrom, sourceBase_);
+        source_.erase(source_.begin(), source_.begin() + static_cast<size_t>(keepFrom - sourceBase_) * srcChannels_);
+        sourceBase_ = keepFrom;
+
+        PublishHeld();
+    }
+
+    UINT32 format_;
+    UINT32 srcRate_;
+    UINT32 srcChannels_;
+    UINT32 dstRate_ = 0;
+    UINT32 dstChannels_ = 0;
+    UINT32 fadeFrames_ = 0;
+
+    // Writer thread state
+    std::vector<BYTE> carry_;            // Partial frame left over from the previous write
+    std::vector<float> source_;          // Source frames from sourceBase_ still read by later output frames
+    std::vector<float> unstretched_;     // Converted block on its way into the stretcher
+    WsolaStretcher stretcher_;
+    bool stretch_ = false;
+    PolyphaseResampler resampler_;
+    bool polyphase_ = false;             // Else linear interpolation (equal rates, or a ratio Init rejects)
+    UINT32 history_ = 0;                 // Source frames kept before the next output frame's position
+    UINT32 lookahead_ = 1;               // Source frames read after it
+    uint64_t sourceBase_ = 0;
+    uint64_t sourceTotal_ = 0;
+    uint64_t outIndex_ = 0;              // Next output frame
+    uint64_t published_ = 0;             // Ring position published so far; the rest is the fade-out hold
+    LARGE_INTEGER firstWrite_ = {};
+    std::atomic<bool> firstWriteTaken_{false};
+
+    MirroredRing ring_;
+    std::atomic<bool> ended_{false};
+    std::atomic<bool> detached_{false};
+    HANDLE event_ = nullptr;             // Signaled when frames are published or the stream ends
+    HANDLE space_ = nullptr;             // Signaled when the renderer releases frames or detaches
+};
+
+// Queue of processed buffers handed from concurrently launched processes to one elected renderer
+//
+// No daemon is involved. The first process to finish processing wins the election mutex and renders;
+// later processes copy their processed buffer into a named file mapping, append its name to a small
+// shared ring (guarded by a named mutex) and signal the queue event. The renderer opens each mapping,
+// claims it and sets the item's ack event while still holding the lock, after which the client may
+// exit: the renderer's handle keeps the mapping alive. Ownership is decided by the item's owner
+// field alone: renderer and client both try to claim it with a compare-exchange, and only a client
+// that finds the renderer's claim treats its sound as handed off. A client that gets no ack within
+// SHARED_ACK_TIMEOUT_MS claims the item itself and plays it, so a stuck or exiting renderer does
+// not lose its sound, and a late renderer cannot play it a second time.
+// Items the renderer has already acked are lost if its device then fails: their clients have exited.
+// All objects live in the Local\ namespace, i.e. per logon session like the audio session itself.
+class SharedRenderQueue {
+public:
+    // Layout of the shared ring mapping
+    struct Header {
+        LONG    accepting;      // Nonzero while a renderer will still take new items
+        DWORD   rendererPid;
+        DWORD   head;
+        DWORD   count;
+        wchar_t names[SHARED_QUEUE_SLOTS][SHARED_ITEM_NAME_LEN];
+    };
+
+    // Layout at the start of each item mapping; interleaved float samples follow
+    struct ItemHeader {
+        UINT32 sampleRate;
+        UINT32 channels;
+        UINT64 sampleCount;
+        float  gain;
+        volatile LONG owner;    // SHARED_OWNER_*; claimed once with InterlockedCompareExchange
+    };
+
+    enum : LONG { SHARED_OWNER_NONE = 0, SHARED_OWNER_RENDERER = 1, SHARED_OWNER_CLIENT = 2 };
+
+    // Item taken over by the renderer; owns the mapping handle and view until Release
+    class Item {
+    public:
+        Item() = default;
+        Item(const Item&) = delete;
+        Item& operator=(const Item&) = delete;
+        ~Item() { Release(); }
+
+        const float* Samples() const { return reinterpret_cast<const float*>(header_ + 1); }
+        size_t SampleCount() const { return static_cast<size_t>(info_.sampleCount); }
+        UINT32 SampleRate() const { return info_.sampleRate; }
+        UINT32 Channels() const { return info_.channels; }
+        float Gain() const { return info_.gain; }
+
+        void Release() {
+            if (header_) UnmapViewOfFile(header_);
+            if (mapping_) CloseHandle(mapping_);
+            header_ = nullptr;
+            mapping_ = nullptr;
+        }
+
+    private:
+        friend class SharedRenderQueue;
+        HANDLE mapping_ = nullptr;
+        const ItemHeader* header_ = nullptr;
+        ItemHeader info_ = {};    // Header as validated on accept; the view stays writable by its creator
+    };
+
+    SharedRenderQueue() = default;
+    SharedRenderQueue(const SharedRenderQueue&) = delete;
+    SharedRenderQueue& operator=(const SharedRenderQueue&) = delete;
+
+    ~SharedRenderQueue() {
+        for (auto& item : pending_) {
+            if (item.header_) UnmapViewOfFile(item.header_);
+            if (item.mapping_) CloseHandle(item.mapping_);
+        }
+        // Normally already resigned; this covers early-exit paths so clients stop queuing immediately
+        Resign();
+        if (header_) UnmapViewOfFile(header_);
+        if (ring_) CloseHandle(ring_);
+        if (event_) CloseHandle(event_);
+        if (lock_) CloseHandle(lock_);
+        if (election_) CloseHandle(election_);
+    }
+
+    // Create or open the named objects; false if any is unavailable (the caller then plays standalone)
+    bool Open() {
+        election_ = CreateMutexW(nullptr, FALSE, L"Local\\minply.renderer");
+        lock_ = CreateMutexW(nullptr, FALSE, L"Local\\minply.queue.lock");
+        event_ = CreateEventW(nullptr, FALSE, FALSE, L"Local\\minply.queue.event");
+        // Page-file backed mappings are zero-initialized on creation, i.e. an empty ring that is not accepting
+        ring_ = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(Header),
+                                   L"Local\\minply.queue");
+        if (!election_ || !lock_ || !event_ || !ring_) return false;
+        header_ = static_cast<Header*>(MapViewOfFile(ring_, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Header)));
+        return header_ != nullptr;
+    }
+
+    // Try to win the election without waiting. An abandoned mutex (crashed renderer) also counts as a win.
+    // The renderer only claims items already in its device format, so the render thread never converts;
+    // items in any other format are acked unclaimed and their client plays them itself.
+    bool TryBecomeRenderer(UINT32 sampleRate, UINT32 channels) {
+        if (isRenderer_) return true;
+        DWORD result = WaitForSingleObject(election_, 0);
+        if (result != WAIT_OBJECT_0 && result != WAIT_ABANDONED) return false;
+        isRenderer_ = true;
+        sampleRate_ = sampleRate;
+        channels_ = channels;
+        if (Lock()) {
+            header_->accepting = 1;
+            header_->rendererPid = GetCurrentProcessId();
+            Unlock();
+        }
+        return true;
+    }
+
+    // Client side: hand a processed buffer to the renderer.
+    // Returns true once the renderer owns it; false means the caller must play it itself.
+    bool Submit(const std::vector<float>& samples, UINT32 sampleRate, UINT32 channels, float gain) {
+        if (!(gain >= 0.0f && gain <= SHARED_MAX_GAIN)) return false;
+        // Every session of a DLL host submits from its own render thread
+        static volatile LONG sequence = 0;
+        wchar_t name[SHARED_ITEM_NAME_LEN];
+        wchar_t ackName[SHARED_ITEM_NAME_LEN];
+        swprintf(name, SHARED_ITEM_NAME_LEN, L"Local\\minply.item.%lu.%ld",
+                 static_cast<unsigned long>(GetCurrentProcessId()),
+                 static_cast<long>(InterlockedIncrement(&sequence)));
+        swprintf(ackName, SHARED_ITEM_NAME_LEN, L"%ls.ack", name);
+
+        UINT64 bytes = sizeof(ItemHeader) + static_cast<UINT64>(samples.size()) * sizeof(float);
+        HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                            static_cast<DWORD>(bytes >> 32), static_cast<DWORD>(bytes), name);
+        if (!mapping) return false;
+        // An existing object of the same name is someone else's item, never ours to fill
+        if (GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(mapping);
+            return false;
+        }
+        HANDLE ack = CreateEventW(nullptr, TRUE, FALSE, ackName);
+        void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (!ack || !view) {
+            if (view) UnmapViewOfFile(view);
+            if (ack) CloseHandle(ack);
+            CloseHandle(mapping);
+            return false;
+        }
+        auto* item = static_cast<ItemHeader*>(view);
+        item->sampleRate = sampleRate;
+        item->channels = channels;
+        item->sampleCount = samples.size();
+        item->gain = gain;
+        item->owner = SHARED_OWNER_NONE;
+        if (!samples.empty()) memcpy(item + 1, samples.data(), samples.size() * sizeof(float));
+
+        bool queued = false;
+        if (Lock()) {
+            if (header_->accepting && header_->count < SHARED_QUEUE_SLOTS) {
+                DWORD slot = (header_->head + header_->count) % SHARED_QUEUE_SLOTS;
+                memcpy(header_->names[slot], name, sizeof(name));
+                header_->count++;
+                queued = true;
+            }
+            Unlock();
+        }
+
+        bool handedOff = false;
+        if (queued) {
+            SetEvent(event_);
+            WaitForSingleObject(ack, SHARED_ACK_TIMEOUT_MS);
+            // The renderer claims before it acks; after a timeout the claim below settles any race with it
+            handedOff = InterlockedCompareExchange(&item->owner, SHARED_OWNER_CLIENT, SHARED_OWNER_NONE) ==
+                        SHARED_OWNER_RENDERER;
+            if (!handedOff && Lock()) {
+                // Tidy the ring; a renderer that still finds the name cannot claim the item any more
+                Withdraw(name);
+                Unlock();
+            }
+        }
+
+        UnmapViewOfFile(view);
+        CloseHandle(ack);
+        CloseHandle(mapping);
+        return handedOff;
+    }
+
+    bool IsRenderer() const { return isRenderer_; }
+
+    // Auto-reset event signaled whenever a client queues an item
+    HANDLE Event() const { return event_; }
+
+    // Renderer side: take ownership of every queued item. Cheap when nothing was signaled.
+    // Pass signaled = true when the caller has already consumed the queue event in its own wait.
+    void Accept(bool signaled = false) {
+        if (!signaled && WaitForSingleObject(event_, 0) != WAIT_OBJECT_0) return;
+        if (!Lock()) {
+            SetEvent(event_);    // Retry on the next poll
+            return;
+        }
+        TakeQueued();
+        Unlock();
+    }
+
+    // Renderer side: pop the next accepted item
+    bool Next(Item& item) {
+        Accept();
+        if (pending_.empty()) return false;
+        item.Release();
+        item.mapping_ = pending_.front().mapping_;
+        item.header_ = pending_.front().header_;
+        item.info_ = pending_.front().info_;
+        pending_.erase(pending_.begin());
+        return true;
+    }
+
+    // Renderer side: whether accepted items are waiting to be played
+    bool HasPending() {
+        Accept();
+        return !pending_.empty();
+    }
+
+    // Renderer side: give up the renderer role. Must run on the thread that won the election,
+    // because mutex ownership is per thread.
+    void Resign() {
+        if (!isRenderer_) return;
+        if (Lock()) {
+            header_->accepting = 0;
+            Unlock();
+        }
+        ReleaseMutex(election_);
+        isRenderer_ = false;
+    }
+
+    // Renderer side: give up the role after the device failed, dropping every accepted item.
+    // Their clients were acked and have exited, so those sounds are lost; new clients play standalone.
+    void Abandon() {
+        Resign();
+        for (auto& item : pending_) {
+            if (item.header_) UnmapViewOfFile(item.header_);
+            if (item.mapping_) CloseHandle(item.mapping_);
+        }
+        pending_.clear();
+    }
+
+    // Renderer side: stop accepting if nothing is left. Returns false when items remain to be played.
+    bool Close() {
+        if (!Lock()) return pending_.empty();
+        TakeQueued();
+        if (pending_.empty()) header_->accepting = 0;
+        Unlock();
+        return pending_.empty();
+    }
+
+private:
+    struct Pending {
+        HANDLE mapping_;
+        const ItemHeader* header_;
+        ItemHeader info_;
+    };
+
+    bool Lock() {
+        DWORD result = WaitForSingleObject(lock_, SHARED_LOCK_TIMEOUT_MS);
+        return result == WAIT_OBJECT_0 || result == WAIT_ABANDONED;
+    }
+    void Unlock() { ReleaseMutex(lock_); }
+
+    // Remove a queued name from the ring; caller holds the lock
+    bool Withdraw(const wchar_t* name) {
+        for (DWORD i = 0; i < header_->count; i++) {
+            DWORD slot = (header_->head + i) % SHARED_QUEUE_SLOTS;
+            if (wcsncmp(header_->names[slot], name, SHARED_ITEM_NAME_LEN) != 0) continue;
+            // Shift later entries down to keep FIFO order
+            for (DWORD j = i; j + 1 < header_->count; j++) {
+                DWORD from = (header_->head + j + 1) % SHARED_QUEUE_SLOTS;
+                DWORD to = (header_->head + j) % SHARED_QUEUE_SLOTS;
+                memcpy(header_->names[to], header_->names[from], sizeof(header_->names[to]));
+            }
+            header_->count--;
+            return true;
+        }
+        return false;
+    }
+
+    // Snapshot an item header if it describes samples that fit in the mapped view.
+    // The header comes from another process, so nothing in it is trusted before this check.
+    static bool ValidateItem(const void* view, ItemHeader& info) {
+        MEMORY_BASIC_INFORMATION region;
+        if (VirtualQuery(view, &region, sizeof(region)) != sizeof(region)) return false;
+        if (region.RegionSize < sizeof(ItemHeader)) return false;
+        memcpy(&info, view, sizeof(info));
+        if (info.channels == 0 || info.channels > WAV_MAX_CHANNELS) return false;
+        if (info.sampleRate == 0 || info.sampleRate > SHARED_MAX_RATE) return false;
+        if (!(info.gain >= 0.0f && info.gain <= SHARED_MAX_GAIN)) return false;    // Also rejects NaN
+        if (info.sampleCount % info.channels != 0) return false;
+        return info.sampleCount <= (region.RegionSize - sizeof(ItemHeader)) / sizeof(float);
+    }
+
+    // Open, claim and ack every queued item; caller holds the lock.
+    // Items whose client has already gone (mapping no longer exists) are dropped, as are items
+    // whose header fails ValidateItem, that are not in the renderer's device format, or that their
+    // client already claimed after a timeout.
+    // Every item is acked, so a client whose item was not taken plays it without waiting further.
+    void TakeQueued() {
+        while (header_->count > 0) {
+            wchar_t name[SHARED_ITEM_NAME_LEN];
+            memcpy(name, header_->names[header_->head], sizeof(name));
+            name[SHARED_ITEM_NAME_LEN - 1] = L'\0';
+            header_->head = (header_->head + 1) % SHARED_QUEUE_SLOTS;
+            header_->count--;
+
+            HANDLE mapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+            if (!mapping) continue;
+            void* view = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+            if (!view) {
+                CloseHandle(mapping);
+                continue;
+            }
+            ItemHeader info;
+            if (ValidateItem(view, info) && info.sampleRate == sampleRate_ && info.channels == channels_ &&
+                InterlockedCompareExchange(&static_cast<ItemHeader*>(view)->owner, SHARED_OWNER_RENDERER,
+                                           SHARED_OWNER_NONE) == SHARED_OWNER_NONE) {
+                pending_.push_back({ mapping, static_cast<const ItemHeader*>(view), info });
+            }
+            else {
+                UnmapViewOfFile(view);
+                CloseHandle(mapping);
+            }
+
+            wchar_t ackName[SHARED_ITEM_NAME_LEN];
+            swprintf(ackName, SHARED_ITEM_NAME_LEN, L"%ls.ack", name);
+            HANDLE ack = OpenEventW(EVENT_MODIFY_STATE, FALSE, ackName);
+            if (ack) {
+                SetEvent(ack);
+                CloseHandle(ack);
+            }
+        }
+    }
+
+    HANDLE election_ = nullptr;
+    HANDLE lock_ = nullptr;
+    HANDLE event_ = nullptr;
+    HANDLE ring_ = nullptr;
+    Header* header_ = nullptr;
+    bool isRenderer_ = false;
+    UINT32 sampleRate_ = 0;    // Device format of the renderer; only matching items are claimed
+    UINT32 channels_ = 0;
+    std::vector<Pending> pending_;
+};
+
+// WASAPI shared-mode render client kept open across sounds
+//
+// Open activates the default endpoint once; Start/Stop bracket each burst of sounds so an idle
+// session costs nothing while the next burst skips endpoint activation and client initialization.
+// The stream format chosen at Open is kept for the life of the session: Reopen activates a new default
+// endpoint in that same format (converted by the audio engine if its mix format differs), so buffers
+// already processed for the session stay playable after the user switches or loses the device.
+class RenderDevice {
+public:
+    RenderDevice() = default;
+    RenderDevice(const RenderDevice&) = delete;
+    RenderDevice& operator=(const RenderDevice&) = delete;
+
+    ~RenderDevice() {
+        ReleaseClient();
+        if (deviceEnumerator_) deviceEnumerator_->Release();
+        if (eventHandle_) CloseHandle(eventHandle_);
+        if (mixFormat_) CoTaskMemFree(mixFormat_);
+    }
+
+    // Activate the default endpoint in its mix format; errors are reported to stderr
+    bool Open() {
+        HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
+                                      __uuidof(IMMDeviceEnumerator), (void**)&deviceEnumerator_);
+        if (FAILED(hr)) {
+            PrintError("Failed to create device enumerator");
+            return false;
+        }
+
+        eventHandle_ = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!eventHandle_) {
+            PrintError("Failed to create event");
+            return false;
+        }
+
+        return Activate();
+    }
+
+    // Drop the current endpoint and activate the default one again in the session's stream format.
+    // Used after AUDCLNT_E_DEVICE_INVALIDATED or a change of the default device; errors go to stderr.
+    bool Reopen() {
+        ReleaseClient();
+        lastError_ = S_OK;
+        return Activate();
+    }
+
+    // Whether the last failure means the endpoint is gone (unplugged, disabled or format changed)
+    bool Invalidated() const { return lastError_ == AUDCLNT_E_DEVICE_INVALIDATED; }
+
+    // Whether the user picked another default device since Open/Reopen. Costs a few COM calls,
+    // so it is checked once per burst rather than per buffer.
+    bool DefaultChanged() {
+        if (!deviceEnumerator_ || !endpointId_) return false;
+        IMMDevice* current = nullptr;
+        if (FAILED(deviceEnumerator_->GetDefaultAudioEndpoint(eRender, eConsole, &current))) return false;
+        LPWSTR id = nullptr;
+        bool changed = SUCCEEDED(current->GetId(&id)) && wcscmp(id, endpointId_) != 0;
+        if (id) CoTaskMemFree(id);
+        current->Release();
+        return changed;
+    }
+
+    // Mix format of the endpoint itself; differs from Format() after Reopen onto another device
+    UINT32 DeviceSampleRate() const { return deviceRate_; }
+    UINT32 DeviceChannels() const { return deviceChannels_; }
+
+    const WAVEFORMATEX* Format() const { return mixFormat_; }
+
+    bool Start() {
+        lastError_ = audioClient_->Start();
+        if (FAILED(lastError_)) {
+            PrintError("Failed to start audio client");
+            return false;
+        }
+        return true;
+    }
+
+    void Stop() {
+        if (!audioClient_) return;    // A failed Reopen leaves no client
+        audioClient_->Stop();
+        audioClient_->Reset();
+    }
+
+    // Render one span of interleaved frames in the mix format.
+    // When gain is given the span is scaled while copying into the device buffer and follows changes
+    // of gain->target with a linear ramp (used by background loudness refinement).
+    // poll runs between device events so callers can service other work (e.g. handoff acks) promptly.
+    template <typename Poll>
+    bool Render(const float* samples, size_t totalFrames, GainControl* gain, Poll&& poll) {
+        UINT32 channels = mixFormat_->nChannels;
+        float rampFrames = (std::max)(mixFormat_->nSamplesPerSec * GAIN_RAMP_DURATION, 1.0f);
+        // Ramp starts at the initial target so no ramp plays at onset
+        if (gain && !gain->started) {
+            gain->current = gain->rampTarget = gain->target.load();
+            gain->rampStep = 0.0f;
+            gain->started = true;
+        }
+        size_t frameIndex = 0;
+
+        // Stall detection based on consecutive WAIT_TIMEOUT wakeups (event auto-reset guarantees ~BUFFER_WAIT_MS per timeout)
+        int stallCount = 0;
+        while (frameIndex < totalFrames) {
+            poll();
+
+            DWORD waitResult = WaitForSingleObject(eventHandle_, BUFFER_WAIT_MS);
+            if (waitResult == WAIT_TIMEOUT) {
+                if (++stallCount >= RENDER_MAX_STALL_ITERATIONS) {
+                    PrintError("Audio device stopped responding");
+                    return false;
+                }
+                continue;
+            }
+            // Any non-signaled return (WAIT_FAILED / WAIT_ABANDONED) means the audio thread is no longer
+            // pumping; treat this as a hard failure rather than letting the outer loop report success.
+            if (waitResult != WAIT_OBJECT_0) return false;
+
+            UINT32 numFramesPadding;
+            HRESULT hr = audioClient_->GetCurrentPadding(&numFramesPadding);
+            if (FAILED(hr)) {
+                lastError_ = hr;
+                return false;
+            }
+
+            UINT32 numFramesAvailable = bufferFrameCount_ - numFramesPadding;
+            if (numFramesAvailable == 0) continue;
+
+            UINT32 framesToWrite = static_cast<UINT32>(
+                (std::min)(static_cast<size_t>(numFramesAvailable), totalFrames - frameIndex)
+            );
+
+            BYTE* buffer;
+            hr = renderClient_->GetBuffer(framesToWrite, &buffer);
+            if (FAILED(hr)) {
+                lastError_ = hr;
+                return false;
+            }
+
+            if (gain) {
+                float newTarget = gain->target.load(std::memory_order_relaxed);
+                if (newTarget != gain->rampTarget) {
+                    gain->rampTarget = newTarget;
+                    gain->rampStep = fabsf(newTarget - gain->current) / rampFrames;
+                }
+                ScaledCopy(reinterpret_cast<float*>(buffer), samples + frameIndex * channels,
+                           framesToWrite, channels, gain->current, gain->rampTarget, gain->rampStep);
+            }
+            else {
+                size_t byteCount = framesToWrite * mixFormat_->nBlockAlign;
+                memcpy(buffer, samples + frameIndex * channels, byteCount);
+            }
+
+            hr = renderClient_->ReleaseBuffer(framesToWrite, 0);
+            if (FAILED(hr)) {
+                lastError_ = hr;
+                return false;
+            }
+
+            frameIndex += framesToWrite;
+            stallCount = 0;
+        }
+        return true;
+    }
+
+    // Wait for buffered samples to actually play out, with a hard cap so a stuck device cannot hang the process
+    void Drain() {
+        UINT32 numFramesPadding = 0;
+        DWORD drainElapsed = 0;
+        bool drainedCleanly = false;
+        while (drainElapsed < DRAIN_TIMEOUT_MS) {
+            Sleep(DRAIN_POLL_MS);
+            drainElapsed += DRAIN_POLL_MS;
+            HRESULT hr = audioClient_->GetCurrentPadding(&numFramesPadding);
+            if (FAILED(hr)) break;
+            if (numFramesPadding == 0) {
+                drainedCleanly = true;
+                break;
+            }
+        }
+
+        // Only honor the trailing pad when drain completed normally; skip it on timeout to avoid compounding the delay
+        if (drainedCleanly) Sleep(DRAIN_WAIT_MS);
+    }
+
+private:
+    // Activate the current default endpoint. The first activation adopts its mix format as the stream
+    // format; later ones keep the stream format and let the audio engine convert when the new
+    // endpoint's mix format differs.
+    bool Activate() {
+        HRESULT hr = deviceEnumerator_->GetDefaultAudioEndpoint(eRender, eConsole, &device_);
+        if (FAILED(hr)) {
+            PrintError("Failed to get default audio device");
+            return false;
+        }
+        if (FAILED(device_->GetId(&endpointId_))) endpointId_ = nullptr;
+
+        hr = device_->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)&audioClient_);
+        if (FAILED(hr)) {
+            PrintError("Failed to activate audio client");
+            return false;
+        }
+
+        WAVEFORMATEX* deviceFormat = nullptr;
+        hr = audioClient_->GetMixFormat(&deviceFormat);
+        if (FAILED(hr)) {
+            PrintError("Failed to get device format");
+            return false;
+        }
+        deviceRate_ = deviceFormat->nSamplesPerSec;
+        deviceChannels_ = deviceFormat->nChannels;
+        DWORD flags = AUDCLNT_STREAMFLAGS_EVENTCALLBACK;
+        if (!mixFormat_) {
+            mixFormat_ = deviceFormat;
+        }
+        else {
+            if (deviceRate_ != mixFormat_->nSamplesPerSec || deviceChannels_ != mixFormat_->nChannels) {
+                flags |= AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+            }
+            CoTaskMemFree(deviceFormat);
+        }
+
+        hr = audioClient_->Initialize(AUDCLNT_SHAREMODE_SHARED, flags, 0, 0, mixFormat_, nullptr);
+        if (FAILED(hr)) {
+            PrintError("Failed to initialize audio client");
+            return false;
+        }
+
+        hr = audioClient_->SetEventHandle(eventHandle_);
+        if (FAILED(hr)) {
+            PrintError("Failed to set event handle");
+            return false;
+        }
+
+        hr = audioClient_->GetBufferSize(&bufferFrameCount_);
+        if (FAILED(hr)) {
+            PrintError("Failed to get buffer size");
+            return false;
+        }
+
+        hr = audioClient_->GetService(__uuidof(IAudioRenderClient), (void**)&renderClient_);
+        if (FAILED(hr)) {
+            PrintError("Failed to get render client");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Release everything tied to the current endpoint; the enumerator, event and stream format stay
+    void ReleaseClient() {
+        if (renderClient_) renderClient_->Release();
+        if (audioClient_) audioClient_->Release();
+        if (device_) device_->Release();
+        if (endpointId_) CoTaskMemFree(endpointId_);
+        renderClient_ = nullptr;
+        audioClient_ = nullptr;
+        device_ = nullptr;
+        endpointId_ = nullptr;
+    }
+
+    IMMDeviceEnumerator* deviceEnumerator_ = nullptr;
+    IMMDevice* device_ = nullptr;
+    IAudioClient* audioClient_ = nullptr;
+    IAudioRenderClient* renderClient_ = nullptr;
+    HANDLE eventHandle_ = nullptr;
+    WAVEFORMATEX* mixFormat_ = nullptr;     // Stream format; fixed at the first activation
+    LPWSTR endpointId_ = nullptr;           // Endpoint the client was activated on, for DefaultChanged
+    UINT32 deviceRate_ = 0;                 // Mix format of that endpoint
+    UINT32 deviceChannels_ = 0;
+    UINT32 bufferFrameCount_ = 0;
+    HRESULT lastError_ = S_OK;              // Last failure from Start/Render, for Invalidated
+};
+
+// Per-user state directory (%LOCALAPPDATA%\minply), created on demand. Empty on failure.
+static std::wstring GetStateDirectory() {
+    wchar_t base[MAX_PATH] = {};
+    DWORD len = GetEnvironmentVariableW(L"LOCALAPPDATA", base, MAX_PATH);
+    if (len == 0 || len >= MAX_PATH) return {};
+
+    std::wstring dir(base);
+    dir += L"\\minply";
+    if (!CreateDirectoryW(dir.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) return {};
+    return dir;
+}
+
+// On-disk record of the last observed device mix format
+struct CachedMixFormat {
+    char   magic[4];      // "MPMF"
+    UINT32 sampleRate;
+    UINT32 channels;
+};
+
+// Load the device mix format seen by the previous run; false if absent or malformed
+static bool LoadCachedMixFormat(UINT32& sampleRate, UINT32& channels) {
+    std::wstring dir = GetStateDirectory();
+    if (dir.empty()) return false;
+
+    HANDLE hFile = CreateFileW((dir + L"\\mixformat.bin").c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+    CachedMixFormat cached = {};
+    DWORD bytesRead = 0;
+    bool ok = ReadFile(hFile, &cached, sizeof(cached), &bytesRead, nullptr) && bytesRead == sizeof(cached);
+    CloseHandle(hFile);
+
+    // Concurrent writers can leave a torn file; validate before trusting it
+    if (!ok || memcmp(cached.magic, "MPMF", 4) != 0) return false;
+    if (cached.sampleRate == 0 || cached.channels == 0 || cached.channels > WAV_MAX_CHANNELS) return false;
+    sampleRate = cached.sampleRate;
+    channels = cached.channels;
+    return true;
+}
+
+// Persist the device mix format for the next run's speculative cache lookup; failures are ignored
+static void SaveCachedMixFormat(UINT32 sampleRate, UINT32 channels) {
+    std::wstring dir = GetStateDirectory();
+    if (dir.empty()) return;
+
+    HANDLE hFile = CreateFileW((dir + L"\\mixformat.bin").c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                               nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return;
+    CachedMixFormat cached = { { 'M', 'P', 'M', 'F' }, sampleRate, channels };
+    DWORD written = 0;
+    WriteFile(hFile, &cached, sizeof(cached), &written, nullptr);
+    CloseHandle(hFile);
+}
+
+// Half-precision (IEEE binary16) conversion for the FP16 cache encoding
+//
+// The scalar versions round to nearest even like the F16C instructions, so both paths produce the
+// same bits; F16C converts eight samples per instruction on CPUs that have it.
+static uint16_t FloatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    bits &= 0x7FFFFFFF;
+    if (bits >= 0x47800000) {
+        // Beyond the half range: infinity, or a quiet NaN
+        return sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00);
+    }
+    if (bits < 0x38800000) {
+        // Half subnormal: adding 0.5 lets the FPU round the mantissa onto the subnormal grid
+        float shifted;
+        memcpy(&shifted, &bits, 4);
+        shifted += 0.5f;
+        uint32_t rounded;
+        memcpy(&rounded, &shifted, 4);
+        return sign | static_cast<uint16_t>(rounded - 0x3F000000);
+    }
+    // Rebias the exponent and round to nearest even on the 13 dropped mantissa bits
+    bits += 0xC8000FFF + ((bits >> 13) & 1);
+    return sign | static_cast<uint16_t>(bits >> 13);
+}
+
+static float HalfToFloat(uint16_t half) {
+    uint32_t bits = static_cast<uint32_t>(half & 0x7FFF) << 13;
+    uint32_t exponent = bits & 0x0F800000;
+    bits += 0x38000000;
+    if (exponent == 0x0F800000) {
+        bits += 0x38000000;                      // Infinity / NaN
+    }
+    else if (exponent == 0) {
+        // Subnormal: renormalize through a float subtraction
+        bits += 0x00800000;
+        float value;
+        memcpy(&value, &bits, 4);
+        value -= 6.103515625e-05f;               // 2^-14
+        memcpy(&bits, &value, 4);
+    }
+    bits |= static_cast<uint32_t>(half & 0x8000) << 16;
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+// F16C instructions are VEX-encoded, so the OS must also preserve AVX register state
+static bool HasF16C() {
+    int info[4];
+    __cpuid(info, 1);
+    bool f16c = (info[2] & (1 << 29)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    return f16c && avx && osxsave && (_xgetbv(0) & 6) == 6;
+}
+
+static void FloatsToHalves(const float* input, size_t count, uint16_t* output) {
+    static const bool f16c = HasF16C();
+    size_t i = 0;
+    if (f16c) {
+        for (; i + 8 <= count; i += 8) {
+            __m128i packed = _mm256_cvtps_ph(_mm256_loadu_ps(input + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), packed);
+        }
+        _mm256_zeroupper();
+    }
+    for (; i < count; i++) output[i] = FloatToHalf(input[i]);
+}
+
+static void HalvesToFloats(const uint16_t* input, size_t count, float* output) {
+    static const bool f16c = HasF16C();
+    size_t i = 0;
+    if (f16c) {
+        for (; i + 8 <= count; i += 8) {
+            __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            _mm256_storeu_ps(output + i, _mm256_cvtph_ps(packed));
+        }
+        _mm256_zeroupper();
+    }
+    for (; i < count; i++) output[i] = HalfToFloat(input[i]);
+}
+
+// MSB-first bit packing for the Rice24 cache encoding
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<BYTE>& output) : output_(output) {}
+
+    // Append the low bits of value; bits <= 32
+    void Put(uint64_t value, unsigned bits) {
+        bits_ = (bits_ << bits) | (value & ((1ull << bits) - 1));
+        count_ += bits;
+        while (count_ >= 8) {
+            count_ -= 8;
+            output_.push_back(static_cast<BYTE>(bits_ >> count_));
+        }
+    }
+
+    // Pad the last byte with zeros
+    void Flush() {
+        if (count_ > 0) output_.push_back(static_cast<BYTE>(bits_ << (8 - count_)));
+        count_ = 0;
+    }
+
+private:
+    std::vector<BYTE>& output_;
+    uint64_t bits_ = 0;
+    unsigned count_ = 0;
+};
+
+class BitReader {
+public:
+    BitReader(const BYTE* data, size_t size) : data_(data), size_(size) {}
+
+    // Next bits (<= 32) as an unsigned value; sets Overrun past the end
+    uint32_t Get(unsigned bits) {
+        Refill();
+        if (count_ < bits) {
+            overrun_ = true;
+            return 0;
+        }
+        count_ -= bits;
+        return static_cast<uint32_t>((bits_ >> count_) & ((1ull << bits) - 1));
+    }
+
+    // Count leading one bits up to limit, consuming them and the terminating zero (not at the limit)
+    uint32_t Unary(uint32_t limit) {
+        Refill();
+        // Unread bits aligned to the top; the zero fill below them bounds the run at count_
+        uint64_t window = count_ > 0 ? bits_ << (64 - count_) : 0;
+        unsigned long index;
+        uint32_t ones = _BitScanReverse64(&index, ~window) ? 63 - index : 64;
+        ones = (std::min)(ones, limit);
+        if (ones == limit) {
+            count_ -= ones;
+            return ones;
+        }
+        if (ones >= count_) {
+            overrun_ = true;
+            return 0;
+        }
+        count_ -= ones + 1;
+        return ones;
+    }
+
+    bool Overrun() const { return overrun_; }
+
+private:
+    void Refill() {
+        while (count_ <= 56 && pos_ < size_) {
+            bits_ = (bits_ << 8) | data_[pos_++];
+            count_ += 8;
+        }
+    }
+
+    const BYTE* data_;
+    size_t size_;
+    size_t pos_ = 0;
+    uint64_t bits_ = 0;
+    unsigned count_ = 0;
+    bool overrun_ = false;
+};
+
+// Fixed polynomial predictor residual (FLAC's fixed predictors) of x[n] for orders 0..4
+static int64_t RiceResidual(const int64_t* x, size_t n, UINT32 order) {
+    switch (order) {
+        case 0:  return x[n];
+        case 1:  return x[n] - x[n - 1];
+        case 2:  return x[n] - 2 * x[n - 1] + x[n - 2];
+        case 3:  return x[n] - 3 * x[n - 1] + 3 * x[n - 2] - x[n - 3];
+        default: return x[n] - 4 * x[n - 1] + 6 * x[n - 2] - 4 * x[n - 3] + x[n - 4];
+    }
+}
+
+// Encode one channel of one block: predictor order, warm-up samples, then Rice-coded residuals in
+// partitions that each pick their own parameter from the mean residual magnitude
+static void EncodeRiceChannel(const int64_t* x, size_t frames, BitWriter& writer) {
+    // The order with the smallest residual magnitude over the block; all are scored from the same start
+    UINT32 order = 0;
+    uint64_t best = UINT64_MAX;
+    size_t start = (std::min)(static_cast<size_t>(RICE_MAX_ORDER), frames);
+    for (UINT32 candidate = 0; candidate <= RICE_MAX_ORDER && candidate <= frames; candidate++) {
+        uint64_t sum = 0;
+        for (size_t n = start; n < frames; n++) {
+            int64_t r = RiceResidual(x, n, candidate);
+            sum += static_cast<uint64_t>(r < 0 ? -r : r);
+        }
+        if (sum < best) {
+            best = sum;
+            order = candidate;
+        }
+    }
+
+    writer.Put(order, 3);
+    for (UINT32 n = 0; n < order; n++) writer.Put(static_cast<uint32_t>(x[n]), 32);
+
+    for (size_t first = order; first < frames; first += RICE_PARTITION) {
+        size_t last = (std::min)(first + RICE_PARTITION, frames);
+        uint64_t total = 0;
+        for (size_t n = first; n < last; n++) {
+            int64_t r = RiceResidual(x, n, order);
+            total += static_cast<uint64_t>(r < 0 ? -r : r);
+        }
+        uint64_t mean = total / (last - first);
+        unsigned k = 0;
+        while (k < 30 && (mean >> (k + 1)) != 0) k++;
+        writer.Put(k, 5);
+
+        for (size_t n = first; n < last; n++) {
+            int64_t r = RiceResidual(x, n, order);
+            uint64_t zigzag = (static_cast<uint64_t>(r) << 1) ^ static_cast<uint64_t>(r >> 63);
+            uint64_t quotient = zigzag >> k;
+            if (quotient >= RICE_ESCAPE) {
+                writer.Put((1ull << RICE_ESCAPE) - 1, RICE_ESCAPE);
+                writer.Put(zigzag >> 20, 20);
+                writer.Put(zigzag, 20);
+                continue;
+            }
+            writer.Put((1ull << (quotient + 1)) - 2, static_cast<unsigned>(quotient) + 1);
+            if (k > 0) writer.Put(zigzag, k);
+        }
+    }
+}
+
+static bool DecodeRiceChannel(BitReader& reader, size_t frames, int64_t* x) {
+    UINT32 order = reader.Get(3);
+    if (order > RICE_MAX_ORDER || order > frames) return false;
+    for (UINT32 n = 0; n < order; n++) x[n] = static_cast<int32_t>(reader.Get(32));
+
+    for (size_t first = order; first < frames; first += RICE_PARTITION) {
+        size_t last = (std::min)(first + RICE_PARTITION, frames);
+        unsigned k = reader.Get(5);
+        if (k > 30) return false;
+        for (size_t n = first; n < last; n++) {
+            uint64_t zigzag;
+            uint32_t quotient = reader.Unary(RICE_ESCAPE);
+            if (quotient == RICE_ESCAPE) {
+                zigzag = static_cast<uint64_t>(reader.Get(20)) << 20;
+                zigzag |= reader.Get(20);
+            }
+            else {
+                zigzag = (static_cast<uint64_t>(quotient) << k) | (k > 0 ? reader.Get(k) : 0);
+            }
+            int64_t r = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+            // Prediction is the residual formula with x[n] = 0, negated
+            x[n] = 0;
+            x[n] = r - RiceResidual(x, n, order);
+        }
+        if (reader.Overrun()) return false;
+    }
+    return !reader.Overrun();
+}
+
+// Run fn(first, last) over [0, count) split across up to CACHE_MAX_THREADS threads for large sounds
+template <typename Fn>
+static void ForEachCacheBlock(size_t count, size_t samples, Fn&& fn) {
+    UINT32 threads = samples >= CACHE_PARALLEL_MIN_SAMPLES ? ParallelThreads(count, CACHE_MAX_THREADS) : 1;
+    ParallelRanges(count, threads, fn);
+}
+
+// Rice24 payload: block frame count, block count, byte offsets of each block (plus the end) relative
+// to the first block, then the blocks. Each block holds every channel for RICE_BLOCK_FRAMES frames
+// and restarts prediction, so blocks are coded and decoded in parallel.
+static void EncodeRice24(const std::vector<float>& samples, UINT32 channels, std::vector<BYTE>& payload) {
+    size_t frames = samples.size() / channels;
+    size_t blockCount = (frames + RICE_BLOCK_FRAMES - 1) / RICE_BLOCK_FRAMES;
+    std::vector<std::vector<BYTE>> blocks(blockCount);
+
+    ForEachCacheBlock(blockCount, samples.size(), [&](size_t first, size_t last) {
+        std::vector<int64_t> x(RICE_BLOCK_FRAMES);
+        for (size_t b = first; b < last; b++) {
+            size_t base = b * RICE_BLOCK_FRAMES;
+            size_t blockFrames = (std::min)(static_cast<size_t>(RICE_BLOCK_FRAMES), frames - base);
+            BitWriter writer(blocks[b]);
+            for (UINT32 c = 0; c < channels; c++) {
+                for (size_t n = 0; n < blockFrames; n++) {
+                    float v = samples[(base + n) * channels + c];
+                    v = std::isnan(v) ? 0.0f : (std::min)((std::max)(v, -RICE_LIMIT), RICE_LIMIT);
+                    x[n] = lrintf(v * RICE_SCALE);
+                }
+                EncodeRiceChannel(x.data(), blockFrames, writer);
+            }
+            writer.Flush();
+        }
+    });
+
+    UINT32 head[2] = { RICE_BLOCK_FRAMES, static_cast<UINT32>(blockCount) };
+    std::vector<UINT32> offsets(blockCount + 1, 0);
+    for (size_t b = 0; b < blockCount; b++) offsets[b + 1] = offsets[b] + static_cast<UINT32>(blocks[b].size());
+    payload.resize(sizeof(head) + offsets.size() * sizeof(UINT32) + offsets.back());
+    BYTE* out = payload.data();
+    memcpy(out, head, sizeof(head));
+    memcpy(out + sizeof(head), offsets.data(), offsets.size() * sizeof(UINT32));
+    out += sizeof(head) + offsets.size() * sizeof(UINT32);
+    for (const std::vector<BYTE>& block : blocks) {
+        memcpy(out, block.data(), block.size());
+        out += block.size();
+    }
+}
+
+static bool DecodeRice24(const BYTE* payload, size_t size, size_t sampleCount, UINT32 channels,
+                         std::vector<float>& samples) {
+    UINT32 head[2];
+    if (channels == 0 || size < sizeof(head)) return false;
+    memcpy(head, payload, sizeof(head));
+    size_t frames = sampleCount / channels;
+    size_t blockCount = head[1];
+    if (head[0] != RICE_BLOCK_FRAMES || frames * channels != sampleCount ||
+        blockCount != (frames + RICE_BLOCK_FRAMES - 1) / RICE_BLOCK_FRAMES) {
+        return false;
+    }
+    size_t tableBytes = (blockCount + 1) * sizeof(UINT32);
+    if (size - sizeof(head) < tableBytes) return false;
+    std::vector<UINT32> offsets(blockCount + 1);
+    memcpy(offsets.data(), payload + sizeof(head), tableBytes);
+    const BYTE* blockData = payload + sizeof(head) + tableBytes;
+    size_t blockBytes = size - sizeof(head) - tableBytes;
+    for (size_t b = 0; b < blockCount; b++) {
+        if (offsets[b] > offsets[b + 1]) return false;
+    }
+    if (offsets[0] != 0 || offsets[blockCount] != blockBytes) return false;
+
+    samples.resize(sampleCount);
+    std::atomic<bool> failed{false};
+    ForEachCacheBlock(blockCount, sampleCount, [&](size_t first, size_t last) {
+        std::vector<int64_t> x(RICE_BLOCK_FRAMES);
+        for (size_t b = first; b < last && !failed.load(std::memory_order_relaxed); b++) {
+            size_t base = b * RICE_BLOCK_FRAMES;
+            size_t blockFrames = (std::min)(static_cast<size_t>(RICE_BLOCK_FRAMES), frames - base);
+            BitReader reader(blockData + offsets[b], offsets[b + 1] - offsets[b]);
+            for (UINT32 c = 0; c < channels; c++) {
+                if (!DecodeRiceChannel(reader, blockFrames, x.data())) {
+                    failed = true;
+                    break;
+                }
+                for (size_t n = 0; n < blockFrames; n++) {
+                    samples[(base + n) * channels + c] = static_cast<float>(x[n]) / RICE_SCALE;
+                }
+            }
+        }
+    });
+    return !failed;
+}
+
+// Processed sound ready to be written to the audio cache
+struct CacheRecord {
+    uint64_t key = 0;
+    CacheEncoding encoding = CacheEncoding::Float16;
+    UINT32 sampleRate = 0;
+    UINT32 channels = 0;
+    std::vector<float> samples;         // Copy of the processed samples, encoded after queueing
+    std::vector<BYTE> payload;
+};
+
+// On-disk layout of a cached processed sound: this header, then the encoded payload
+struct AudioCacheHeader {
+    char     magic[4];      // "MPAC"
+    UINT32   encoding;      // CacheEncoding
+    uint64_t key;
+    UINT32   sampleRate;
+    UINT32   channels;
+    uint64_t samples;       // Float samples the payload decodes to
+    uint64_t payloadBytes;
+};
+
+// Cache file of a key under %LOCALAPPDATA%\minply\cache, created on demand. Empty on failure.
+static std::wstring AudioCachePath(uint64_t key) {
+    std::wstring dir = GetStateDirectory();
+    if (dir.empty()) return {};
+    dir += L"\\cache";
+    if (!CreateDirectoryW(dir.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) return {};
+    wchar_t name[32];
+    swprintf(name, 32, L"\\%016llx.bin", static_cast<unsigned long long>(key));
+    return dir + name;
+}
+
+// Encode the record's samples in its cache encoding
+static void EncodeCachePayload(CacheRecord& record) {
+    const std::vector<float>& samples = record.samples;
+    switch (record.encoding) {
+        case CacheEncoding::Float32:
+            record.payload.resize(samples.size() * sizeof(float));
+            memcpy(record.payload.data(), samples.data(), record.payload.size());
+            break;
+        case CacheEncoding::Float16:
+            record.payload.resize(samples.size() * sizeof(uint16_t));
+            FloatsToHalves(samples.data(), samples.size(), reinterpret_cast<uint16_t*>(record.payload.data()));
+            break;
+        case CacheEncoding::Rice24:
+            EncodeRice24(samples, record.channels, record.payload);
+            break;
+    }
+}
+
+// Decode a cache payload into samples; false when the payload does not match the header
+static bool DecodeCachePayload(const AudioCacheHeader& header, const BYTE* payload, std::vector<float>& samples) {
+    size_t count = static_cast<size_t>(header.samples);
+    switch (static_cast<CacheEncoding>(header.encoding)) {
+        case CacheEncoding::Float32:
+            if (header.payloadBytes != count * sizeof(float)) return false;
+            samples.resize(count);
+            memcpy(samples.data(), payload, count * sizeof(float));
+            return true;
+        case CacheEncoding::Float16:
+            if (header.payloadBytes != count * sizeof(uint16_t)) return false;
+            samples.resize(count);
+            HalvesToFloats(reinterpret_cast<const uint16_t*>(payload), count, samples.data());
+            return true;
+        case CacheEncoding::Rice24:
+            return DecodeRice24(payload, static_cast<size_t>(header.payloadBytes), count, header.channels, samples);
+    }
+    return false;
+}
+
+// Load the processed sound cached under key for the given output format; false on a miss or on a
+// torn, foreign or undecodable file
+static bool LoadCachedAudio(uint64_t key, UINT32 sampleRate, UINT32 channels, std::vector<float>& samples) {
+    std::wstring path = AudioCachePath(key);
+    if (path.empty()) return false;
+
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+    bool ok = false;
+    do {
+        AudioCacheHeader header = {};
+        DWORD bytesRead = 0;
+        if (!ReadFile(hFile, &header, sizeof(header), &bytesRead, nullptr) || bytesRead != sizeof(header)) break;
+        if (memcmp(header.magic, "MPAC", 4) != 0 || header.key != key ||
+            header.sampleRate != sampleRate || header.channels != channels) {
+            break;
+        }
+        if (header.samples == 0 || header.samples > MAXDWORD || header.payloadBytes > MAXDWORD) break;
+        std::vector<BYTE> payload(static_cast<size_t>(header.payloadBytes));
+        DWORD toRead = static_cast<DWORD>(payload.size());
+        if (!ReadFile(hFile, payload.data(), toRead, &bytesRead, nullptr) || bytesRead != toRead) break;
+        ok = DecodeCachePayload(header, payload.data(), samples);
+    } while (false);
+    CloseHandle(hFile);
+    return ok;
+}
+
+// Write a processed sound to the cache; failures are ignored
+//
+// The file is written under a per-process temporary name and renamed into place, so concurrent
+// readers see either no file or a complete one.
+static void StoreCachedAudio(const CacheRecord& record) {
+    std::wstring path = AudioCachePath(record.key);
+    if (path.empty() || record.payload.empty() || record.payload.size() > MAXDWORD) return;
+
+    std::wstring temp = path + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+    HANDLE hFile = CreateFileW(temp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return;
+    AudioCacheHeader header = { { 'M', 'P', 'A', 'C' }, static_cast<UINT32>(record.encoding), record.key,
+                                record.sampleRate, record.channels, record.samples.size(), record.payload.size() };
+    DWORD written = 0;
+    DWORD payloadBytes = static_cast<DWORD>(record.payload.size());
+    bool ok = WriteFile(hFile, &header, sizeof(header), &written, nullptr) && written == sizeof(header) &&
+              WriteFile(hFile, record.payload.data(), payloadBytes, &written, nullptr) && written == payloadBytes;
+    CloseHandle(hFile);
+    if (!ok || !MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) DeleteFileW(temp.c_str());
+}
+
+// Parse a subset of TOML (sections + bool/float key-value) into config.
+//
+// Unknown sections and keys are silently ignored.
+// Returns false only if the file cannot be opened; parse warnings go to stderr.
+static bool ParseTomlFile(const wchar_t* path, AppConfig& config) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD fileSize = GetFileSize(hFile, nullptr);
+    if (fileSize == INVALID_FILE_SIZE) {
+        CloseHandle(hFile);
+        return false;
+    }
+    // Hard cap to keep a hostile or accidental huge TOML from exhausting memory
+    constexpr DWORD MAX_TOML_SIZE = 1024 * 1024;
+    if (fileSize > MAX_TOML_SIZE) {
+        CloseHandle(hFile);
+        char nameBuf[MAX_PATH] = {};
+        WideCharToMultiByte(CP_UTF8, 0, PathFindFileNameW(path), -1, nameBuf, sizeof(nameBuf), nullptr, nullptr);
+        std::cerr << "Warning: " << nameBuf << ": config file too large; ignored" << std::endl;
+        return false;
+    }
+    std::string content(fileSize, '\0');
+    DWORD bytesRead = 0;
+    bool ok = (fileSize == 0) || ReadFile(hFile, &content[0], fileSize, &bytesRead, nullptr);
+    CloseHandle(hFile);
+    if (!ok) return false;
+    content.resize(bytesRead);
+
+    std::string section;
+    size_t lineStart = 0;
+    int lineNum = 0;
+
+    auto trim = [](const std::string& s) -> std::string {
+        const char* ws = " \t\r";
+        size_t a = s.find_first_not_of(ws);
+        if (a == std::string::npos) return {};
+        size_t b = s.find_last_not_of(ws);
+        return s.substr(a, b - a + 1);
+    };
+
+    while (lineStart < content.size()) {
+        size_t lineEnd = content.find('\n', lineStart);
+        if (lineEnd == std::string::npos) lineEnd = content.size();
+        std::string line = trim(content.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+        lineNum++;
+
+        if (line.empty() || line[0] == '#') continue;
+
+        if (line[0] == '[' && line.back() == ']') {
+            section = trim(line.substr(1, line.size() - 2));
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+
+        std::string key = trim(line.substr(0, eq));
+        std::string val = trim(line.substr(eq + 1));
+
+        size_t hash = val.find('#');
+        if (hash != std::string::npos) val = trim(val.substr(0, hash));
+
+        auto parseBool = [&](bool& dest) {
+            if (val == "true") dest = true;
+            else if (val == "false") dest = false;
+            else std::cerr << "Warning: config line " << lineNum << ": invalid bool '" << val << "'" << std::endl;
+        };
+        // Parse and range-check a float value.
+        // Rejects non-finite values and values outside [minVal, maxVal]; keeps the existing default on failure.
+        auto parseFloat = [&](float& dest, float minVal, float maxVal) {
+            char* end;
+            float v = strtof(val.c_str(), &end);
+            if (end == val.c_str() || !std::isfinite(v) || v < minVal || v > maxVal) {
+                std::cerr << "Warning: config line " << lineNum << ": invalid value '" << val << "'" << std::endl;
+                return;
+            }
+            dest = v;
+        };
+
+        if (section == "guard") {
+            if      (key == "enabled")          parseBool(config.guardEnabled);
+            else if (key == "frequency")        parseFloat(config.guardFrequency, 20.0f, 20000.0f);
+            else if (key == "amplitude")        parseFloat(config.guardAmplitude, 0.0f, 1.0f);
+            else if (key == "lead_in_duration") parseFloat(config.leadInDuration, 0.0f, 10.0f);
+            else if (key == "lead_out_duration") parseFloat(config.leadOutDuration, 0.0f, 10.0f);
+        }
+        else if (section == "loudness") {
+            if      (key == "enabled")      parseBool(config.loudnessEnabled);
+            else if (key == "target")       parseFloat(config.loudnessTarget, -70.0f, 0.0f);
+            else if (key == "peak_ceiling") parseFloat(config.loudnessPeakCeiling, 0.001f, 1.0f);
+            else if (key == "estimate")     parseBool(config.loudnessEstimate);
+            else if (key == "trust_metadata") parseBool(config.loudnessTrustMetadata);
+            else if (key == "estimate_error")        parseFloat(config.loudnessEstimateError, 0.05f, 6.0f);
+            else if (key == "estimate_min_duration") parseFloat(config.loudnessEstimateMinDuration, 0.0f, 86400.0f);
+        }
+        else if (section == "share") {
+            if      (key == "enabled")      parseBool(config.shareEnabled);
+        }
+        else if (section == "tempo") {
+            if      (key == "rate")         parseFloat(config.tempoRate, 0.5f, 2.0f);
+            else if (key == "min_duration") parseFloat(config.tempoMinDuration, 0.0f, 86400.0f);
+        }
+        else if (section == "cache") {
+            if      (key == "enabled")      parseBool(config.cacheEnabled);
+            else if (key == "format") {
+                if      (val == "\"f16\"") config.cacheFormat = CacheEncoding::Float16;
+                else if (val == "\"f32\"") config.cacheFormat = CacheEncoding::Float32;
+                else if (val == "\"lossless24\"") config.cacheFormat = CacheEncoding::Rice24;
+                else std::cerr << "Warning: config line " << lineNum << ": invalid value '" << val << "'" << std::endl;
+            }
+        }
+        else if (section == "pipeline") {
+            if (key == "layout") {
+                if      (val == "\"interleaved\"") config.planarLayout = false;
+                else if (val == "\"planar\"")      config.planarLayout = true;
+                else std::cerr << "Warning: config line " << lineNum << ": invalid value '" << val << "'" << std::endl;
+            }
+            else if (key == "deadline") parseFloat(config.deadlineMs, 0.0f, DEADLINE_MAX_MS);
+        }
+    }
+    return true;
+}
+
+// Load configuration from minply.toml and minply.local.toml in the executable directory.
+//
+// Missing files are silently skipped. Returns default AppConfig if both are absent.
+static AppConfig LoadConfig() {
+    AppConfig config;
+
+    wchar_t exePath[MAX_PATH] = {};
+    DWORD pathLen = GetModuleFileNameW(nullptr, exePath, MAX_PATH);
+    if (pathLen == 0 || pathLen >= MAX_PATH) return config;
+
+    if (!PathRemoveFileSpecW(exePath)) return config;
+
+    std::wstring dir(exePath);
+    dir += L'\\';
+    ParseTomlFile((dir + L"minply.toml").c_str(), config);
+    ParseTomlFile((dir + L"minply.local.toml").c_str(), config);
+
+    return config;
+}
+
+// Deadline-driven degradation policy
+//
+// Once a sound has been decoded, the time spent since its submission plus the predicted cost of the
+// loudness and resampling stages still ahead is compared with the deadline. While the prediction
+// overruns it, the pipeline is degraded in a fixed order:
+//   1. a gain remembered from an earlier analysis of the same input, or tagged in the file, instead of
+//      the full loudness analysis
+//   2. linear interpolation instead of the polyphase resampler
+// The peak pass is never skipped: without the real peak the ceiling would have to assume full scale
+// and cap the gain of every quiet input far below the target.
+// Costs are kept per stage in nanoseconds per sample, seeded with conservative values and moved
+// towards each run the session measures, so contention on the machine shows up within a few sounds.
+// A run also moves the other stages by half as much in the same proportion, since contention slows
+// them alike; a stage skipped to meet the deadline would otherwise keep the cost that made it skip.
+class DeadlinePolicy {
+public:
+    enum Stage { Analysis, Peak, Polyphase, Linear, STAGE_COUNT };
+    enum : UINT32 { DEGRADE_GAIN = 0x1, DEGRADE_RESAMPLE = 0x2 };
+
+    // Stages still ahead of one sound, in samples
+    struct Work {
+        size_t analysisSamples = 0;        // Read by the loudness analysis; 0 when none runs
+        size_t peakSamples = 0;            // Read by a separate peak pass of the gain in use
+        size_t resampleSamples = 0;        // Output frames times the larger channel count; 0 at equal rates
+        bool   substitute = false;         // A remembered or tagged gain can replace the analysis
+        size_t substitutePeakSamples = 0;  // Peak pass the substitute still needs (tag without true peak)
+    };
+
+    // Predicted milliseconds for samples of a stage
+    double Predict(Stage stage, size_t samples) const {
+        return cost_[stage] * static_cast<double>(samples) * 1e-6;
+    }
+
+    void Observe(Stage stage, size_t samples, double ms) {
+        if (samples < DEADLINE_MIN_SAMPLES) return;
+        double ratio = ms * 1e6 / static_cast<double>(samples) / cost_[stage];
+        for (int other = 0; other < STAGE_COUNT; other++) {
+            double weight = other == stage ? DEADLINE_COST_WEIGHT : DEADLINE_COST_WEIGHT * 0.5;
+            cost_[other] *= 1.0 + weight * (ratio - 1.0);
+        }
+    }
+
+    // DEGRADE_* set needed for work to fit in remainingMs; predictedMs receives the cost left after them
+    UINT32 Plan(const Work& work, double remainingMs, double& predictedMs) const {
+        remainingMs *= DEADLINE_HEADROOM;
+        UINT32 degraded = 0;
+        double gain = Predict(Analysis, work.analysisSamples) + Predict(Peak, work.peakSamples);
+        double resample = Predict(Polyphase, work.resampleSamples);
+        if (gain + resample > remainingMs && work.substitute) {
+            degraded |= DEGRADE_GAIN;
+            gain = Predict(Peak, work.substitutePeakSamples);
+        }
+        if (gain + resample > remainingMs && work.resampleSamples > 0) {
+            degraded |= DEGRADE_RESAMPLE;
+            resample = Predict(Linear, work.resampleSamples);
+        }
+        predictedMs = gain + resample;
+        return degraded;
+    }
+
+private:
+    double cost_[STAGE_COUNT] = { 30.0, 2.0, 60.0, 8.0 };
+};
+
+// Submitted sound awaiting processing
+struct PlaybackJob {
+    const BYTE* data = nullptr;          // Encoded input; nullptr for PCM
+    size_t size = 0;
+    std::vector<BYTE> copy;              // Owns the input under MINPLY_PLAY_COPY
+    std::unique_ptr<ReadAhead> file;     // Owns input still being read by minply_play_file
+    const float* pcm = nullptr;          // Interleaved float PCM input
+    size_t pcmSamples = 0;
+    UINT32 pcmRate = 0;
+    UINT32 pcmChannels = 0;
+    std::shared_ptr<PcmStream> stream;   // Incrementally written PCM; played as it arrives
+    std::vector<ToneStep> tone;          // Tone pattern synthesized in the device format
+    bool skipLoudness = false;           // MINPLY_PLAY_NO_LOUDNESS
+    CacheRecord cache;                   // Processed result to encode and store once it is queued for playback
+    minply_completion_fn callback = nullptr;
+    void* context = nullptr;
+    LARGE_INTEGER submitted = {};
+};
+
+// Playback session behind the C API
+//
+// The caller submits jobs; a processing worker decodes, converts, measures loudness and fades them in
+// submission order; the render thread owns the RenderDevice and plays processed items back to back,
+// bracketing each burst with the BLE guard lead-in and lead-out. Device discovery runs on the render
+// thread at open and overlaps the first decode, which needs no device format; the audio cache is
+// looked up speculatively against the cached mix format.
+// With [share] enabled the render thread also takes part in the cross-process renderer election.
+class PlaybackSession {
+public:
+    explicit PlaybackSession(const minply_options& options)
+        : flags_(options.flags), deadlineOption_(options.deadline_ms),
+          timer_((options.flags & MINPLY_OPEN_TIMING) != 0) {}
+    PlaybackSession(const PlaybackSession&) = delete;
+    PlaybackSession& operator=(const PlaybackSession&) = delete;
+
+    ~PlaybackSession() {
+        if (formatReady_) CloseHandle(formatReady_);
+        if (renderWake_) CloseHandle(renderWake_);
+    }
+
+    int Open() {
+        config_ = LoadConfig();
+        if (flags_ & MINPLY_OPEN_DEADLINE) {
+            config_.deadlineMs = (std::min)(static_cast<float>(deadlineOption_), DEADLINE_MAX_MS);
+        }
+        cacheValid_ = LoadCachedMixFormat(cachedRate_, cachedChannels_);
+        sharedOpen_ = config_.shareEnabled && shared_.Open();
+
+        formatReady_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        renderWake_ = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (!formatReady_ || !renderWake_) return MINPLY_E_DEVICE;
+
+        renderer_ = std::thread([this]() { RenderMain(); });
+        worker_ = std::thread([this]() { WorkerMain(); });
+        return MINPLY_OK;
+    }
+
+    // Queue an encoded input (data != nullptr) or float PCM for processing and playback
+    int Submit(std::unique_ptr<PlaybackJob> job);
+
+    // Queue a PCM stream; waits for the device format the stream converts to
+    int SubmitStream(const std::shared_ptr<PcmStream>& stream, minply_completion_fn callback, void* context) {
+        if (!WaitForFormat()) return MINPLY_E_DEVICE;
+        if (!stream->Init(sampleRate_, channels_, config_.tempoRate)) return MINPLY_E_DEVICE;
+        auto job = std::make_unique<PlaybackJob>();
+        job->stream = stream;
+        job->callback = callback;
+        job->context = context;
+        return Submit(std::move(job));
+    }
+
+    void Stats(minply_stats& stats) {
+        stats = {};
+        stats.submitted = submitted_;
+        stats.played = played_;
+        stats.handed_off = handedOff_;
+        stats.failed = failed_;
+        stats.pending = pending_;
+        if (WaitForSingleObject(formatReady_, 0) == WAIT_OBJECT_0 && deviceOk_) {
+            stats.sample_rate = sampleRate_;
+            stats.channels = channels_;
+        }
+        stats.last_process_ms = lastProcessMs_;
+        stats.last_start_latency_ms = lastStartLatencyMs_;
+    }
+
+    // Finish every submitted sound, then stop both threads
+    void Close() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            closing_ = true;
+        }
+        jobsChanged_.notify_all();
+        if (worker_.joinable()) worker_.join();
+        if (renderer_.joinable()) renderer_.join();
+    }
+
+private:
+    // Processed sound ready for the render thread
+    struct Item {
+        std::vector<float> samples;
+        GainControl gain;
+        bool scaled = false;             // Gain applied at render time (estimate mode)
+        bool estimated = false;
+        LoudnessEstimate estimate;
+        LoudnessInput measured;          // Data the loudness was measured on, reread by the refinement
+        std::vector<float> source;       // Keeps decoded source-format data alive for the refinement
+        PlanarAudio sourcePlanar;        // The same for planar decoder output
+        float peak = 0.0f;
+        std::thread refine;              // Exact loudness measurement refining an estimate
+        std::atomic<bool> cancelRefine{false};
+        double exactLoudness = 0.0;
+        bool refined = false;
+        std::unique_ptr<WsolaStretcher> stretcher;    // Tempo applied block by block while rendering
+        std::shared_ptr<PcmStream> stream;
+        minply_completion_fn callback = nullptr;
+        void* context = nullptr;
+        LARGE_INTEGER submitted = {};
+    };
+
+    double MsSince(const LARGE_INTEGER& start) const {
+        LARGE_INTEGER now, freq;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&freq);
+        return static_cast<double>(now.QuadPart - start.QuadPart) * 1000.0 / static_cast<double>(freq.QuadPart);
+    }
+
+    std::vector<float> AcquireBuffer() {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (pool_.empty()) return {};
+        std::vector<float> buffer = std::move(pool_.back());
+        pool_.pop_back();
+        return buffer;
+    }
+
+    void ReleaseBuffer(std::vector<float>&& buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > BUFFER_POOL_MAX_SAMPLES) return;
+        buffer.clear();
+        std::lock_guard<std::mutex> guard(lock_);
+        if (pool_.size() < BUFFER_POOL_SIZE) pool_.push_back(std::move(buffer));
+    }
+
+    void Finish(minply_completion_fn callback, void* context, int result) {
+        if (result != MINPLY_OK) failed_++;
+        if (callback) callback(context, result);
+        pending_--;
+    }
+
+    // Complete a processed item: stop its refinement, report, recycle its buffer
+    void Finish(std::unique_ptr<Item> item, int result) {
+        if (item->refine.joinable()) {
+            item->cancelRefine = true;
+            item->refine.join();
+        }
+        if (item->estimated && timer_.Enabled()) {
+            std::cerr << "Loudness: estimate " << item->estimate.loudness << " LUFS (+/-" << item->estimate.halfWidth
+                      << " LU, " << item->estimate.sampledBlocks << "/" << item->estimate.totalBlocks << " blocks)";
+            if (item->refined) {
+                std::cerr << ", exact " << item->exactLoudness << " LUFS, error "
+                          << (item->estimate.loudness - item->exactLoudness) << " LU";
+            }
+            std::cerr << std::endl;
+        }
+        if (item->stream) item->stream->Detach();
+        ReleaseBuffer(std::move(item->samples));
+        Finish(item->callback, item->context, result);
+    }
+
+    // Device format, waiting for discovery on the render thread; false if the device failed
+    bool WaitForFormat() {
+        WaitForSingleObject(formatReady_, INFINITE);
+        return deviceOk_;
+    }
+
+    // Cache key of a processed sound: the input's identity plus every setting that shapes the output
+    uint64_t CacheKey(uint64_t input, UINT32 sampleRate, UINT32 channels, bool loudness) const {
+        DWORD fields[] = { AUDIO_CACHE_VERSION, sampleRate, channels, loudness,
+                           config_.loudnessTrustMetadata, 0, 0, 0, 0 };
+        memcpy(&fields[5], &config_.loudnessTarget, sizeof(float));
+        memcpy(&fields[6], &config_.loudnessPeakCeiling, sizeof(float));
+        memcpy(&fields[7], &config_.tempoRate, sizeof(float));
+        memcpy(&fields[8], &config_.tempoMinDuration, sizeof(float));
+        return HashBytes(fields, sizeof(fields), input);
+    }
+
+    // Stretcher for a buffered sound of frames device frames; nullptr when it plays at its own tempo
+    std::unique_ptr<WsolaStretcher> TempoStretcher(size_t frames) const {
+        if (config_.tempoRate == 1.0f || frames < sampleRate_ * config_.tempoMinDuration) return nullptr;
+        auto stretcher = std::make_unique<WsolaStretcher>();
+        if (!stretcher->Init(sampleRate_, channels_, config_.tempoRate)) return nullptr;
+        return stretcher;
+    }
+
+    bool MetadataGain(const LoudnessMetadata& metadata, Item& item, float& gain);
+    float MeasureGain(Item& item, UINT32 usedChannels);
+    void RememberGain(uint64_t key, float gain) {
+        if (gainHistory_.size() >= DEADLINE_GAIN_HISTORY) gainHistory_.clear();
+        gainHistory_[key] = gain;
+    }
+    std::unique_ptr<Item> Process(PlaybackJob& job, int& result);
+    void WorkerMain();
+    void RenderMain();
+    bool ReopenDevice();
+    bool RenderBurst(std::unique_ptr<Item> first, const std::vector<float>& leadIn,
+                     const std::vector<float>& leadOut);
+    template <typename Poll>
+    bool RenderStream(Item& item, const std::vector<float>& guard, Poll&& poll);
+    template <typename Poll>
+    bool RenderStretched(Item& item, Poll&& poll);
+    std::unique_ptr<Item> PopReady() {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (ready_.empty()) return nullptr;
+        std::unique_ptr<Item> item = std::move(ready_.front());
+        ready_.pop_front();
+        return item;
+    }
+    bool HasReady() {
+        std::lock_guard<std::mutex> guard(lock_);
+        return !ready_.empty();
+    }
+
+    UINT32 flags_ = 0;
+    UINT32 deadlineOption_ = 0;                      // minply_options.deadline_ms under MINPLY_OPEN_DEADLINE
+    AppConfig config_;
+    StageTimer timer_;
+
+    // Deadline policy state; used by the processing worker only
+    DeadlinePolicy deadline_;
+    std::unordered_map<uint64_t, float> gainHistory_;  // Analysed gain by CacheKey of input and device format
+
+    // Device format published by the render thread through formatReady_
+    RenderDevice device_;
+    HANDLE formatReady_ = nullptr;
+    std::atomic<bool> deviceOk_{false};              // Cleared by the render thread when the device fails
+    UINT32 sampleRate_ = 0;
+    UINT32 channels_ = 0;
+    bool cacheValid_ = false;
+    UINT32 cachedRate_ = 0;
+    UINT32 cachedChannels_ = 0;
+    bool mfStarted_ = false;
+
+    SharedRenderQueue shared_;
+    bool sharedOpen_ = false;
+
+    std::mutex lock_;                                // Guards jobs_, ready_, pool_, closing_, workerDone_
+    std::condition_variable jobsChanged_;
+    std::deque<std::unique_ptr<PlaybackJob>> jobs_;
+    std::deque<std::unique_ptr<Item>> ready_;
+    std::vector<std::vector<float>> pool_;
+    bool closing_ = false;
+    bool workerDone_ = false;
+    HANDLE renderWake_ = nullptr;                    // Signaled when ready_ grows or the worker exits
+
+    std::thread worker_;
+    std::thread renderer_;
+
+    std::atomic<uint64_t> submitted_{0};
+    std::atomic<uint64_t> played_{0};
+    std::atomic<uint64_t> handedOff_{0};
+    std::atomic<uint64_t> failed_{0};
+    std::atomic<uint32_t> pending_{0};
+    std::atomic<double> lastProcessMs_{0.0};
+    std::atomic<double> lastStartLatencyMs_{0.0};
+};
+
+int PlaybackSession::Submit(std::unique_ptr<PlaybackJob> job) {
+    QueryPerformanceCounter(&job->submitted);
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (closing_) return MINPLY_E_INVALID_ARG;
+        jobs_.push_back(std::move(job));
+        submitted_++;
+        pending_++;
+    }
+    jobsChanged_.notify_one();
+    return MINPLY_OK;
+}
+
+// Loudness gain from loudness embedded in the file, skipping libebur128; false when there is none
+// or the device channel mapping would change the loudness by an unknown amount
+bool PlaybackSession::MetadataGain(const LoudnessMetadata& metadata, Item& item, float& gain) {
+    double offset;
+    if (!metadata.present || !LoudnessChannelOffset(metadata.channels, channels_, offset)) return false;
+
+    item.peak = metadata.hasTruePeak ? metadata.truePeak : MeasurePeak(item.measured, channels_);
+    gain = item.peak < LOUDNESS_MIN_PEAK
+        ? 1.0f
+        : ComputeLoudnessGain(metadata.loudness + offset, item.peak, config_.loudnessTarget, config_.loudnessPeakCeiling);
+    if (timer_.Enabled()) {
+        std::cerr << "Loudness: bext " << metadata.loudness << " LUFS";
+        if (metadata.hasTruePeak) std::cerr << ", " << 20.0 * log10(metadata.truePeak) << " dBTP";
+        std::cerr << " (measurement skipped)" << std::endl;
+    }
+    timer_.Mark("loudness (metadata)");
+    return true;
+}
+
+// Loudness gain for item.measured, whose first usedChannels channels reach the device
+//
+// Long inputs in estimate mode start with a sampled-block gain applied at render time and return 1;
+// the exact measurement then runs in the background and the render loop ramps to it.
+// Each full pass is timed for the deadline policy's cost estimates.
+float PlaybackSession::MeasureGain(Item& item, UINT32 usedChannels) {
+    const LoudnessInput& input = item.measured;
+    if (input.sampleCount == 0) return 1.0f;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    // Deferred PCM is read once for both: the peak comes from the blocks fed to libebur128
+    if (input.pcm) {
+        double loudness = 0.0;
+        bool measured = MeasureLoudness(input, loudness, nullptr, &item.peak, usedChannels);
+        deadline_.Observe(DeadlinePolicy::Analysis, input.sampleCount, MsSince(start));
+        if (!measured || item.peak < LOUDNESS_MIN_PEAK) return 1.0f;
+        return ComputeLoudnessGain(loudness, item.peak, config_.loudnessTarget, config_.loudnessPeakCeiling);
+    }
+
+    item.peak = MeasurePeak(input, usedChannels);
+    deadline_.Observe(DeadlinePolicy::Peak, input.sampleCount, MsSince(start));
+    QueryPerformanceCounter(&start);
+    if (item.peak < LOUDNESS_MIN_PEAK) return 1.0f;
+
+    size_t frames = input.sampleCount / input.channels;
+    if (config_.loudnessEstimate && frames >= input.sampleRate * config_.loudnessEstimateMinDuration &&
+        EstimateLoudness(input, config_.loudnessEstimateError, item.estimate)) {
+        item.gain.target = ComputeLoudnessGain(item.estimate.loudness, item.peak,
+                                               config_.loudnessTarget, config_.loudnessPeakCeiling);
+        item.scaled = true;
+        item.estimated = true;
+        return 1.0f;
+    }
+
+    double loudness = 0.0;
+    if (!MeasureLoudness(input, loudness)) return 1.0f;
+    deadline_.Observe(DeadlinePolicy::Analysis, input.sampleCount, MsSince(start));
+    return ComputeLoudnessGain(loudness, item.peak, config_.loudnessTarget, config_.loudnessPeakCeiling);
+}
+
+// Decode, measure, convert and fade one job. Returns nullptr with result set on failure.
+std::unique_ptr<PlaybackSession::Item> PlaybackSession::Process(PlaybackJob& job, int& result) {
+    LARGE_INTEGER started;
+    QueryPerformanceCounter(&started);
+    if (job.stream) {
+        auto item = std::make_unique<Item>();
+        item->stream = job.stream;
+        item->callback = job.callback;
+        item->context = job.context;
+        item->submitted = job.submitted;
+        result = MINPLY_OK;
+        return item;
+    }
+    // Tones are synthesized block by block straight into the device format at a level derived from
+    // the loudness target; nothing is read, decoded, converted or measured
+    if (!job.tone.empty()) {
+        if (!WaitForFormat()) {
+            result = MINPLY_E_DEVICE;
+            return nullptr;
+        }
+        auto item = std::make_unique<Item>();
+        item->callback = job.callback;
+        item->context = job.context;
+        item->submitted = job.submitted;
+        ToneSynth synth(job.tone, sampleRate_, ToneLevel(config_.loudnessTarget, channels_), config_.loudnessPeakCeiling);
+        item->samples = AcquireBuffer();
+        item->samples.resize(synth.TotalFrames() * channels_);
+        for (size_t frame = 0; frame < synth.TotalFrames();) {
+            frame += synth.Render(item->samples.data() + frame * channels_, TONE_BLOCK_FRAMES, channels_);
+        }
+        timer_.Mark("synthesize");
+        ApplyFade(item->samples, sampleRate_, channels_);
+        timer_.Mark("fade");
+        lastProcessMs_ = MsSince(started);
+        result = MINPLY_OK;
+        return item;
+    }
+    DecodedAudio decoded;
+    const float* source = job.pcm;
+    size_t sourceSamples = job.pcmSamples;
+    UINT32 sourceRate = job.pcmRate;
+    UINT32 sourceChannels = job.pcmChannels;
+    bool loudness = config_.loudnessEnabled && !job.skipLoudness;
+    // Files opened by path are identified without hashing their contents; 0 keeps the job out of the
+    // cache and the deadline policy's remembered gains
+    uint64_t inputIdentity = 0;
+    if ((config_.cacheEnabled || config_.deadlineMs > 0.0f) && job.data) {
+        inputIdentity = job.file ? job.file->Identity() : (HashBytes(job.data, job.size) | 1);
+    }
+
+    if (job.data) {
+        // PCM WAV is left in the input and processed block by block unless the planar layout is chosen
+        DecodeOutput output = config_.planarLayout ? DecodeOutput::Planar : DecodeOutput::Blocks;
+        // Decoding does not depend on the device format, so it never waits for device discovery. The
+        // cache is looked up against the real format if already known, else speculatively against the
+        // one saved by the previous run.
+        bool known = WaitForSingleObject(formatReady_, 0) == WAIT_OBJECT_0;
+        bool speculative = !known && cacheValid_;
+        if (known && !deviceOk_) {
+            result = MINPLY_E_DEVICE;
+            return nullptr;
+        }
+        UINT32 targetRate = speculative ? cachedRate_ : sampleRate_;
+        UINT32 targetChannels = speculative ? cachedChannels_ : channels_;
+
+        // A cached result for this input and output format skips decode, loudness and fade
+        if (config_.cacheEnabled && inputIdentity != 0 && (known || speculative)) {
+            std::vector<float> cached = AcquireBuffer();
+            bool hit = LoadCachedAudio(CacheKey(inputIdentity, targetRate, targetChannels, loudness),
+                                       targetRate, targetChannels, cached);
+            timer_.Mark(hit ? "cache hit" : "cache miss");
+            if (hit && WaitForFormat() && sampleRate_ == targetRate && channels_ == targetChannels) {
+                auto item = std::make_unique<Item>();
+                item->samples = std::move(cached);
+                item->stretcher = TempoStretcher(item->samples.size() / channels_);
+                item->callback = job.callback;
+                item->context = job.context;
+                item->submitted = job.submitted;
+                lastProcessMs_ = MsSince(started);
+                result = MINPLY_OK;
+                return item;
+            }
+            ReleaseBuffer(std::move(cached));
+        }
+
+        bool decodedOk = DecodeInput(job.data, job.size, decoded, job.file.get(), output);
+        timer_.Mark("decode");
+        if (job.file && timer_.Enabled()) {
+            double firstBlockMs = job.file->OpenToFirstBlockMs();
+            if (firstBlockMs >= 0.0) std::cerr << "Read-ahead: first block decoded " << firstBlockMs << " ms after open" << std::endl;
+        }
+
+        if (!known) {
+            if (!WaitForFormat()) {
+                result = MINPLY_E_DEVICE;
+                return nullptr;
+            }
+            timer_.Mark("wait for device format");
+        }
+        if (!decodedOk && job.file && job.file->Failed()) {
+            PrintError("Failed to read file");
+            result = MINPLY_E_FILE;
+            return nullptr;
+        }
+        if (!decodedOk) {
+            PrintError("Failed to decode audio");
+            result = MINPLY_E_DECODE;
+            return nullptr;
+        }
+        source = decoded.samples.data();
+        sourceSamples = !decoded.planar.Empty() ? decoded.planar.Frames() * decoded.channels
+                      : decoded.pcm.data       ? decoded.pcm.frames * decoded.channels
+                                               : decoded.samples.size();
+        sourceRate = decoded.sampleRate;
+        sourceChannels = decoded.channels;
+    }
+    else if (!WaitForFormat()) {
+        result = MINPLY_E_DEVICE;
+        return nullptr;
+    }
+
+    auto item = std::make_unique<Item>();
+    item->callback = job.callback;
+    item->context = job.context;
+    item->submitted = job.submitted;
+
+    // Measure loudness on the source-rate, source-channel data, with channel weights reproducing the
+    // device channel mapping, and fold the gain into the conversion. A low-rate prompt is K-weighted
+    // on its own samples rather than on the upsampled copy.
+    bool planar = !decoded.planar.Empty();
+    // Loudness estimation samples blocks at random and refines in the background after the input may
+    // be gone, so deferred PCM it could apply to is read into a float buffer up front
+    if (decoded.pcm.data && loudness && config_.loudnessEstimate &&
+        decoded.pcm.frames >= sourceRate * config_.loudnessEstimateMinDuration) {
+        if (!ConvertPcmBlocks(decoded.pcm, sourceRate, sourceRate, sourceChannels, decoded.samples)) {
+            PrintError("Failed to read file");
+            result = MINPLY_E_FILE;
+            return nullptr;
+        }
+        decoded.pcm = DeferredPcm();
+        source = decoded.samples.data();
+    }
+    bool blocks = decoded.pcm.data != nullptr;
+    item->measured.data = source;
+    item->measured.planar = planar ? &decoded.planar : nullptr;
+    item->measured.pcm = blocks ? &decoded.pcm : nullptr;
+    item->measured.sampleCount = sourceSamples;
+    item->measured.sampleRate = sourceRate;
+    item->measured.channels = sourceChannels;
+    bool atSource = sourceChannels > 0 && MapLoudnessChannels(sourceChannels, channels_, item->measured.channelTypes);
+
+    // With a deadline, the stages ahead are degraded when the time already spent since submission
+    // plus their predicted cost would overrun it (see DeadlinePolicy)
+    UINT32 degraded = 0;
+    const uint64_t gainKey = inputIdentity != 0 ? CacheKey(inputIdentity, sampleRate_, channels_, true) : 0;
+    auto remembered = gainKey != 0 ? gainHistory_.find(gainKey) : gainHistory_.end();
+    if (config_.deadlineMs > 0.0f) {
+        const LoudnessMetadata& metadata = decoded.metadata;
+        double offset;
+        bool tagged = metadata.present && LoudnessChannelOffset(metadata.channels, channels_, offset);
+        size_t dstFrames = sourceRate > 0 && sourceChannels > 0
+            ? static_cast<size_t>(static_cast<uint64_t>(sourceSamples / sourceChannels) * sampleRate_ / sourceRate) : 0;
+        size_t analysed = atSource ? sourceSamples : dstFrames * channels_;
+        DeadlinePolicy::Work work;
+        if (loudness && tagged && config_.loudnessTrustMetadata) {
+            work.peakSamples = metadata.hasTruePeak ? 0 : sourceSamples;
+        }
+        else if (loudness) {
+            work.analysisSamples = analysed;
+            work.peakSamples = decoded.pcm.data && atSource ? 0 : analysed;
+            work.substitute = remembered != gainHistory_.end() || tagged;
+            work.substitutePeakSamples = remembered != gainHistory_.end() || metadata.hasTruePeak ? 0 : sourceSamples;
+        }
+        if (sourceRate != sampleRate_) work.resampleSamples = dstFrames * (std::max)(sourceChannels, channels_);
+
+        double elapsedMs = MsSince(job.submitted);
+        double predictedMs = 0.0;
+        degraded = deadline_.Plan(work, config_.deadlineMs - elapsedMs, predictedMs);
+        if (timer_.Enabled()) {
+            std::string fired;
+            if (degraded & DeadlinePolicy::DEGRADE_GAIN) {
+                fired += remembered != gainHistory_.end() ? ", remembered gain" : ", tagged gain";
+            }
+            if (degraded & DeadlinePolicy::DEGRADE_RESAMPLE) fired += ", linear resampling";
+            std::cerr << "Deadline: " << config_.deadlineMs << " ms, " << elapsedMs << " ms elapsed, "
+                      << predictedMs << " ms predicted; degraded: " << (fired.empty() ? "none" : fired.c_str() + 2);
+            if (elapsedMs + predictedMs > config_.deadlineMs) std::cerr << " (deadline at risk)";
+            std::cerr << std::endl;
+        }
+    }
+    const Resampling resampling = (degraded & DeadlinePolicy::DEGRADE_RESAMPLE) ? Resampling::Linear : Resampling::Polyphase;
+
+    // A gain from the file's tags or an earlier analysis replaces the measurement
+    float gain = 1.0f;
+    bool skipAnalysis = false;
+    if (loudness && (degraded & DeadlinePolicy::DEGRADE_GAIN) && remembered != gainHistory_.end()) {
+        gain = remembered->second;
+        skipAnalysis = true;
+        timer_.Mark("loudness (remembered)");
+    }
+    else if (loudness && (config_.loudnessTrustMetadata || (degraded & DeadlinePolicy::DEGRADE_GAIN))) {
+        skipAnalysis = MetadataGain(decoded.metadata, *item, gain);
+    }
+    if (loudness && atSource && !skipAnalysis) {
+        gain = MeasureGain(*item, channels_);
+        if (gainKey != 0 && !item->estimated) RememberGain(gainKey, gain);
+        timer_.Mark("loudness");
+    }
+
+    // Planar decoder output stays planar through conversion, loudness and fade, and is interleaved
+    // into the device buffer once at the end
+    PlanarAudio converted;
+    bool passthrough = job.data && sourceRate == sampleRate_ && sourceChannels == channels_;
+    LARGE_INTEGER convertStarted;
+    QueryPerformanceCounter(&convertStarted);
+    if (blocks) {
+        // The measurement pass above and this conversion pass each stream the PCM once; no
+        // full-length float copy of the source is made
+        item->samples = AcquireBuffer();
+        if (!ConvertPcmBlocks(decoded.pcm, sourceRate, sampleRate_, channels_, item->samples, gain, resampling)) {
+            PrintError("Failed to read file");
+            result = MINPLY_E_FILE;
+            return nullptr;
+        }
+    }
+    else if (planar) {
+        ConvertPlanar(decoded.planar, sourceRate, sampleRate_, channels_, converted, gain, resampling);
+        if (item->estimated) {
+            item->sourcePlanar = std::move(decoded.planar);
+            item->measured.planar = &item->sourcePlanar;
+        }
+    }
+    else if (passthrough) {
+        item->samples = std::move(decoded.samples);
+        ApplyGain(item->samples, gain);
+        item->measured.data = item->samples.data();
+    }
+    else {
+        item->samples = AcquireBuffer();
+        ConvertFormatInto(source, sourceSamples, sourceRate, sourceChannels, sampleRate_, channels_, item->samples,
+                          gain, resampling);
+        if (item->estimated && job.data) {
+            item->source = std::move(decoded.samples);
+            item->measured.data = item->source.data();
+        }
+    }
+    if (planar ? converted.Empty() : item->samples.empty()) {
+        PrintError("Failed to decode audio");
+        result = MINPLY_E_DECODE;
+        return nullptr;
+    }
+    if (sourceRate != sampleRate_) {
+        size_t outputFrames = planar ? converted.Frames() : item->samples.size() / channels_;
+        deadline_.Observe(resampling == Resampling::Linear ? DeadlinePolicy::Linear : DeadlinePolicy::Polyphase,
+                          outputFrames * (std::max)(sourceChannels, channels_), MsSince(convertStarted));
+    }
+    timer_.Mark("convert");
+
+    // Channel mappings libebur128 weights cannot express are measured in the device format
+    if (loudness && !atSource && !skipAnalysis) {
+        item->measured = LoudnessInput();
+        item->measured.data = item->samples.data();
+        item->measured.planar = planar ? &converted : nullptr;
+        item->measured.sampleCount = planar ? converted.Frames() * channels_ : item->samples.size();
+        item->measured.sampleRate = sampleRate_;
+        item->measured.channels = channels_;
+        float deviceGain = MeasureGain(*item, channels_);
+        if (gainKey != 0 && !item->estimated) RememberGain(gainKey, deviceGain);
+        if (planar) ApplyGainPlanar(converted, deviceGain);
+        else        ApplyGain(item->samples, deviceGain);
+        timer_.Mark("loudness (device format)");
+    }
+
+    if (planar) {
+        ApplyFadePlanar(converted, sampleRate_);
+        timer_.Mark("fade");
+        item->samples = AcquireBuffer();
+        item->samples.resize(converted.Frames() * channels_);
+        converted.Interleave(0, converted.Frames(), item->samples.data());
+        // A refinement of a device-format measurement reads the interleaved copy; converted goes away
+        if (item->measured.planar == &converted) {
+            item->measured.planar = nullptr;
+            item->measured.data = item->samples.data();
+        }
+        timer_.Mark("interleave");
+    }
+    else {
+        ApplyFade(item->samples, sampleRate_, channels_);
+        timer_.Mark("fade");
+    }
+
+    // Long inputs play at the configured tempo. The render thread stretches them a block at a time as
+    // it plays (see RenderStretched), so the first frame does not wait for the whole sound. The fades
+    // survive the stretch: WSOLA passes the first half window and the tail after its last segment
+    // through unchanged.
+    item->stretcher = TempoStretcher(item->samples.size() / channels_);
+
+    // Estimated items still change gain while playing, so only final results are cached; neither are
+    // results degraded to meet a deadline
+    if (config_.cacheEnabled && inputIdentity != 0 && !item->estimated && degraded == 0) {
+        job.cache.key = CacheKey(inputIdentity, sampleRate_, channels_, loudness);
+        job.cache.encoding = config_.cacheFormat;
+        job.cache.sampleRate = sampleRate_;
+        job.cache.channels = channels_;
+        job.cache.samples = item->samples;
+    }
+
+    // Started after ApplyFade so the refinement thread never reads samples being modified
+    if (item->estimated) {
+        Item* raw = item.get();
+        item->refine = std::thread([this, raw]() {
+            if (MeasureLoudness(raw->measured, raw->exactLoudness, &raw->cancelRefine)) {
+                raw->gain.target = ComputeLoudnessGain(raw->exactLoudness, raw->peak,
+                                                       config_.loudnessTarget, config_.loudnessPeakCeiling);
+                raw->refined = true;
+            }
+        });
+    }
+
+    lastProcessMs_ = MsSince(started);
+    if (config_.deadlineMs > 0.0f && timer_.Enabled()) {
+        std::cerr << "Deadline: processed " << MsSince(job.submitted) << " ms after submission" << std::endl;
+    }
+    result = MINPLY_OK;
+    return item;
+}
+
+void PlaybackSession::WorkerMain() {
+    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    mfStarted_ = SUCCEEDED(hr) && SUCCEEDED(MFStartup(MF_VERSION));
+    if (!mfStarted_) PrintError("Failed to initialize Media Foundation");
+
+    while (true) {
+        std::unique_ptr<PlaybackJob> job;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            jobsChanged_.wait(guard, [this]() { return closing_ || !jobs_.empty(); });
+            if (jobs_.empty()) break;
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
 
-        hr = reader->SetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, nullptr, mediaType);
-        if (FAILED(hr)) {
-            PrintError("Failed to set output format");
-            break;
+        int result = MINPLY_OK;
+        std::unique_ptr<Item> item = (job->data && !mfStarted_) ? nullptr : Process(*job, result);
+        if (!item) {
+            Finish(job->callback, job->context, mfStarted_ ? result : MINPLY_E_DECODE);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            ready_.push_back(std::move(item));
         }
+        SetEvent(renderWake_);
+
+        // Encoded and written while the sound plays rather than ahead of it
+        if (!job->cache.samples.empty()) {
+            EncodeCachePayload(job->cache);
+            timer_.Mark("cache encode");
+            StoreCachedAudio(job->cache);
+            timer_.Mark("cache store");
+        }
+    }
 
-        while (true) {
-            DWORD flags = 0;
-            IMFSample* sample = nullptr;
+    if (mfStarted_) MFShutdown();
+    if (SUCCEEDED(hr)) CoUninitialize();
 
-            hr = reader->ReadSample((DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM, 0,
-                                   nullptr, &flags, nullptr, &sample);
-            if (FAILED(hr)) break;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        workerDone_ = true;
+    }
+    SetEvent(renderWake_);
+}
 
-            // MF reports stream-level errors via flags rather than HRESULT; honor them to avoid spinning forever
-            if (flags & MF_SOURCE_READERF_ERROR) {
-                if (sample) sample->Release();
-                break;
-            }
-            if (flags & MF_SOURCE_READERF_ENDOFSTREAM) {
-                if (sample) sample->Release();
-                break;
+void PlaybackSession::RenderMain() {
+    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    if (FAILED(hr)) PrintError("Failed to initialize COM");
+    deviceOk_ = SUCCEEDED(hr) && device_.Open();
+    if (deviceOk_) {
+        sampleRate_ = device_.Format()->nSamplesPerSec;
+        channels_ = device_.Format()->nChannels;
+        if (!cacheValid_ || cachedRate_ != sampleRate_ || cachedChannels_ != channels_) {
+            SaveCachedMixFormat(sampleRate_, channels_);
+        }
+    }
+    SetEvent(formatReady_);
+    timer_.Mark("device format");
+
+    std::vector<float> leadIn, leadOut;
+    if (deviceOk_ && config_.guardEnabled) {
+        leadIn = GenerateBleGuard(sampleRate_, channels_,
+                                  config_.leadInDuration, config_.guardFrequency, config_.guardAmplitude);
+        leadOut = GenerateBleGuard(sampleRate_, channels_,
+                                   config_.leadOutDuration, config_.guardFrequency, config_.guardAmplitude);
+    }
+
+    while (true) {
+        std::unique_ptr<Item> item = PopReady();
+        bool sharedPending = shared_.IsRenderer() && shared_.HasPending();
+        if (!item && !sharedPending) {
+            bool done;
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                done = workerDone_ && ready_.empty();
             }
-            // A mid-stream media-type change would force mixing samples of different formats; discard partial data and fail
-            if (flags & MF_SOURCE_READERF_CURRENTMEDIATYPECHANGED) {
-                if (sample) sample->Release();
-                decodedData.clear();
-                break;
+            // Keep the renderer role until no handed-off item is left behind
+            if (done && (!shared_.IsRenderer() || shared_.Close())) break;
+            if (done) continue;
+
+            HANDLE waits[] = { renderWake_, shared_.Event() };
+            DWORD count = shared_.IsRenderer() ? 2 : 1;
+            if (WaitForMultipleObjects(count, waits, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+                shared_.Accept(true);
             }
+            continue;
+        }
 
-            if (sample) {
-                IMFMediaBuffer* buffer = nullptr;
-                hr = sample->ConvertToContiguousBuffer(&buffer);
-                if (SUCCEEDED(hr)) {
-                    BYTE* bufData = nullptr;
-                    DWORD dataLen = 0;
+        // Only a session with a working device can win the election, and a device failure resigns it,
+        // so shared items imply deviceOk_
+        if (item && !deviceOk_) {
+            Finish(std::move(item), MINPLY_E_DEVICE);
+            continue;
+        }
 
-                    hr = buffer->Lock(&bufData, nullptr, &dataLen);
-                    if (SUCCEEDED(hr)) {
-                        size_t sampleCount = dataLen / sizeof(float);
-                        size_t oldSize = decodedData.size();
-                        decodedData.resize(oldSize + sampleCount);
-                        memcpy(&decodedData[oldSize], bufData, dataLen);
-                        buffer->Unlock();
-                    }
-                    buffer->Release();
-                }
-                sample->Release();
+        // The first process ready to play becomes the renderer; with MINPLY_OPEN_HANDOFF a loser hands
+        // its sound to the active renderer instead of opening a second audio stream
+        // Streams cannot be handed off: the shared queue carries complete buffers only, and a sound
+        // still to be stretched would need the renderer to share this session's tempo
+        if (item && sharedOpen_ && !shared_.TryBecomeRenderer(sampleRate_, channels_) && (flags_ & MINPLY_OPEN_HANDOFF) &&
+            !item->stream && !item->stretcher) {
+            if (item->refine.joinable()) {
+                item->cancelRefine = true;
+                item->refine.join();
+            }
+            if (shared_.Submit(item->samples, sampleRate_, channels_, item->scaled ? item->gain.target.load() : 1.0f)) {
+                timer_.Mark("handoff");
+                handedOff_++;
+                Finish(std::move(item), MINPLY_OK);
+                continue;
             }
+            timer_.Mark("handoff (fallback)");
         }
 
-        success = !decodedData.empty();
+        RenderBurst(std::move(item), leadIn, leadOut);
+    }
 
-    } while (false);
+    shared_.Resign();
+    if (SUCCEEDED(hr)) CoUninitialize();
+}
 
-    if (mediaType) mediaType->Release();
-    if (reader) reader->Release();
-    if (byteStream) byteStream->Release();
-    if (istream) istream->Release();
+// Play items back to back between one lead-in and lead-out, including items handed off by other
+// processes while this session is the renderer. Items that arrive during the lead-out are played
+// after it with another lead-out, so the device is started and drained once per burst.
+bool PlaybackSession::RenderBurst(std::unique_ptr<Item> first, const std::vector<float>& leadIn,
+                                  const std::vector<float>& leadOut) {
+    auto poll = [this]() {
+        if (shared_.IsRenderer()) shared_.Accept();
+    };
+    auto renderVector = [&](const std::vector<float>& source) -> bool {
+        return source.empty() || device_.Render(source.data(), source.size() / channels_, nullptr, poll);
+    };
 
-    return success;
-}
+    // A default device picked while the session was idle is adopted before the burst starts
+    bool ok = !device_.DefaultChanged() || ReopenDevice();
+    if (ok) ok = device_.Start();
+    if (ok) ok = renderVector(leadIn);
+    std::unique_ptr<Item> item = std::move(first);
+    while (ok) {
+        if (!item) item = PopReady();
+        if (item && item->stream) {
+            ok = RenderStream(*item, leadIn, poll);
+            if (ok) played_++;
+            Finish(std::move(item), ok ? MINPLY_OK : MINPLY_E_PLAYBACK);
+            continue;
+        }
+        if (item) {
+            lastStartLatencyMs_ = MsSince(item->submitted);
+            ok = item->stretcher ? RenderStretched(*item, poll)
+                                 : device_.Render(item->samples.data(), item->samples.size() / channels_,
+                                                  item->scaled ? &item->gain : nullptr, poll);
+            if (ok) played_++;
+            Finish(std::move(item), ok ? MINPLY_OK : MINPLY_E_PLAYBACK);
+            continue;
+        }
 
-// Read all binary data from stdin into buffer
-//
-// Only reads when stdin is a pipe or redirected file to avoid blocking on
-// interactive console input. Switches to binary mode to prevent CRLF translation.
-// Returns false if stdin is not redirected, on read error, or no data was read.
-bool ReadAllStdin(std::vector<BYTE>& buffer) {
-    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    if (!hStdin || hStdin == INVALID_HANDLE_VALUE) return false;
+        SharedRenderQueue::Item sharedItem;
+        if (shared_.IsRenderer() && shared_.Next(sharedItem)) {
+            // Claimed items are already in the device format (see TryBecomeRenderer)
+            GainControl itemGain;
+            itemGain.target = sharedItem.Gain();
+            ok = device_.Render(sharedItem.Samples(), sharedItem.SampleCount() / channels_, &itemGain, poll);
+            continue;
+        }
 
-    DWORD type = GetFileType(hStdin);
-    if (type != FILE_TYPE_PIPE && type != FILE_TYPE_DISK) return false;
+        ok = renderVector(leadOut);
+        if (!ok || (!HasReady() && !(shared_.IsRenderer() && shared_.HasPending()))) break;
+    }
 
-    _setmode(_fileno(stdin), _O_BINARY);
+    if (ok) device_.Drain();
+    device_.Stop();
+    if (!ok) {
+        PrintError("Failed to play audio");
+        if (item) Finish(std::move(item), MINPLY_E_PLAYBACK);
+        // A lost or replaced endpoint is reopened once; the sound cut off above is not retried, but
+        // queued and accepted sounds play on the new device in the next burst
+        if (!((device_.Invalidated() || device_.DefaultChanged()) && ReopenDevice())) {
+            // Stop taking sounds from other processes and fail every later one instead of retrying the device
+            shared_.Abandon();
+            deviceOk_ = false;
+            while ((item = PopReady())) Finish(std::move(item), MINPLY_E_PLAYBACK);
+        }
+    }
+    timer_.Mark("playback");
+    return ok;
+}
 
-    buffer.reserve(STDIN_INITIAL_RESERVE);
+// Activate the current default endpoint again. The stream format is kept (see RenderDevice), so
+// sampleRate_/channels_, the guard tones and every item already processed for them stay valid;
+// only the persisted mix format follows the new endpoint for the next run's cache lookup.
+bool PlaybackSession::ReopenDevice() {
+    if (!device_.Reopen()) return false;
+    // Reopening is rare, so the file is rewritten unconditionally; cachedRate_ belongs to the worker
+    SaveCachedMixFormat(device_.DeviceSampleRate(), device_.DeviceChannels());
+    timer_.Mark("device reopen");
+    return true;
+}
 
-    BYTE chunk[STDIN_READ_CHUNK];
+// Play a stream's frames as they are published until it ends. While the writer has not caught up the device
+// is kept fed with short slices of the guard tone (BLE links would otherwise sleep on the underrun
+// silence); without a guard the thread just waits for the next block.
+template <typename Poll>
+bool PlaybackSession::RenderStream(Item& item, const std::vector<float>& guard, Poll&& poll) {
+    size_t sliceFrames = (std::max)(static_cast<size_t>(sampleRate_ * STREAM_GUARD_SLICE), static_cast<size_t>(1));
+    size_t guardFrames = guard.size() / channels_;
+    size_t guardOffset = 0;
+    bool first = true;
     while (true) {
-        DWORD bytesRead = 0;
-        // Distinguish EOF (success with 0 bytes) from read errors:
-        // pipe disconnect / handle invalidation must not be treated as clean EOF
-        // because that would silently truncate the input.
-        if (!ReadFile(hStdin, chunk, sizeof(chunk), &bytesRead, nullptr)) {
-            DWORD err = GetLastError();
-            // ERROR_BROKEN_PIPE on a closed write-end is a normal end-of-stream
-            if (err == ERROR_BROKEN_PIPE) break;
-            return false;
+        bool ended = item.stream->Ended();
+        size_t frames;
+        const float* span = item.stream->ReadSpan(frames);
+        if (frames > 0) {
+            if (first) {
+                LARGE_INTEGER firstWrite;
+                lastStartLatencyMs_ = MsSince(item.stream->FirstWrite(firstWrite) ? firstWrite : item.submitted);
+                timer_.Mark("stream first block");
+                first = false;
+            }
+            if (!device_.Render(span, frames, nullptr, poll)) return false;
+            item.stream->Release(frames);
+            continue;
         }
-        if (bytesRead == 0) break;
-        // Cap at 4GB; the in-memory decode path uses SHCreateMemStream (UINT length)
-        if (bytesRead > MAXUINT - buffer.size()) {
-            PrintError("stdin input exceeds 4GB limit");
+        if (ended) return true;
+
+        if (guardFrames >= sliceFrames) {
+            if (guardOffset + sliceFrames > guardFrames) guardOffset = 0;
+            if (!device_.Render(guard.data() + guardOffset * channels_, sliceFrames, nullptr, poll)) return false;
+            guardOffset += sliceFrames;
+        }
+        else {
+            poll();
+            WaitForSingleObject(item.stream->Event(), BUFFER_WAIT_MS);
+        }
+    }
+}
+
+// Play a buffered sound through its tempo stretcher, TEMPO_RENDER_BLOCK of input at a time. Each block
+// is stretched while the device still holds the previous one, so playback starts after one block
+// instead of after the whole sound, and the gain ramp carries across the blocks.
+template <typename Poll>
+bool PlaybackSession::RenderStretched(Item& item, Poll&& poll) {
+    const size_t totalFrames = item.samples.size() / channels_;
+    const size_t blockFrames = (std::max)(static_cast<size_t>(sampleRate_ * TEMPO_RENDER_BLOCK), static_cast<size_t>(1));
+    GainControl* gain = item.scaled ? &item.gain : nullptr;
+    std::vector<float> stretched;
+    size_t first = 0;
+    bool flushed = false;
+    while (!flushed) {
+        stretched.clear();
+        if (first < totalFrames) {
+            size_t frames = (std::min)(blockFrames, totalFrames - first);
+            item.stretcher->Push(item.samples.data() + first * channels_, frames, stretched);
+            first += frames;
+        }
+        else {
+            item.stretcher->Flush(stretched);
+            flushed = true;
+        }
+        if (!stretched.empty() && !device_.Render(stretched.data(), stretched.size() / channels_, gain, poll)) {
             return false;
         }
-        buffer.insert(buffer.end(), chunk, chunk + bytesRead);
     }
-    return !buffer.empty();
+    timer_.Mark("tempo");
+    return true;
 }
 
-// Generate inaudible sine wave buffer for BLE anti-clipping
-// BLE devices enter power-saving mode on digital silence, causing audio clipping.
-// A 19kHz tone at ~-60dB is inaudible to adults but keeps the BLE codec active.
-std::vector<float> GenerateBleGuard(UINT32 sampleRate, UINT32 channels, float duration,
-                                     float freq, float amp) {
-    size_t totalFrames = static_cast<size_t>(sampleRate * duration);
-    std::vector<float> buffer(totalFrames * channels);
+struct minply_session {
+    explicit minply_session(const minply_options& options) : impl(options) {}
+    PlaybackSession impl;
+};
 
-    for (size_t i = 0; i < totalFrames; i++) {
-        float t = static_cast<float>(i) / sampleRate;
-        float sample = amp * sinf(TWO_PI * freq * t);
-        for (UINT32 ch = 0; ch < channels; ch++) {
-            buffer[i * channels + ch] = sample;
+extern "C" {
+
+MINPLY_API int minply_open(const minply_options* options, minply_session** session) {
+    if (!session) return MINPLY_E_INVALID_ARG;
+    *session = nullptr;
+    try {
+        // deadline_ms is only read when flagged, so callers built against the one-field struct stay valid
+        minply_options opened = {};
+        if (options) {
+            opened.flags = options->flags;
+            if (opened.flags & MINPLY_OPEN_DEADLINE) opened.deadline_ms = options->deadline_ms;
         }
+        auto created = std::make_unique<minply_session>(opened);
+        int result = created->impl.Open();
+        if (result != MINPLY_OK) {
+            created->impl.Close();
+            return result;
+        }
+        *session = created.release();
+        return MINPLY_OK;
+    }
+    catch (...) {
+        return MINPLY_E_DEVICE;
     }
-
-    return buffer;
 }
 
-// Normalize audio using EBU R128 integrated loudness (ITU-R BS.1770-4)
-//
-// Measures integrated loudness via libebur128, computes gain to reach target,
-// then clamps gain if true peak would exceed peakCeiling.
-void NormalizeLoudness(std::vector<float>& audioData, UINT32 sampleRate, UINT32 channels,
-                       float target, float peakCeiling) {
-    if (audioData.empty()) return;
-
-    float peak = 0.0f;
-    for (float s : audioData) {
-        float v = fabsf(s);
-        if (v > peak) peak = v;
+MINPLY_API int minply_play(minply_session* session, const void* data, size_t size, uint32_t flags,
+                           minply_completion_fn callback, void* context) {
+    if (!session || !data || size == 0) return MINPLY_E_INVALID_ARG;
+    try {
+        auto job = std::make_unique<PlaybackJob>();
+        if (flags & MINPLY_PLAY_COPY) {
+            const BYTE* bytes = static_cast<const BYTE*>(data);
+            job->copy.assign(bytes, bytes + size);
+            job->data = job->copy.data();
+        }
+        else {
+            job->data = static_cast<const BYTE*>(data);
+        }
+        job->size = size;
+        job->skipLoudness = (flags & MINPLY_PLAY_NO_LOUDNESS) != 0;
+        job->callback = callback;
+        job->context = context;
+        return session->impl.Submit(std::move(job));
     }
-    if (peak < LOUDNESS_MIN_PEAK) return;
+    catch (...) {
+        return MINPLY_E_DECODE;
+    }
+}
 
-    ebur128_state* state = ebur128_init(channels, sampleRate, EBUR128_MODE_I);
-    if (!state) return;
+MINPLY_API int minply_play_file(minply_session* session, const wchar_t* path, uint32_t flags,
+                                minply_completion_fn callback, void* context) {
+    if (!session || !path) return MINPLY_E_INVALID_ARG;
+    try {
+        auto job = std::make_unique<PlaybackJob>();
+        job->file = std::make_unique<ReadAhead>();
+        const char* message = nullptr;
+        int result = job->file->Open(path, message);
+        if (result != EXIT_SUCCESS) {
+            PrintError(message);
+            return result;
+        }
+        job->data = job->file->Data();
+        job->size = job->file->Size();
+        job->skipLoudness = (flags & MINPLY_PLAY_NO_LOUDNESS) != 0;
+        job->callback = callback;
+        job->context = context;
+        return session->impl.Submit(std::move(job));
+    }
+    catch (...) {
+        return MINPLY_E_DECODE;
+    }
+}
 
-    size_t frames = audioData.size() / channels;
-    if (ebur128_add_frames_float(state, audioData.data(), frames) != EBUR128_SUCCESS) {
-        ebur128_destroy(&state);
-        return;
+MINPLY_API int minply_enqueue(minply_session* session, const float* samples, size_t frames,
+                              uint32_t sample_rate, uint32_t channels,
+                              minply_completion_fn callback, void* context) {
+    if (!session || !samples || frames == 0 || sample_rate == 0 ||
+        channels == 0 || channels > WAV_MAX_CHANNELS) {
+        return MINPLY_E_INVALID_ARG;
+    }
+    try {
+        auto job = std::make_unique<PlaybackJob>();
+        job->pcm = samples;
+        job->pcmSamples = frames * channels;
+        job->pcmRate = sample_rate;
+        job->pcmChannels = channels;
+        job->callback = callback;
+        job->context = context;
+        return session->impl.Submit(std::move(job));
     }
+    catch (...) {
+        return MINPLY_E_DECODE;
+    }
+}
 
-    double loudness = 0.0;
-    int result = ebur128_loudness_global(state, &loudness);
-    ebur128_destroy(&state);
+MINPLY_API int minply_play_tone(minply_session* session, const char* pattern,
+                                minply_completion_fn callback, void* context) {
+    if (!session || !pattern) return MINPLY_E_INVALID_ARG;
+    try {
+        auto job = std::make_unique<PlaybackJob>();
+        if (!ParseTonePattern(pattern, job->tone)) return MINPLY_E_INVALID_ARG;
+        job->callback = callback;
+        job->context = context;
+        return session->impl.Submit(std::move(job));
+    }
+    catch (...) {
+        return MINPLY_E_DECODE;
+    }
+}
 
-    if (result != EBUR128_SUCCESS || !std::isfinite(loudness)) return;
+struct minply_stream {
+    std::shared_ptr<PcmStream> impl;
+};
 
-    float gain = static_cast<float>(pow(10.0, (target - loudness) / 20.0));
+MINPLY_API int minply_stream_open(minply_session* session, uint32_t format, uint32_t sample_rate,
+                                  uint32_t channels, minply_completion_fn callback, void* context,
+                                  minply_stream** stream) {
+    if (!stream) return MINPLY_E_INVALID_ARG;
+    *stream = nullptr;
+    if (!session || (format != MINPLY_FORMAT_S16LE && format != MINPLY_FORMAT_F32LE) ||
+        sample_rate == 0 || channels == 0 || channels > WAV_MAX_CHANNELS) {
+        return MINPLY_E_INVALID_ARG;
+    }
+    try {
+        auto created = std::make_unique<minply_stream>();
+        created->impl = std::make_shared<PcmStream>(format, sample_rate, channels);
+        int result = session->impl.SubmitStream(created->impl, callback, context);
+        if (result != MINPLY_OK) return result;
+        *stream = created.release();
+        return MINPLY_OK;
+    }
+    catch (...) {
+        return MINPLY_E_DEVICE;
+    }
+}
 
-    if (peak * gain > peakCeiling) {
-        gain = peakCeiling / peak;
+MINPLY_API int minply_stream_write(minply_stream* stream, const void* data, size_t size) {
+    if (!stream || (!data && size > 0)) return MINPLY_E_INVALID_ARG;
+    if (size == 0) return MINPLY_OK;
+    try {
+        stream->impl->Write(static_cast<const BYTE*>(data), size);
+        return MINPLY_OK;
     }
+    catch (...) {
+        return MINPLY_E_PLAYBACK;
+    }
+}
 
-    for (float& s : audioData) {
-        s *= gain;
+MINPLY_API void minply_stream_close(minply_stream* stream) {
+    if (!stream) return;
+    try {
+        stream->impl->End();
     }
+    catch (...) {
+        stream->impl->Abort();
+    }
+    delete stream;
 }
 
-// Apply fade-in/out to audio data to prevent click noise from waveform discontinuity
-void ApplyFade(std::vector<float>& audioData, UINT32 sampleRate, UINT32 channels) {
-    UINT32 fadeFrames = static_cast<UINT32>(sampleRate * FADE_DURATION);
-    UINT32 totalFrames = static_cast<UINT32>(audioData.size() / channels);
-    if (totalFrames < fadeFrames * 2) return; // too short for fade
+MINPLY_API int minply_stats_get(minply_session* session, minply_stats* stats) {
+    if (!session || !stats) return MINPLY_E_INVALID_ARG;
+    session->impl.Stats(*stats);
+    return MINPLY_OK;
+}
 
-    // Fade in
-    for (UINT32 i = 0; i < fadeFrames; i++) {
-        float gain = static_cast<float>(i) / fadeFrames;
-        for (UINT32 ch = 0; ch < channels; ch++) {
-            audioData[i * channels + ch] *= gain;
-        }
-    }
+MINPLY_API void minply_close(minply_session* session) {
+    if (!session) return;
+    session->impl.Close();
+    delete session;
+}
 
-    // Fade out
-    UINT32 fadeStart = totalFrames - fadeFrames;
-    for (UINT32 i = fadeStart; i < totalFrames; i++) {
-        float gain = static_cast<float>(totalFrames - i) / fadeFrames;
-        for (UINT32 ch = 0; ch < channels; ch++) {
-            audioData[i * channels + ch] *= gain;
+}  // extern "C"
+
+#ifndef MINPLY_BUILD_DLL
+// Parse a --raw specification "<s16le|f32le>:<rate>:<channels>"
+static bool ParseRawFormat(const wchar_t* spec, UINT32& format, UINT32& sampleRate, UINT32& channels) {
+    const wchar_t* colon = wcschr(spec, L':');
+    if (!colon) return false;
+    std::wstring name(spec, colon);
+    if (name == L"s16le") format = MINPLY_FORMAT_S16LE;
+    else if (name == L"f32le") format = MINPLY_FORMAT_F32LE;
+    else return false;
+
+    wchar_t* end = nullptr;
+    unsigned long rate = wcstoul(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != L':') return false;
+    const wchar_t* channelText = end + 1;
+    unsigned long count = wcstoul(channelText, &end, 10);
+    if (end == channelText || *end != L'\0') return false;
+    if (rate == 0 || rate > 768000 || count == 0 || count > WAV_MAX_CHANNELS) return false;
+    sampleRate = static_cast<UINT32>(rate);
+    channels = static_cast<UINT32>(count);
+    return true;
+}
+
+// Forward stdin to a PCM stream block by block as the producer writes it
+//
+// ReadFile on a pipe returns as soon as any data is available, so each block reaches the session
+// without waiting for STDIN_READ_CHUNK bytes or for the end of input.
+static int StreamStdin(minply_stream* stream) {
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    if (!hStdin || hStdin == INVALID_HANDLE_VALUE) return ERR_FILE_NOT_FOUND;
+    DWORD type = GetFileType(hStdin);
+    if (type != FILE_TYPE_PIPE && type != FILE_TYPE_DISK) return ERR_FILE_NOT_FOUND;
+    _setmode(_fileno(stdin), _O_BINARY);
+
+    std::vector<BYTE> chunk(STDIN_READ_CHUNK);
+    size_t total = 0;
+    while (true) {
+        DWORD bytesRead = 0;
+        if (!ReadFile(hStdin, chunk.data(), static_cast<DWORD>(chunk.size()), &bytesRead, nullptr)) {
+            if (GetLastError() == ERROR_BROKEN_PIPE) break;
+            PrintError("Failed to read stdin");
+            return ERR_FILE_NOT_FOUND;
         }
+        if (bytesRead == 0) break;
+        if (minply_stream_write(stream, chunk.data(), bytesRead) != MINPLY_OK) return ERR_PLAYBACK_FAILED;
+        total += bytesRead;
     }
+    return total > 0 ? EXIT_SUCCESS : ERR_FILE_NOT_FOUND;
 }
 
-// Play audio using WASAPI
-bool PlayAudio(const std::vector<float>& audioData, const WAVEFORMATEX* mixFormat,
-               const std::vector<float>& leadIn = {},
-               const std::vector<float>& leadOut = {}) {
-    HRESULT hr;
-    IMMDeviceEnumerator* deviceEnumerator = nullptr;
-    IMMDevice* device = nullptr;
-    IAudioClient* audioClient = nullptr;
-    IAudioRenderClient* renderClient = nullptr;
-    HANDLE eventHandle = nullptr;
-    bool success = false;
-
-    UINT32 channels = mixFormat->nChannels;
+// Buffered stdin reader for the --framed protocol (text header lines followed by binary payloads)
+class StdinReader {
+public:
+    bool Open() {
+        handle_ = GetStdHandle(STD_INPUT_HANDLE);
+        if (!handle_ || handle_ == INVALID_HANDLE_VALUE) return false;
+        DWORD type = GetFileType(handle_);
+        if (type != FILE_TYPE_PIPE && type != FILE_TYPE_DISK) return false;
+        _setmode(_fileno(stdin), _O_BINARY);
+        buffer_.resize(STDIN_READ_CHUNK);
+        return true;
+    }
 
-    do {
-        hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL,
-                              __uuidof(IMMDeviceEnumerator), (void**)&deviceEnumerator);
-        if (FAILED(hr)) {
-            PrintError("Failed to create device enumerator");
-            break;
+    // Read one line without its CR/LF. False at end of input (eof set if nothing was pending),
+    // on a read error or when the line exceeds FRAME_HEADER_MAX.
+    bool ReadLine(std::string& line, bool& eof) {
+        line.clear();
+        eof = false;
+        while (true) {
+            if (pos_ == end_ && !Fill()) {
+                eof = line.empty() && !failed_;
+                return false;
+            }
+            BYTE c = buffer_[pos_++];
+            if (c == '\n') break;
+            if (line.size() >= FRAME_HEADER_MAX) return false;
+            line.push_back(static_cast<char>(c));
         }
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
 
-        hr = deviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device);
-        if (FAILED(hr)) {
-            PrintError("Failed to get default audio device");
-            break;
+    bool ReadExact(BYTE* dst, size_t size) {
+        while (size > 0) {
+            if (pos_ == end_ && !Fill()) return false;
+            size_t n = (std::min)(size, end_ - pos_);
+            memcpy(dst, buffer_.data() + pos_, n);
+            pos_ += n;
+            dst += n;
+            size -= n;
         }
+        return true;
+    }
 
-        hr = device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, nullptr, (void**)&audioClient);
-        if (FAILED(hr)) {
-            PrintError("Failed to activate audio client");
-            break;
+private:
+    bool Fill() {
+        DWORD bytesRead = 0;
+        if (!ReadFile(handle_, buffer_.data(), static_cast<DWORD>(buffer_.size()), &bytesRead, nullptr)) {
+            // ERROR_BROKEN_PIPE on a closed write-end is a normal end-of-stream
+            failed_ = GetLastError() != ERROR_BROKEN_PIPE;
+            return false;
         }
+        pos_ = 0;
+        end_ = bytesRead;
+        return bytesRead > 0;
+    }
 
-        eventHandle = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-        if (!eventHandle) {
-            PrintError("Failed to create event");
-            break;
-        }
+    HANDLE handle_ = nullptr;
+    std::vector<BYTE> buffer_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    bool failed_ = false;
+};
 
-        hr = audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-                                     AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
-                                     0, 0, mixFormat, nullptr);
-        if (FAILED(hr)) {
-            PrintError("Failed to initialize audio client");
-            break;
+// Completion reporting shared by all messages of a --framed run
+struct FramedOutput {
+    std::mutex lock;                 // Completions arrive on the session's worker and render threads
+    std::atomic<int> firstError{MINPLY_OK};
+
+    void Report(const std::string& id, int result) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::cout << id << " " << result << std::endl;
         }
+        int expected = MINPLY_OK;
+        if (result != MINPLY_OK) firstError.compare_exchange_strong(expected, result);
+    }
+};
 
-        hr = audioClient->SetEventHandle(eventHandle);
-        if (FAILED(hr)) {
-            PrintError("Failed to set event handle");
+// One framed message in flight; owns its payload until its completion line is written
+struct FramedItem {
+    std::string id;
+    std::vector<BYTE> data;
+    FramedOutput* output = nullptr;
+};
+
+// Play a sequence of length-prefixed messages from stdin in one warm session
+//
+// Each message is a header line "<length> [id=<token>] [loudness=on|off]" followed by exactly
+// <length> bytes of encoded audio, at most FRAMED_MAX_BYTES. Messages are submitted as soon as they are read, so the next one
+// is decoded while the current one plays; every message produces a "<id> <exit code>" line on stdout
+// when it finishes, in completion order. The id defaults to the message's 1-based sequence number.
+static int RunFramed(const minply_options& options) {
+    StdinReader reader;
+    if (!reader.Open()) {
+        PrintError("No input data on stdin");
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    minply_session* session = nullptr;
+    int exitCode = minply_open(&options, &session);
+    if (exitCode != MINPLY_OK) return exitCode;
+
+    FramedOutput output;
+    auto onComplete = [](void* context, int result) {
+        std::unique_ptr<FramedItem> item(static_cast<FramedItem*>(context));
+        item->output->Report(item->id, result);
+    };
+
+    unsigned long long sequence = 0;
+    while (true) {
+        std::string line;
+        bool eof = false;
+        if (!reader.ReadLine(line, eof)) {
+            if (!eof) {
+                PrintError("Invalid frame header");
+                exitCode = ERR_INVALID_ARGS;
+            }
             break;
         }
-
-        UINT32 bufferFrameCount;
-        hr = audioClient->GetBufferSize(&bufferFrameCount);
-        if (FAILED(hr)) {
-            PrintError("Failed to get buffer size");
+        if (line.empty()) continue;
+        sequence++;
+
+        auto item = std::make_unique<FramedItem>();
+        item->id = std::to_string(sequence);
+        item->output = &output;
+        uint32_t flags = 0;
+        unsigned long long length = 0;
+        bool valid = true;
+        size_t start = 0;
+        bool first = true;
+        while (start < line.size() && valid) {
+            size_t stop = line.find(' ', start);
+            if (stop == std::string::npos) stop = line.size();
+            std::string token = line.substr(start, stop - start);
+            start = stop + 1;
+            if (token.empty()) continue;
+            if (first) {
+                first = false;
+                char* end = nullptr;
+                length = strtoull(token.c_str(), &end, 10);
+                valid = *end == '\0' && token[0] != '-' && length <= FRAMED_MAX_BYTES;
+            }
+            else if (token.compare(0, 3, "id=") == 0 && token.size() > 3) {
+                item->id = token.substr(3);
+            }
+            else if (token == "loudness=off") {
+                flags |= MINPLY_PLAY_NO_LOUDNESS;
+            }
+            // Other options (including loudness=on) are ignored so newer producers keep working
+        }
+        if (!valid) {
+            PrintError("Invalid frame header");
+            exitCode = ERR_INVALID_ARGS;
             break;
         }
 
-        hr = audioClient->GetService(__uuidof(IAudioRenderClient), (void**)&renderClient);
-        if (FAILED(hr)) {
-            PrintError("Failed to get render client");
+        // Messages in flight can still exhaust memory together; that ends the sequence like a bad header
+        try {
+            item->data.resize(static_cast<size_t>(length));
+        }
+        catch (const std::bad_alloc&) {
+            PrintError("Invalid frame header");
+            exitCode = ERR_INVALID_ARGS;
             break;
         }
-
-        hr = audioClient->Start();
-        if (FAILED(hr)) {
-            PrintError("Failed to start audio client");
+        if (!reader.ReadExact(item->data.data(), item->data.size())) {
+            PrintError("Truncated frame");
+            exitCode = ERR_INVALID_ARGS;
             break;
         }
+        FramedItem* raw = item.get();
+        int result = minply_play(session, raw->data.data(), raw->data.size(), flags, onComplete, raw);
+        if (result == MINPLY_OK) {
+            item.release();
+        }
+        else {
+            output.Report(raw->id, result);
+        }
+    }
 
-        // Play lead-in (BLE guard), main audio, then lead-out (BLE guard)
-        const std::vector<float>* sources[] = { &leadIn, &audioData, &leadOut };
-        bool playbackAborted = false;
-        for (const auto* source : sources) {
-            if (source->empty()) continue;
-
-            size_t totalFrames = source->size() / channels;
-            size_t frameIndex = 0;
-
-            // Stall detection based on consecutive WAIT_TIMEOUT wakeups (event auto-reset guarantees ~BUFFER_WAIT_MS per timeout)
-            int stallCount = 0;
-            while (frameIndex < totalFrames) {
-                DWORD waitResult = WaitForSingleObject(eventHandle, BUFFER_WAIT_MS);
-                if (waitResult == WAIT_TIMEOUT) {
-                    if (++stallCount >= RENDER_MAX_STALL_ITERATIONS) {
-                        PrintError("Audio device stopped responding");
-                        playbackAborted = true;
-                        break;
-                    }
-                    continue;
-                }
-                // Any non-signaled return (WAIT_FAILED / WAIT_ABANDONED) means the audio thread is no longer
-                // pumping; treat this as a hard failure rather than letting the outer loop report success.
-                if (waitResult != WAIT_OBJECT_0) {
-                    playbackAborted = true;
-                    break;
-                }
-
-                UINT32 numFramesPadding;
-                hr = audioClient->GetCurrentPadding(&numFramesPadding);
-                if (FAILED(hr)) {
-                    playbackAborted = true;
-                    break;
-                }
-
-                UINT32 numFramesAvailable = bufferFrameCount - numFramesPadding;
-                if (numFramesAvailable == 0) continue;
-
-                UINT32 framesToWrite = static_cast<UINT32>(
-                    (std::min)(static_cast<size_t>(numFramesAvailable), totalFrames - frameIndex)
-                );
-
-                BYTE* buffer;
-                hr = renderClient->GetBuffer(framesToWrite, &buffer);
-                if (FAILED(hr)) {
-                    playbackAborted = true;
-                    break;
-                }
+    minply_close(session);
+    return exitCode != MINPLY_OK ? exitCode : output.firstError.load();
+}
 
-                size_t byteCount = framesToWrite * mixFormat->nBlockAlign;
-                memcpy(buffer, &(*source)[frameIndex * channels], byteCount);
+// Contents of one input file, or the error that prevented reading it
+struct LoadedFile {
+    std::vector<BYTE> data;
+    int error = EXIT_SUCCESS;
+    const char* message = nullptr;
+    int playResult = MINPLY_OK;
+};
 
-                hr = renderClient->ReleaseBuffer(framesToWrite, 0);
-                if (FAILED(hr)) {
-                    playbackAborted = true;
-                    break;
-                }
+// Read a whole file with one open, one size query and one read
+//
+// CreateFileW's own failure stands in for an up-front GetFileAttributesW existence check.
+// FILE_FLAG_SEQUENTIAL_SCAN lets the cache manager read ahead aggressively on a cold cache.
+static void LoadFile(const wchar_t* filePath, LoadedFile& file) {
+    // Zip entries go through the archive reader and are copied out once fully available
+    std::wstring archivePath;
+    std::string entryName;
+    if (ParseZipSpec(filePath, archivePath, entryName)) {
+        ReadAhead entry;
+        file.error = entry.Open(filePath, file.message);
+        if (file.error != EXIT_SUCCESS) return;
+        if (!entry.Ensure(entry.Size())) {
+            file.error = ERR_FILE_NOT_FOUND;
+            file.message = "Failed to read file";
+            return;
+        }
+        file.data.assign(entry.Data(), entry.Data() + entry.Size());
+        return;
+    }
 
-                frameIndex += framesToWrite;
-                stallCount = 0;
-            }
-            if (playbackAborted) break;
+    HANDLE hFile = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        file.error = ERR_FILE_NOT_FOUND;
+        file.message = "File not found";
+        return;
+    }
+    do {
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(hFile, &fileSize)) {
+            file.error = ERR_FILE_NOT_FOUND;
+            file.message = "Failed to read file";
+            break;
         }
-        if (playbackAborted) {
-            audioClient->Stop();
+        if (fileSize.QuadPart == 0) {
+            file.error = ERR_FILE_NOT_FOUND;
+            file.message = "File is empty";
             break;
         }
-
-        // Wait for buffered samples to actually play out, with a hard cap so a stuck device cannot hang the process
-        UINT32 numFramesPadding = 0;
-        DWORD drainElapsed = 0;
-        bool drainedCleanly = false;
-        while (drainElapsed < DRAIN_TIMEOUT_MS) {
-            Sleep(DRAIN_POLL_MS);
-            drainElapsed += DRAIN_POLL_MS;
-            hr = audioClient->GetCurrentPadding(&numFramesPadding);
-            if (FAILED(hr)) break;
-            if (numFramesPadding == 0) {
-                drainedCleanly = true;
-                break;
-            }
+        // Guard against 4GB+ files: ReadFile takes DWORD, and notification sounds
+        // never approach this size in practice
+        if (fileSize.QuadPart > MAXDWORD) {
+            file.error = ERR_DECODE_FAILED;
+            file.message = "File too large";
+            break;
+        }
+        file.data.resize(static_cast<size_t>(fileSize.QuadPart));
+        DWORD toRead = static_cast<DWORD>(fileSize.QuadPart);
+        DWORD bytesRead = 0;
+        if (!ReadFile(hFile, file.data.data(), toRead, &bytesRead, nullptr) || bytesRead != toRead) {
+            file.error = ERR_FILE_NOT_FOUND;
+            file.message = "Failed to read file";
+            file.data.clear();
         }
-
-        // Only honor the trailing pad when drain completed normally; skip it on timeout to avoid compounding the delay
-        if (drainedCleanly) Sleep(DRAIN_WAIT_MS);
-
-        audioClient->Stop();
-        success = true;
-
     } while (false);
-
-    // Release resources
-    if (renderClient) renderClient->Release();
-    if (audioClient) audioClient->Release();
-    if (device) device->Release();
-    if (deviceEnumerator) deviceEnumerator->Release();
-    if (eventHandle) CloseHandle(eventHandle);
-
-    return success;
+    CloseHandle(hFile);
 }
 
-// Parse a subset of TOML (sections + bool/float key-value) into config.
+// Reads many input files with up to LOAD_QUEUE_DEPTH requests in flight
 //
-// Unknown sections and keys are silently ignored.
-// Returns false only if the file cannot be opened; parse warnings go to stderr.
-static bool ParseTomlFile(const wchar_t* path, AppConfig& config) {
-    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
-                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-    if (hFile == INVALID_HANDLE_VALUE) return false;
-
-    DWORD fileSize = GetFileSize(hFile, nullptr);
-    if (fileSize == INVALID_FILE_SIZE) {
-        CloseHandle(hFile);
-        return false;
-    }
-    // Hard cap to keep a hostile or accidental huge TOML from exhausting memory
-    constexpr DWORD MAX_TOML_SIZE = 1024 * 1024;
-    if (fileSize > MAX_TOML_SIZE) {
-        CloseHandle(hFile);
-        char nameBuf[MAX_PATH] = {};
-        WideCharToMultiByte(CP_UTF8, 0, PathFindFileNameW(path), -1, nameBuf, sizeof(nameBuf), nullptr, nullptr);
-        std::cerr << "Warning: " << nameBuf << ": config file too large; ignored" << std::endl;
-        return false;
+// Workers claim files in argument order and fill per-file slots; Wait hands them out in the same
+// order as each completes, so the first sound can be submitted while later files are still loading.
+// Reading is synchronous per worker: the concurrency hides open/size/read latency across files,
+// which is what dominates for many small files on a cold cache.
+class BatchLoader {
+public:
+    explicit BatchLoader(const std::vector<const wchar_t*>& paths)
+        : paths_(paths), files_(paths.size()), done_(paths.size(), false) {}
+    BatchLoader(const BatchLoader&) = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+
+    ~BatchLoader() {
+        for (std::thread& worker : workers_) worker.join();
     }
-    std::string content(fileSize, '\0');
-    DWORD bytesRead = 0;
-    bool ok = (fileSize == 0) || ReadFile(hFile, &content[0], fileSize, &bytesRead, nullptr);
-    CloseHandle(hFile);
-    if (!ok) return false;
-    content.resize(bytesRead);
 
-    std::string section;
-    size_t lineStart = 0;
-    int lineNum = 0;
+    void Start() {
+        size_t count = (std::min)(static_cast<size_t>(LOAD_QUEUE_DEPTH), paths_.size());
+        for (size_t i = 0; i < count; i++) {
+            workers_.emplace_back([this]() { WorkerMain(); });
+        }
+    }
 
-    auto trim = [](const std::string& s) -> std::string {
-        const char* ws = " \t\r";
-        size_t a = s.find_first_not_of(ws);
-        if (a == std::string::npos) return {};
-        size_t b = s.find_last_not_of(ws);
-        return s.substr(a, b - a + 1);
-    };
+    // Block until file index has been read; the slot stays owned by the loader
+    LoadedFile& Wait(size_t index) {
+        std::unique_lock<std::mutex> guard(lock_);
+        loaded_.wait(guard, [this, index]() { return done_[index]; });
+        return files_[index];
+    }
 
-    while (lineStart < content.size()) {
-        size_t lineEnd = content.find('\n', lineStart);
-        if (lineEnd == std::string::npos) lineEnd = content.size();
-        std::string line = trim(content.substr(lineStart, lineEnd - lineStart));
-        lineStart = lineEnd + 1;
-        lineNum++;
+private:
+    void WorkerMain() {
+        while (true) {
+            size_t index = next_.fetch_add(1);
+            if (index >= paths_.size()) break;
+            LoadFile(paths_[index], files_[index]);
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                done_[index] = true;
+            }
+            loaded_.notify_all();
+        }
+    }
 
-        if (line.empty() || line[0] == '#') continue;
+    std::vector<const wchar_t*> paths_;
+    std::vector<LoadedFile> files_;
+    std::vector<bool> done_;             // Guarded by lock_
+    std::atomic<size_t> next_{0};
+    std::mutex lock_;
+    std::condition_variable loaded_;
+    std::vector<std::thread> workers_;
+};
 
-        if (line[0] == '[' && line.back() == ']') {
-            section = trim(line.substr(1, line.size() - 2));
+// Play several input files in argument order in one session
+//
+// Files are read by the BatchLoader and each is submitted as soon as it and all earlier files are
+// in, so decoding and playback overlap the remaining reads. A file that cannot be read is reported
+// and skipped; the exit code is the first failure among reads and playbacks.
+static int RunBatch(const std::vector<const wchar_t*>& paths, const minply_options& options, StageTimer& timer) {
+    minply_session* session = nullptr;
+    int exitCode = minply_open(&options, &session);
+    if (exitCode != MINPLY_OK) return exitCode;
+
+    BatchLoader loader(paths);
+    loader.Start();
+    size_t totalBytes = 0;
+    std::vector<LoadedFile*> submitted;
+    for (size_t i = 0; i < paths.size(); i++) {
+        LoadedFile& file = loader.Wait(i);
+        if (file.error != EXIT_SUCCESS) {
+            PrintError(file.message);
+            if (exitCode == MINPLY_OK) exitCode = file.error;
             continue;
         }
+        totalBytes += file.data.size();
+        // The callback releases the data once played; the slot itself lives until the loader is destroyed
+        int result = minply_play(session, file.data.data(), file.data.size(), 0,
+                                 [](void* context, int result) {
+                                     LoadedFile* played = static_cast<LoadedFile*>(context);
+                                     played->playResult = result;
+                                     std::vector<BYTE>().swap(played->data);
+                                 },
+                                 &file);
+        if (result != MINPLY_OK) file.playResult = result;
+        submitted.push_back(&file);
+    }
+    timer.Mark("read");
+    if (timer.Enabled()) std::cerr << "Input: " << paths.size() << " files, " << totalBytes << " bytes" << std::endl;
 
-        size_t eq = line.find('=');
-        if (eq == std::string::npos) continue;
+    minply_close(session);
+    for (LoadedFile* file : submitted) {
+        if (exitCode == MINPLY_OK) exitCode = file->playResult;
+    }
+    return exitCode;
+}
 
-        std::string key = trim(line.substr(0, eq));
-        std::string val = trim(line.substr(eq + 1));
+// Synthesize and play a tone pattern (--tone) in one session; no input is read
+static int RunTone(const wchar_t* pattern, const minply_options& options) {
+    // Patterns are ASCII; checked here so a typo fails before the device is opened
+    std::string text;
+    for (const wchar_t* c = pattern; *c; c++) {
+        if (*c > 0x7F) {
+            text.clear();
+            break;
+        }
+        text += static_cast<char>(*c);
+    }
+    std::vector<ToneStep> steps;
+    if (text.empty() || !ParseTonePattern(text.c_str(), steps)) {
+        PrintError("Invalid --tone pattern (expected <Hz>[+<Hz>]:<duration>[:<envelope>],...)");
+        return ERR_INVALID_ARGS;
+    }
 
-        size_t hash = val.find('#');
-        if (hash != std::string::npos) val = trim(val.substr(0, hash));
+    minply_session* session = nullptr;
+    int exitCode = minply_open(&options, &session);
+    if (exitCode != MINPLY_OK) return exitCode;
+    int playResult = MINPLY_OK;
+    exitCode = minply_play_tone(session, text.c_str(),
+                                [](void* context, int result) { *static_cast<int*>(context) = result; },
+                                &playResult);
+    minply_close(session);
+    return exitCode != MINPLY_OK ? exitCode : playResult;
+}
 
-        auto parseBool = [&](bool& dest) {
-            if (val == "true") dest = true;
-            else if (val == "false") dest = false;
-            else std::cerr << "Warning: config line " << lineNum << ": invalid bool '" << val << "'" << std::endl;
-        };
-        // Parse and range-check a float value.
-        // Rejects non-finite values and values outside [minVal, maxVal]; keeps the existing default on failure.
-        auto parseFloat = [&](float& dest, float minVal, float maxVal) {
-            char* end;
-            float v = strtof(val.c_str(), &end);
-            if (end == val.c_str() || !std::isfinite(v) || v < minVal || v > maxVal) {
-                std::cerr << "Warning: config line " << lineNum << ": invalid value '" << val << "'" << std::endl;
-                return;
-            }
-            dest = v;
-        };
+#ifdef MINPLY_SELF_TEST
+// Self-checks of the pure codec and parser functions
+//
+// Built into a console binary by "task test" (build.ps1 -SelfTest) and run with --self-test.
+// Each failed check is reported to stderr; the exit code is nonzero if any failed.
+static int selfTestFailures = 0;
+
+static void SelfCheck(bool passed, const char* name) {
+    if (passed) return;
+    std::cerr << "Self-test failed: " << name << std::endl;
+    selfTestFailures++;
+}
 
-        if (section == "guard") {
-            if      (key == "enabled")          parseBool(config.guardEnabled);
-            else if (key == "frequency")        parseFloat(config.guardFrequency, 20.0f, 20000.0f);
-            else if (key == "amplitude")        parseFloat(config.guardAmplitude, 0.0f, 1.0f);
-            else if (key == "lead_in_duration") parseFloat(config.leadInDuration, 0.0f, 10.0f);
-            else if (key == "lead_out_duration") parseFloat(config.leadOutDuration, 0.0f, 10.0f);
-        }
-        else if (section == "loudness") {
-            if      (key == "enabled")      parseBool(config.loudnessEnabled);
-            else if (key == "target")       parseFloat(config.loudnessTarget, -70.0f, 0.0f);
-            else if (key == "peak_ceiling") parseFloat(config.loudnessPeakCeiling, 0.001f, 1.0f);
-        }
+// Encode and decode samples; true when every sample comes back bit-exact
+static bool RiceRoundTrip(const std::vector<float>& samples, UINT32 channels) {
+    std::vector<BYTE> payload;
+    EncodeRice24(samples, channels, payload);
+    std::vector<float> decoded;
+    return DecodeRice24(payload.data(), payload.size(), samples.size(), channels, decoded) &&
+           decoded == samples;
+}
+
+static void SelfTestRice24() {
+    constexpr float STEP = 1.0f / RICE_SCALE;
+    const float fullScale = (RICE_SCALE - 1.0f) * STEP;
+
+    SelfCheck(RiceRoundTrip(std::vector<float>(RICE_BLOCK_FRAMES * 2 * 2, 0.0f), 2), "rice24 silence");
+
+    std::vector<float> extremes(RICE_BLOCK_FRAMES * 2);
+    for (size_t i = 0; i < extremes.size(); i++) extremes[i] = (i / 3) % 2 ? fullScale : -fullScale;
+    SelfCheck(RiceRoundTrip(extremes, 2), "rice24 full scale");
+
+    // Isolated spikes in silence give a partition parameter of 0, so each spike takes the escape
+    std::vector<float> spikes(RICE_BLOCK_FRAMES, 0.0f);
+    for (size_t i = 100; i < spikes.size(); i += 700) spikes[i] = (i & 1) ? -fullScale : fullScale;
+    spikes[3000] = RICE_LIMIT;
+    spikes[3001] = -RICE_LIMIT;
+    SelfCheck(RiceRoundTrip(spikes, 1), "rice24 escape");
+
+    // A final block shorter than RICE_BLOCK_FRAMES, and inputs shorter than the predictor order
+    std::vector<float> tone((RICE_BLOCK_FRAMES * 2 + 3) * 6);
+    for (size_t i = 0; i < tone.size(); i++) tone[i] = lrintf(sinf(i * 0.001f) * 0.5f * RICE_SCALE) * STEP;
+    SelfCheck(RiceRoundTrip(tone, 6), "rice24 short final block");
+    SelfCheck(RiceRoundTrip({ 0.25f }, 1), "rice24 one frame");
+    SelfCheck(RiceRoundTrip({ 0.25f, -0.5f, 0.75f, STEP, -STEP, 0.0f }, 2), "rice24 three frames");
+
+    std::vector<BYTE> payload;
+    EncodeRice24(tone, 6, payload);
+    std::vector<float> decoded;
+    bool rejected = true;
+    for (size_t size : { static_cast<size_t>(0), static_cast<size_t>(7), payload.size() / 2, payload.size() - 1 }) {
+        rejected = rejected && !DecodeRice24(payload.data(), size, tone.size(), 6, decoded);
     }
-    return true;
+    SelfCheck(rejected, "rice24 rejects truncated payload");
+    SelfCheck(!DecodeRice24(payload.data(), payload.size(), tone.size() - 6, 6, decoded), "rice24 rejects wrong length");
+
+    // Cut bytes off the last block and shrink the offset table to match: only the bit reader can notice
+    UINT32 blockCount;
+    memcpy(&blockCount, payload.data() + sizeof(UINT32), sizeof(UINT32));
+    size_t endOffset = sizeof(UINT32) * 2 + blockCount * sizeof(UINT32);
+    UINT32 end;
+    memcpy(&end, payload.data() + endOffset, sizeof(UINT32));
+    std::vector<BYTE> cut(payload.begin(), payload.end() - 16);
+    end -= 16;
+    memcpy(cut.data() + endOffset, &end, sizeof(UINT32));
+    SelfCheck(!DecodeRice24(cut.data(), cut.size(), tone.size(), 6, decoded), "rice24 rejects truncated block");
+
+    // All-ones block data reads an invalid predictor order
+    std::vector<BYTE> garbage = payload;
+    std::fill(garbage.begin() + endOffset + sizeof(UINT32), garbage.end(), 0xFF);
+    SelfCheck(!DecodeRice24(garbage.data(), garbage.size(), tone.size(), 6, decoded), "rice24 rejects corrupt block");
 }
 
-// Load configuration from minply.toml and minply.local.toml in the executable directory.
-//
-// Missing files are silently skipped. Returns default AppConfig if both are absent.
-static AppConfig LoadConfig() {
-    AppConfig config;
+// Plan against the initial per-sample costs (analysis 30, peak 2, polyphase 60, linear 8 ns)
+static void SelfTestDeadlinePlan() {
+    DeadlinePolicy policy;
+    DeadlinePolicy::Work work;
+    work.analysisSamples = 1000000;        // 30 ms
+    work.peakSamples = 1000000;            // 2 ms
+    work.resampleSamples = 1000000;        // 60 ms polyphase, 8 ms linear
+    double predicted = 0.0;
+    const auto near = [&](double ms) { return fabs(predicted - ms) < 1e-6; };
+
+    SelfCheck(policy.Plan(work, 200.0, predicted) == 0 && near(92.0), "deadline plan fits");
+    // Without a substitute gain only resampling quality can go; the peak pass always stays
+    SelfCheck(policy.Plan(work, 51.0, predicted) == DeadlinePolicy::DEGRADE_RESAMPLE && near(40.0),
+              "deadline plan degrades resampling");
+    SelfCheck(policy.Plan(work, 10.0, predicted) == DeadlinePolicy::DEGRADE_RESAMPLE && near(40.0),
+              "deadline plan keeps the peak pass");
+
+    work.substitute = true;
+    SelfCheck(policy.Plan(work, 80.0, predicted) == DeadlinePolicy::DEGRADE_GAIN && near(60.0),
+              "deadline plan substitutes the gain first");
+    SelfCheck(policy.Plan(work, 20.0, predicted) == (DeadlinePolicy::DEGRADE_GAIN | DeadlinePolicy::DEGRADE_RESAMPLE) &&
+              near(8.0), "deadline plan substitutes and resamples linearly");
+    work.substitutePeakSamples = 1000000;
+    work.resampleSamples = 0;
+    SelfCheck(policy.Plan(work, 1.0, predicted) == DeadlinePolicy::DEGRADE_GAIN && near(2.0),
+              "deadline plan keeps the substitute's peak pass");
+    // Nothing applicable is degraded even when the budget cannot be met
+    DeadlinePolicy::Work analysisOnly;
+    analysisOnly.analysisSamples = 1000000;
+    SelfCheck(policy.Plan(analysisOnly, 0.0, predicted) == 0 && near(30.0), "deadline plan over budget");
+
+    // A slow observation raises the prediction; one below DEADLINE_MIN_SAMPLES is ignored
+    double before = policy.Predict(DeadlinePolicy::Analysis, 1000000);
+    policy.Observe(DeadlinePolicy::Analysis, DEADLINE_MIN_SAMPLES - 1, 1000.0);
+    SelfCheck(policy.Predict(DeadlinePolicy::Analysis, 1000000) == before, "deadline ignores short observations");
+    policy.Observe(DeadlinePolicy::Analysis, 1000000, 90.0);
+    SelfCheck(policy.Predict(DeadlinePolicy::Analysis, 1000000) > before &&
+              policy.Predict(DeadlinePolicy::Polyphase, 1000000) > 60.0, "deadline observation raises costs");
+}
 
-    wchar_t exePath[MAX_PATH] = {};
-    DWORD pathLen = GetModuleFileNameW(nullptr, exePath, MAX_PATH);
-    if (pathLen == 0 || pathLen >= MAX_PATH) return config;
+// Pattern parses to the given number of steps
+static bool ToneSteps(const char* pattern, size_t count) {
+    std::vector<ToneStep> steps;
+    return ParseTonePattern(pattern, steps) && steps.size() == count;
+}
 
-    if (!PathRemoveFileSpecW(exePath)) return config;
+static void SelfTestTonePattern() {
+    std::vector<ToneStep> steps;
+    SelfCheck(ParseTonePattern("880:150ms,660:150ms", steps) && steps.size() == 2 &&
+              steps[0].voices == 1 && steps[0].freqs[0] == 880.0f && steps[1].freqs[0] == 660.0f &&
+              steps[0].duration == 0.15f && !steps[0].bell, "tone two steps");
+    SelfCheck(ParseTonePattern("880:150,440:1.5s", steps) && steps[0].duration == 0.15f &&
+              steps[1].duration == 1.5f, "tone duration units");
+    SelfCheck(ParseTonePattern("880+1320+0:200ms:bell,0:100", steps) && steps[0].voices == 2 &&
+              steps[0].bell && steps[1].voices == 0, "tone chord, bell and rest");
+    SelfCheck(ParseTonePattern("880:1s:a2r30,880:1s:r100", steps) && steps[0].attack == 0.002f &&
+              steps[0].release == 0.03f && steps[1].attack == TONE_ATTACK && steps[1].release == 0.1f,
+              "tone attack and release");
+
+    // Nested groups expand innermost first and keep their order
+    SelfCheck(ParseTonePattern("((440:10ms)*3,0:5ms)*2,880:1ms", steps) && steps.size() == 9, "tone nested repeat");
+    bool order = steps.size() == 9;
+    for (size_t i = 0; order && i < 8; i++) order = steps[i].voices == (i % 4 == 3 ? 0u : 1u);
+    SelfCheck(order && steps[8].freqs[0] == 880.0f, "tone nested repeat order");
+
+    // Limits: nesting depth, expanded step count and total duration
+    std::string nested = "440:1ms";
+    for (int depth = 0; depth < TONE_MAX_DEPTH; depth++) nested = "(" + nested + ")*2";
+    SelfCheck(ToneSteps(nested.c_str(), 1u << TONE_MAX_DEPTH), "tone deepest nesting");
+    SelfCheck(!ToneSteps(("(" + nested + ")").c_str(), 1u << TONE_MAX_DEPTH), "tone nesting limit");
+    SelfCheck(ToneSteps("(440:1ms)*1024", TONE_MAX_STEPS), "tone step limit");
+    SelfCheck(!ToneSteps("(440:1ms)*1025", 1025) && !ToneSteps("((440:1ms)*32)*33", 1056), "tone step limit exceeded");
+    SelfCheck(ToneSteps("(440:1s)*30", 30) && !ToneSteps("(440:1s)*30,440:1ms", 31), "tone duration limit");
+
+    const char* invalid[] = {
+        "", "880", "880:", "880:0", "880:31s", "880:-5", "10:100", "880:100,", "880:100:foo", "880:100:",
+        "(880:100", "880:100)", "()", "880:100*0", "880:100*1.5", "100+200+300+400+500:100",
+        " 880:100", "+880:100", "0x370:100", "inf:100", "880:100ms:bellx", "880:100:r10a10",
+    };
+    for (const char* pattern : invalid) SelfCheck(!ParseTonePattern(pattern, steps), pattern);
+}
 
-    std::wstring dir(exePath);
-    dir += L'\\';
-    ParseTomlFile((dir + L"minply.toml").c_str(), config);
-    ParseTomlFile((dir + L"minply.local.toml").c_str(), config);
+static void SelfTestAdpcm() {
+    // Mono IMA: 4-byte header, then 4-byte groups of 8 nibbles
+    AdpcmFormat ima;
+    ima.tag = WAV_FORMAT_IMA_ADPCM;
+    ima.channels = 1;
+    ima.blockAlign = 36;
+    ima.samplesPerBlock = 65;
+    SelfCheck(AdpcmBlockFrames(ima, 36) == 65, "ima full block");
+    SelfCheck(AdpcmBlockFrames(ima, 10) == 9, "ima block truncated mid-group");
+    SelfCheck(AdpcmBlockFrames(ima, 4) == 1 && AdpcmBlockFrames(ima, 3) == 0, "ima block truncated in header");
+
+    std::vector<BYTE> block(36, 0);
+    block[0] = 0xE8;                     // Predictor 1000
+    block[1] = 0x03;
+    block[4] = 0x07;                     // First nibble: largest positive step at index 0 (+11)
+    std::vector<float> output(65, 0.0f);
+    DecodeImaBlock(block.data(), 65, 1, output.data());
+    SelfCheck(output[0] == 1000 / PCM16_SCALE && output[1] == 1011 / PCM16_SCALE, "ima decodes first nibble");
+    // An index past the step table is clamped to its last entry instead of reading beyond it
+    block[2] = 200;
+    block[4] = 0x00;
+    DecodeImaBlock(block.data(), 2, 1, output.data());
+    SelfCheck(output[1] == (1000 + (32767 >> 3)) / PCM16_SCALE, "ima clamps step index");
+
+    // The final block may be short; a block too short for its header holds no audio
+    std::vector<BYTE> data(36 + 10, 0);
+    std::vector<float> decoded;
+    SelfCheck(DecodeAdpcm(data.data(), data.size(), ima, SIZE_MAX, decoded) && decoded.size() == 65 + 9,
+              "ima short final block");
+    SelfCheck(!DecodeAdpcm(data.data(), 3, ima, SIZE_MAX, decoded), "ima rejects truncated header");
+
+    // Mono MS: predictor index, delta, two seed samples, then nibbles high first
+    AdpcmFormat ms;
+    ms.tag = WAV_FORMAT_MS_ADPCM;
+    ms.channels = 1;
+    ms.blockAlign = 15;
+    ms.samplesPerBlock = 18;
+    ms.coefs = { 256, 0, 512, -256, 0, 0, 192, 64, 240, 0, 460, -208, 392, -232 };
+    SelfCheck(AdpcmBlockFrames(ms, 15) == 18 && AdpcmBlockFrames(ms, 6) == 0, "ms block frames");
+
+    std::vector<BYTE> msBlock = { 0, 16, 0, 100, 0, 50, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    output.assign(18, 0.0f);
+    SelfCheck(DecodeMsBlock(msBlock.data(), 18, ms, output.data()) && output[0] == 50 / PCM16_SCALE &&
+              output[1] == 100 / PCM16_SCALE && output[17] == 100 / PCM16_SCALE, "ms decodes block");
+    msBlock[0] = 7;                      // One past the seven predictor pairs
+    SelfCheck(!DecodeMsBlock(msBlock.data(), 18, ms, output.data()), "ms rejects predictor index");
+    SelfCheck(!DecodeAdpcm(msBlock.data(), msBlock.size(), ms, SIZE_MAX, decoded), "ms adpcm rejects predictor index");
+}
 
-    return config;
+// Zip archive with one stored entry "a" and one deflated entry "b"; the central directory CRC of
+// "b" is taken from bCrc and the local header offset of "a" from aOffset when given
+static std::vector<BYTE> SelfTestZipArchive(const std::vector<BYTE>& content, const DWORD* bCrc, const DWORD* aOffset) {
+    std::vector<BYTE> deflated(compressBound(static_cast<uLong>(content.size())));
+    z_stream deflater = {};
+    deflateInit2(&deflater, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    deflater.next_in = const_cast<Bytef*>(content.data());
+    deflater.avail_in = static_cast<uInt>(content.size());
+    deflater.next_out = deflated.data();
+    deflater.avail_out = static_cast<uInt>(deflated.size());
+    deflate(&deflater, Z_FINISH);
+    deflated.resize(deflater.total_out);
+    deflateEnd(&deflater);
+    DWORD crc = crc32(0, content.data(), static_cast<uInt>(content.size()));
+
+    std::vector<BYTE> zip;
+    auto put = [&zip](DWORD value, int bytes) {
+        for (int i = 0; i < bytes; i++) zip.push_back(static_cast<BYTE>(value >> (8 * i)));
+    };
+    struct Record { char name; WORD method; const std::vector<BYTE>* data; DWORD offset; };
+    Record records[] = { { 'a', 0, &content, 0 }, { 'b', 8, &deflated, 0 } };
+    for (Record& record : records) {
+        record.offset = static_cast<DWORD>(zip.size());
+        put(0x04034b50, 4); put(20, 2); put(0, 2); put(record.method, 2); put(0, 4);
+        put(crc, 4); put(static_cast<DWORD>(record.data->size()), 4); put(static_cast<DWORD>(content.size()), 4);
+        put(1, 2); put(0, 2);
+        zip.push_back(static_cast<BYTE>(record.name));
+        zip.insert(zip.end(), record.data->begin(), record.data->end());
+    }
+    DWORD cdOffset = static_cast<DWORD>(zip.size());
+    for (const Record& record : records) {
+        DWORD entryCrc = record.name == 'b' && bCrc ? *bCrc : crc;
+        DWORD offset = record.name == 'a' && aOffset ? *aOffset : record.offset;
+        put(0x02014b50, 4); put(20, 2); put(20, 2); put(0, 2); put(record.method, 2); put(0, 4);
+        put(entryCrc, 4); put(static_cast<DWORD>(record.data->size()), 4); put(static_cast<DWORD>(content.size()), 4);
+        put(1, 2); put(0, 2); put(0, 2); put(0, 2); put(0, 2); put(0, 4); put(offset, 4);
+        zip.push_back(static_cast<BYTE>(record.name));
+    }
+    DWORD cdSize = static_cast<DWORD>(zip.size()) - cdOffset;
+    put(0x06054b50, 4); put(0, 2); put(0, 2); put(2, 2); put(2, 2); put(cdSize, 4); put(cdOffset, 4); put(0, 2);
+    return zip;
 }
 
-int wmain(int argc, wchar_t* argv[]) {
-    if (argc > 2) {
-        PrintError("Invalid arguments");
-        std::cerr << "Usage: minply.exe [audio file path | -]" << std::endl;
-        return ERR_INVALID_ARGS;
+// Write archive to path and read entry through ReadAhead; true when it opens and reads back as content
+static bool SelfTestZipRead(const std::wstring& path, const std::vector<BYTE>& archive, const wchar_t* entry,
+                            const std::vector<BYTE>& content) {
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+    DWORD written = 0;
+    bool ok = WriteFile(hFile, archive.data(), static_cast<DWORD>(archive.size()), &written, nullptr) &&
+              written == archive.size();
+    CloseHandle(hFile);
+    if (!ok) return false;
+
+    ReadAhead reader;
+    const char* message = nullptr;
+    return reader.Open((path + L":" + entry).c_str(), message) == EXIT_SUCCESS && reader.Ensure(reader.Size()) &&
+           reader.Size() == content.size() && memcmp(reader.Data(), content.data(), content.size()) == 0;
+}
+
+static void SelfTestZip() {
+    wchar_t dir[MAX_PATH];
+    DWORD length = GetTempPathW(MAX_PATH, dir);
+    if (length == 0 || length >= MAX_PATH) {
+        SelfCheck(false, "zip temporary directory");
+        return;
     }
+    std::wstring path = std::wstring(dir) + L"minply-selftest-" + std::to_wstring(GetCurrentProcessId()) + L".zip";
+
+    // Larger than READ_AHEAD_HEAD so the deflated entry is also inflated in the background
+    std::vector<BYTE> content(READ_AHEAD_HEAD + 5000);
+    for (size_t i = 0; i < content.size(); i++) content[i] = static_cast<BYTE>((i * 7) ^ (i >> 9));
+    SelfCheck(SelfTestZipRead(path, SelfTestZipArchive(content, nullptr, nullptr), L"a", content), "zip stored entry");
+    SelfCheck(SelfTestZipRead(path, SelfTestZipArchive(content, nullptr, nullptr), L"b", content), "zip deflated entry");
+
+    DWORD badCrc = crc32(0, content.data(), static_cast<uInt>(content.size())) ^ 1;
+    SelfCheck(!SelfTestZipRead(path, SelfTestZipArchive(content, &badCrc, nullptr), L"b", content), "zip crc mismatch");
+    // A local header offset into the central directory, and one that is not a local header at all
+    std::vector<BYTE> archive = SelfTestZipArchive(content, nullptr, nullptr);
+    DWORD pastData = static_cast<DWORD>(archive.size() - 22 - 2 * 47);
+    DWORD insideData = 40;
+    SelfCheck(!SelfTestZipRead(path, SelfTestZipArchive(content, nullptr, &pastData), L"a", content),
+              "zip local header past the data");
+    SelfCheck(!SelfTestZipRead(path, SelfTestZipArchive(content, nullptr, &insideData), L"a", content),
+              "zip local header signature");
+    DeleteFileW(path.c_str());
+}
 
-    AppConfig config = LoadConfig();
+// WAV with an fmt chunk, an odd-sized chunk and its pad byte, a bext chunk of bextSize bytes and
+// an empty data chunk
+static std::vector<BYTE> SelfTestBextWav(DWORD bextSize, WORD version, int16_t loudness, int16_t truePeak) {
+    std::vector<BYTE> wav;
+    auto put = [&wav](DWORD value, int bytes) {
+        for (int i = 0; i < bytes; i++) wav.push_back(static_cast<BYTE>(value >> (8 * i)));
+    };
+    auto tag = [&wav](const char* id) { wav.insert(wav.end(), id, id + 4); };
+    tag("RIFF"); put(0, 4); tag("WAVE");
+    tag("fmt "); put(16, 4); put(1, 2); put(2, 2); put(48000, 4); put(192000, 4); put(4, 2); put(16, 2);
+    tag("junk"); put(3, 4); put(0xFFFFFF, 3); wav.push_back(0);
+    tag("bext"); put(bextSize, 4);
+    size_t bext = wav.size();
+    wav.resize(bext + bextSize, 0xAB);
+    memcpy(&wav[bext + 346], &version, 2);
+    memcpy(&wav[bext + 412], &loudness, 2);
+    wav[bext + 414] = 0x00;              // LoudnessRange, between the two fields read
+    wav[bext + 415] = 0x80;
+    memcpy(&wav[bext + 416], &truePeak, 2);
+    if (bextSize & 1) wav.push_back(0);
+    tag("data"); put(0, 4);
+    DWORD riffSize = static_cast<DWORD>(wav.size() - 8);
+    memcpy(&wav[4], &riffSize, 4);
+    return wav;
+}
 
-    // Load audio data into buffer
-    //
-    // Argument resolution:
-    //   - argc == 1            : read from stdin if piped, else exit silently
-    //   - argv[1] == "-"       : read from stdin (error if empty)
-    //   - argv[1] == file path : read from file
-    std::vector<BYTE> inputData;
-    if (argc == 1) {
-        if (!ReadAllStdin(inputData)) {
-            return EXIT_SUCCESS;
+static void SelfTestBext() {
+    LoudnessMetadata metadata;
+    std::vector<BYTE> wav = SelfTestBextWav(602, 2, -2300, -100);
+    SelfCheck(ReadWavLoudnessMetadata(wav.data(), wav.size(), metadata) && metadata.loudness == -23.0 &&
+              metadata.hasTruePeak && fabsf(metadata.truePeak - powf(10.0f, -1.0f / 20.0f)) < 1e-6f &&
+              metadata.channels == 2, "bext loudness and true peak");
+
+    wav = SelfTestBextWav(418, 2, -1800, 0x7FFF);
+    SelfCheck(ReadWavLoudnessMetadata(wav.data(), wav.size(), metadata) && metadata.loudness == -18.0 &&
+              !metadata.hasTruePeak, "bext minimal chunk without true peak");
+    wav = SelfTestBextWav(417, 2, -1800, -100);
+    SelfCheck(!ReadWavLoudnessMetadata(wav.data(), wav.size(), metadata), "bext rejects a chunk without the peak field");
+    wav = SelfTestBextWav(602, 1, -2300, -100);
+    SelfCheck(!ReadWavLoudnessMetadata(wav.data(), wav.size(), metadata), "bext ignores version 1");
+    wav = SelfTestBextWav(602, 2, 0x7FFF, -100);
+    SelfCheck(!ReadWavLoudnessMetadata(wav.data(), wav.size(), metadata), "bext ignores unset loudness");
+
+    // A chunk size running past the end stops the walk before bext is reached
+    wav = SelfTestBextWav(602, 2, -2300, -100);
+    DWORD oversize = 0x7FFFFFF0;
+    memcpy(&wav[12 + 8 + 16 + 4], &oversize, 4);
+    SelfCheck(!ReadWavLoudnessMetadata(wav.data(), wav.size(), metadata), "bext stops at an oversized chunk");
+}
+
+static int RunSelfTest() {
+    SelfTestRice24();
+    SelfTestAdpcm();
+    SelfTestZip();
+    SelfTestBext();
+    SelfTestDeadlinePlan();
+    SelfTestTonePattern();
+    if (selfTestFailures == 0) std::cerr << "Self-test passed" << std::endl;
+    return selfTestFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif  // MINPLY_SELF_TEST
+
+int wmain(int argc, wchar_t* argv[]) {
+#ifdef MINPLY_SELF_TEST
+    if (argc == 2 && wcscmp(argv[1], L"--self-test") == 0) return RunSelfTest();
+#endif
+    // Options precede the positional inputs; "--" ends option parsing
+    bool timing = false;
+    bool raw = false;
+    bool framed = false;
+    bool deadlineSet = false;
+    UINT32 deadlineMs = 0;
+    const wchar_t* tonePattern = nullptr;
+    UINT32 rawFormat = 0, rawRate = 0, rawChannels = 0;
+    std::vector<const wchar_t*> inputs;
+    bool optionsEnded = false;
+    for (int i = 1; i < argc; i++) {
+        const wchar_t* arg = argv[i];
+        if (!optionsEnded && wcscmp(arg, L"--") == 0) {
+            optionsEnded = true;
         }
-    }
-    else if (wcscmp(argv[1], L"-") == 0) {
-        if (!ReadAllStdin(inputData)) {
-            PrintError("No input data on stdin");
-            return ERR_FILE_NOT_FOUND;
+        else if (!optionsEnded && wcscmp(arg, L"--timing") == 0) {
+            timing = true;
         }
-    }
-    else {
-        const wchar_t* filePath = argv[1];
-        if (GetFileAttributesW(filePath) == INVALID_FILE_ATTRIBUTES) {
-            PrintError("File not found");
-            return ERR_FILE_NOT_FOUND;
+        else if (!optionsEnded && wcscmp(arg, L"--raw") == 0) {
+            if (i + 1 >= argc || !ParseRawFormat(argv[i + 1], rawFormat, rawRate, rawChannels)) {
+                PrintError("Invalid --raw format (expected s16le|f32le:<rate>:<channels>)");
+                return ERR_INVALID_ARGS;
+            }
+            raw = true;
+            i++;
         }
-        HANDLE hFile = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr,
-                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-        if (hFile == INVALID_HANDLE_VALUE) {
-            PrintError("File not found");
-            return ERR_FILE_NOT_FOUND;
+        else if (!optionsEnded && wcscmp(arg, L"--framed") == 0) {
+            framed = true;
         }
-        LARGE_INTEGER fileSize;
-        if (!GetFileSizeEx(hFile, &fileSize)) {
-            CloseHandle(hFile);
-            PrintError("Failed to read file");
-            return ERR_FILE_NOT_FOUND;
+        else if (!optionsEnded && wcscmp(arg, L"--deadline") == 0) {
+            wchar_t* end = nullptr;
+            unsigned long ms = i + 1 < argc ? wcstoul(argv[i + 1], &end, 10) : 0;
+            if (i + 1 >= argc || end == argv[i + 1] || *end != L'\0' || ms > DEADLINE_MAX_MS) {
+                PrintError("Invalid --deadline (expected milliseconds, 0 to 60000)");
+                return ERR_INVALID_ARGS;
+            }
+            deadlineMs = static_cast<UINT32>(ms);
+            deadlineSet = true;
+            i++;
         }
-        if (fileSize.QuadPart == 0) {
-            CloseHandle(hFile);
-            PrintError("File is empty");
-            return ERR_FILE_NOT_FOUND;
+        else if (!optionsEnded && wcscmp(arg, L"--tone") == 0) {
+            if (i + 1 >= argc) {
+                PrintError("--tone needs a pattern");
+                return ERR_INVALID_ARGS;
+            }
+            tonePattern = argv[++i];
         }
-        // Guard against 4GB+ files: ReadFile takes DWORD, and notification sounds
-        // never approach this size in practice
-        if (fileSize.QuadPart > MAXDWORD) {
-            CloseHandle(hFile);
-            PrintError("File too large");
-            return ERR_DECODE_FAILED;
+        else if (!optionsEnded && wcsncmp(arg, L"--", 2) == 0) {
+            PrintError("Unknown option");
+            std::cerr << "Usage: minply.exe [--timing] [--deadline <ms>] [--raw <fmt>:<rate>:<channels> | --framed | --tone <pattern>] [audio file path ... | -]" << std::endl;
+            return ERR_INVALID_ARGS;
         }
-        inputData.resize(static_cast<size_t>(fileSize.QuadPart));
-        DWORD toRead = static_cast<DWORD>(fileSize.QuadPart);
-        DWORD bytesRead = 0;
-        bool readOk = ReadFile(hFile, inputData.data(), toRead, &bytesRead, nullptr);
-        CloseHandle(hFile);
-        if (!readOk || bytesRead != toRead) {
-            PrintError("Failed to read file");
-            return ERR_FILE_NOT_FOUND;
+        else {
+            inputs.push_back(arg);
         }
     }
-
-    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-    if (FAILED(hr)) {
-        PrintError("Failed to initialize COM");
-        return ERR_WASAPI_INIT;
+    // Several inputs are all files; stdin ("-") can only be the sole input
+    if (inputs.size() > 1 && std::any_of(inputs.begin(), inputs.end(),
+                                         [](const wchar_t* input) { return wcscmp(input, L"-") == 0; })) {
+        PrintError("Invalid arguments");
+        std::cerr << "Usage: minply.exe [--timing] [--deadline <ms>] [--raw <fmt>:<rate>:<channels> | --framed | --tone <pattern>] [audio file path ... | -]" << std::endl;
+        return ERR_INVALID_ARGS;
     }
+    const wchar_t* inputArg = inputs.empty() ? nullptr : inputs.front();
 
-    hr = MFStartup(MF_VERSION);
-    if (FAILED(hr)) {
-        PrintError("Failed to initialize Media Foundation");
-        CoUninitialize();
-        return ERR_DECODE_FAILED;
-    }
+    StageTimer timer(timing);
 
-    int exitCode = EXIT_SUCCESS;
+    // Every mode runs one session; --deadline overrides [pipeline] deadline in minply.toml
+    minply_options options = {};
+    options.flags = MINPLY_OPEN_HANDOFF | (timing ? MINPLY_OPEN_TIMING : 0) | (deadlineSet ? MINPLY_OPEN_DEADLINE : 0);
+    options.deadline_ms = deadlineMs;
 
-    WAVEFORMATEX* mixFormat = nullptr;
-    if (!GetDeviceMixFormat(&mixFormat)) {
-        PrintError("Failed to get device format");
-        exitCode = ERR_WASAPI_INIT;
-        MFShutdown();
+    if (tonePattern) {
+        if (raw || framed || !inputs.empty()) {
+            PrintError("--tone takes no input and cannot be combined with --raw or --framed");
+            return ERR_INVALID_ARGS;
+        }
+        return RunTone(tonePattern, options);
     }
-    else {
-        const BYTE* inputBytes = inputData.data();
-        size_t inputSize = inputData.size();
-
-        std::vector<float> decodedData;
-        bool decoded = false;
 
-        // Dispatch by magic bytes to avoid unnecessary decoder attempts
-        if (inputSize >= 12 && memcmp(inputBytes, "RIFF", 4) == 0 && memcmp(inputBytes + 8, "WAVE", 4) == 0) {
-            decoded = TryReadWavBuffer(inputBytes, inputSize, decodedData, mixFormat->nSamplesPerSec, mixFormat->nChannels);
+    if (framed) {
+        if (raw || inputs.size() > 1 || (inputArg && wcscmp(inputArg, L"-") != 0)) {
+            PrintError("--framed reads from stdin only and cannot be combined with --raw");
+            return ERR_INVALID_ARGS;
         }
-        if (!decoded && inputSize >= 4 && memcmp(inputBytes, "OggS", 4) == 0) {
-            decoded = TryDecodeOpusBuffer(inputBytes, inputSize, decodedData, mixFormat->nSamplesPerSec, mixFormat->nChannels);
+        return RunFramed(options);
+    }
+
+    // Raw PCM streams from stdin straight into the session; playback starts with the first block
+    if (raw) {
+        if (inputs.size() > 1 || (inputArg && wcscmp(inputArg, L"-") != 0)) {
+            PrintError("--raw reads from stdin only");
+            return ERR_INVALID_ARGS;
         }
-        if (!decoded) {
-            decoded = DecodeAudioBuffer(inputBytes, inputSize, decodedData, mixFormat->nSamplesPerSec, mixFormat->nChannels);
+        minply_session* session = nullptr;
+        int exitCode = minply_open(&options, &session);
+        if (exitCode != MINPLY_OK) return exitCode;
+
+        int playResult = MINPLY_OK;
+        minply_stream* stream = nullptr;
+        exitCode = minply_stream_open(session, rawFormat, rawRate, rawChannels,
+                                      [](void* context, int result) { *static_cast<int*>(context) = result; },
+                                      &playResult, &stream);
+        if (exitCode == MINPLY_OK) {
+            exitCode = StreamStdin(stream);
+            minply_stream_close(stream);
+            if (exitCode == ERR_FILE_NOT_FOUND) PrintError("No input data on stdin");
         }
+        minply_close(session);
+        return exitCode != MINPLY_OK ? exitCode : playResult;
+    }
 
-        MFShutdown();
+    // Several files play back to back in one session, read concurrently
+    if (inputs.size() > 1) {
+        return RunBatch(inputs, options, timer);
+    }
 
-        if (!decoded) {
-            PrintError("Failed to decode audio");
-            exitCode = ERR_DECODE_FAILED;
+    // Load audio data into buffer
+    //
+    // Argument resolution:
+    //   - no input argument    : read from stdin if piped, else exit silently
+    //   - input == "-"         : read from stdin (error if empty)
+    //   - input == file path   : read by the session while it decodes (minply_play_file)
+    StdinInput stdinInput;
+    bool fromFile = inputArg && wcscmp(inputArg, L"-") != 0;
+    if (!inputArg) {
+        if (!stdinInput.Read()) {
+            return EXIT_SUCCESS;
         }
-        else {
-            if (config.loudnessEnabled) {
-                NormalizeLoudness(decodedData, mixFormat->nSamplesPerSec, mixFormat->nChannels,
-                                  config.loudnessTarget, config.loudnessPeakCeiling);
-            }
-
-            ApplyFade(decodedData, mixFormat->nSamplesPerSec, mixFormat->nChannels);
-
-            std::vector<float> leadIn, leadOut;
-            if (config.guardEnabled) {
-                leadIn = GenerateBleGuard(mixFormat->nSamplesPerSec, mixFormat->nChannels,
-                                          config.leadInDuration, config.guardFrequency, config.guardAmplitude);
-                leadOut = GenerateBleGuard(mixFormat->nSamplesPerSec, mixFormat->nChannels,
-                                           config.leadOutDuration, config.guardFrequency, config.guardAmplitude);
-            }
-
-            if (!PlayAudio(decodedData, mixFormat, leadIn, leadOut)) {
-                PrintError("Failed to play audio");
-                exitCode = ERR_PLAYBACK_FAILED;
-            }
+    }
+    else if (!fromFile) {
+        if (!stdinInput.Read()) {
+            PrintError("No input data on stdin");
+            return ERR_FILE_NOT_FOUND;
         }
-
-        CoTaskMemFree(mixFormat);
+    }
+    if (!fromFile) {
+        timer.Mark("read");
+        if (timer.Enabled()) std::cerr << "Input: " << stdinInput.Size() << " bytes" << std::endl;
     }
 
-    CoUninitialize();
+    // Thin client of the in-process API: one session, one sound, wait for completion.
+    // MINPLY_OPEN_HANDOFF lets concurrently launched processes funnel into one renderer.
+    // The session is opened first so device discovery overlaps the file's header read.
+    minply_session* session = nullptr;
+    int exitCode = minply_open(&options, &session);
+    if (exitCode != MINPLY_OK) return exitCode;
+
+    int playResult = MINPLY_OK;
+    auto onComplete = [](void* context, int result) { *static_cast<int*>(context) = result; };
+    if (fromFile) {
+        exitCode = minply_play_file(session, inputArg, 0, onComplete, &playResult);
+        timer.Mark("open");
+    }
+    else {
+        exitCode = minply_play(session, stdinInput.Data(), stdinInput.Size(), 0, onComplete, &playResult);
+    }
+    minply_close(session);
 
-    return exitCode;
+    return exitCode != MINPLY_OK ? exitCode : playResult;
 }
+
+#endif  // MINPLY_BUILD_DLL
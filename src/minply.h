@@ -0,0 +1,152 @@
+/*
+ * minply - Minimal Audio Player
+ *
+ * In-process playback API (C ABI)
+ *
+ * A session keeps one WASAPI shared-mode output client open for its lifetime and plays
+ * submitted sounds asynchronously, in submission order, through the same decode, loudness,
+ * fade and BLE guard pipeline as minply.exe. Completion is reported through a callback
+ * invoked on one of the session's two threads: the worker thread for sounds that fail while
+ * being read, decoded or processed, the render thread for everything else.
+ *
+ * Typical use:
+ *   minply_session* session;
+ *   if (minply_open(NULL, &session) == MINPLY_OK) {
+ *       minply_play(session, data, size, 0, on_done, ctx);
+ *       ...
+ *       minply_close(session);   // waits until every submitted sound has completed
+ *   }
+ *
+ * Build:
+ *   minply.dll is built from src/minply.cpp with MINPLY_BUILD_DLL defined.
+ *   minply.exe compiles the same source as a static client of this API.
+ */
+
+#ifndef MINPLY_H
+#define MINPLY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(MINPLY_BUILD_DLL)
+#define MINPLY_API __declspec(dllexport)
+#elif defined(MINPLY_STATIC)
+#define MINPLY_API
+#else
+#define MINPLY_API __declspec(dllimport)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Result codes; identical to the exit codes of minply.exe */
+#define MINPLY_OK               0
+#define MINPLY_E_INVALID_ARG    1
+#define MINPLY_E_FILE           2
+#define MINPLY_E_DECODE         3
+#define MINPLY_E_DEVICE         4
+#define MINPLY_E_PLAYBACK       5
+
+/* minply_options.flags */
+#define MINPLY_OPEN_TIMING      0x1u   /* Print per-stage timings to stderr */
+#define MINPLY_OPEN_HANDOFF     0x2u   /* Hand sounds to another process's renderer when one is active */
+#define MINPLY_OPEN_DEADLINE    0x4u   /* Use deadline_ms instead of [pipeline] deadline in minply.toml */
+
+/* minply_play flags */
+#define MINPLY_PLAY_COPY        0x1u   /* Copy the input into a pooled buffer; the caller may free it on return */
+#define MINPLY_PLAY_NO_LOUDNESS 0x2u   /* Play at the file's own level, skipping loudness normalization */
+
+/* minply_stream_open sample formats (little-endian, interleaved) */
+#define MINPLY_FORMAT_S16LE     1u
+#define MINPLY_FORMAT_F32LE     2u
+
+typedef struct minply_session minply_session;
+typedef struct minply_stream minply_stream;
+
+typedef struct minply_options {
+    uint32_t flags;                    /* MINPLY_OPEN_* */
+    uint32_t deadline_ms;              /* Submission-to-playback budget under MINPLY_OPEN_DEADLINE; 0 disables.
+                                        * When a sound would miss it, loudness analysis and resampling
+                                        * quality are degraded in that order. */
+} minply_options;
+
+typedef struct minply_stats {
+    uint64_t submitted;                /* Sounds accepted by minply_play / minply_enqueue */
+    uint64_t played;                   /* Sounds rendered to the device by this session */
+    uint64_t handed_off;               /* Sounds handed to another process's renderer */
+    uint64_t failed;                   /* Sounds completed with an error */
+    uint32_t pending;                  /* Submitted and not yet completed */
+    uint32_t sample_rate;              /* Device mix format; 0 until the device has been opened */
+    uint32_t channels;
+    uint32_t reserved;
+    double   last_process_ms;          /* Decode and processing time of the most recent sound */
+    double   last_start_latency_ms;    /* Submission (first write for streams) to first frame written */
+} minply_stats;
+
+/* Invoked once per submitted sound with its MINPLY_* result, on the session's worker thread
+ * (failures before playback) or render thread (all other results). The two threads may run
+ * callbacks concurrently, so state they share needs its own locking. A callback must return
+ * promptly and must not call minply_close. */
+typedef void (*minply_completion_fn)(void* context, int result);
+
+/* Open a session. Device discovery and activation run in the background so the first
+ * submission can start decoding immediately. Configuration is read from minply.toml and
+ * minply.local.toml next to the host executable. */
+MINPLY_API int minply_open(const minply_options* options, minply_session** session);
+
+/* Decode and play an encoded sound (WAV, Opus, or anything Media Foundation decodes).
+ * Without MINPLY_PLAY_COPY the data must stay valid until the completion callback runs. */
+MINPLY_API int minply_play(minply_session* session, const void* data, size_t size, uint32_t flags,
+                           minply_completion_fn callback, void* context);
+
+/* Decode and play a file. The first 64 KB are read before returning, so a missing or unreadable
+ * file fails here; the rest is read in the background while the decoder consumes it.
+ * "pack.zip:path/in/zip" plays an entry of a zip archive without extracting it. */
+MINPLY_API int minply_play_file(minply_session* session, const wchar_t* path, uint32_t flags,
+                                minply_completion_fn callback, void* context);
+
+/* Play interleaved float PCM through the same loudness, fade and guard stages.
+ * The samples must stay valid until the completion callback runs. */
+MINPLY_API int minply_enqueue(minply_session* session, const float* samples, size_t frames,
+                              uint32_t sample_rate, uint32_t channels,
+                              minply_completion_fn callback, void* context);
+
+/* Synthesize and play a tone pattern through the same fade and guard stages, with no input to read
+ * or decode. Comma-separated steps "<Hz>[+<Hz>...]:<duration>[:<envelope>]" play in order; a
+ * duration is in ms unless it ends in "s", 0 Hz is a rest, the envelope is "bell" or "a<ms>r<ms>"
+ * (attack, release), and "(...)*<n>" repeats a group, e.g. "880:150ms,660:150ms". The level is set
+ * from the [loudness] target without measuring. MINPLY_E_INVALID_ARG for a malformed pattern. */
+MINPLY_API int minply_play_tone(minply_session* session, const char* pattern,
+                                minply_completion_fn callback, void* context);
+
+/* Play headerless PCM written incrementally. The stream takes its place in the submission order;
+ * each written block is converted and played as soon as it arrives. Loudness normalization is not
+ * applied to streams; a [tempo] rate is. The callback runs once minply_stream_close has been called and the stream has
+ * played out. Blocks until the device format is known. */
+MINPLY_API int minply_stream_open(minply_session* session, uint32_t format, uint32_t sample_rate,
+                                  uint32_t channels, minply_completion_fn callback, void* context,
+                                  minply_stream** stream);
+
+/* Append raw sample bytes; a partial trailing frame is kept for the next write.
+ * Converted audio is buffered about 4 seconds ahead of playback; beyond that the call blocks
+ * until the stream has played far enough to make room. */
+MINPLY_API int minply_stream_write(minply_stream* stream, const void* data, size_t size);
+
+/* Mark the end of the stream and release the handle; playback continues to the end */
+MINPLY_API void minply_stream_close(minply_stream* stream);
+
+/* Snapshot session counters */
+MINPLY_API int minply_stats_get(minply_session* session, minply_stats* stats);
+
+/* Wait until every submitted sound has completed, then release the session.
+ * Must not be called from a completion callback: it waits for the thread running the callback,
+ * which deadlocks. Every minply_stream of the session must be closed first; an open stream never
+ * completes, so minply_close would block forever. */
+MINPLY_API void minply_close(minply_session* session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MINPLY_H */